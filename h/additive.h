@@ -0,0 +1,35 @@
+#pragma once
+#include "simd.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// additive voices: a note is the sum of up to ADDITIVE_MAX_PARTIALS sine
+// partials. each partial is a complex phasor multiplied by a fixed rotation
+// every sample, four partials per vector, so the cost is a handful of
+// multiplies per partial and sample and no sinf at all
+
+#define ADDITIVE_MAX_PARTIALS 2048
+#define ADDITIVE_VECTORS 4 // rendered together, see additiveRender
+#define ADDITIVE_LANES (ADDITIVE_VECTORS * SIMD_WIDTH)
+// floats per voice in the pool initSynth allocates
+#define ADDITIVE_VOICE_FLOATS (6 * ADDITIVE_MAX_PARTIALS)
+
+typedef struct Additive {
+  int count;  // partials in the spectrum, 0 is off
+  int active; // partials below nyquist, rounded up to ADDITIVE_LANES
+  float freq; // the rotations are for this fundamental
+  // ADDITIVE_MAX_PARTIALS each, carved out of one pool
+  float *re, *im;         // phasor, im is the output
+  float *rot_re, *rot_im; // per sample rotation
+  float *level;           // spectrum amplitude
+  float *ratio;           // partial freq over the fundamental
+} Additive;
+
+// points the arrays at ADDITIVE_VOICE_FLOATS floats of mem, 16 byte aligned
+void additiveInit(Additive *a, float *mem);
+// spectrum of count partials, partial k at k * sqrt(1 + stretch * k^2) times
+// the fundamental with amplitude k^-tilt, scaled to the power of one sine
+void additiveStart(Additive *a, int count, float tilt, float stretch);
+// adds n samples to out, scratch holds n * SIMD_WIDTH floats
+void additiveRender(Additive *a, float freq, int sample_rate, float *out,
+                    float *scratch, size_t n);
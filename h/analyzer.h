@@ -0,0 +1,45 @@
+#pragma once
+#include "hash.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// spectrum analyzer. the audio thread only copies each finished block into a
+// ring, windowing, fft and binning happen on the analyzer thread, which
+// streams one frame of log spaced magnitudes to every client at a fixed rate
+
+#define ANALYZER_DEFAULT_PORT 5001 // 0 disables the analyzer
+#define ANALYZER_RING_SIZE 65536   // published samples, power of two
+#define ANALYZER_MIN_FFT 256
+#define ANALYZER_MAX_FFT 8192
+#define ANALYZER_MAX_BINS 256
+#define ANALYZER_MAX_CLIENTS 8
+// windows averaged into one frame, a slow analyzer drops the older ones
+#define ANALYZER_MAX_WINDOWS 8
+#define ANALYZER_FLOOR_DB -96.0f // bin value 0, 255 is 0 dBFS
+#define ANALYZER_MAGIC 0x43455053 // "SPEC" little endian
+
+typedef struct analyzer_cfg {
+  int port;
+  int fft_size;    // power of two, ANALYZER_MIN_FFT..ANALYZER_MAX_FFT
+  float overlap;   // between successive windows, 0 to 0.9375
+  int frame_rate;  // frames per second sent to clients
+  int bins;        // log spaced from min_freq to nyquist
+  float min_freq;
+} analyzer_cfg_t;
+
+// every frame on the wire is this header followed by bins bytes
+typedef struct spectrum_frame_header {
+  uint64_t sample_time; // end of the newest window
+  uint32_t magic;
+  uint32_t frame;
+  float min_freq;
+  float max_freq;
+  uint16_t bins;
+  uint16_t windows; // windows averaged into this frame
+  uint32_t reserved;
+} spectrum_frame_header_t;
+
+void analyzer_defaults(analyzer_cfg_t *cfg);
+void analyzer_apply_config(analyzer_cfg_t *cfg, hash_t *config);
+void analyzer_publish(const float *signal, size_t n);
+void analyzer_start(const analyzer_cfg_t *cfg, int sample_rate);
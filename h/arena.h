@@ -0,0 +1,22 @@
+#pragma once
+#include <stddef.h>
+
+// bump allocator, everything is released at once with arena_free
+// allocations never move, chunks are chained when one fills up
+
+#define ARENA_MIN_CHUNK 4096
+
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  size_t used;
+  size_t size;
+  char data[];
+} arena_chunk_t;
+
+typedef struct arena {
+  arena_chunk_t *head;
+} arena_t;
+
+void *arena_alloc(arena_t *a, size_t size);
+char *arena_strndup(arena_t *a, const char *s, size_t len);
+void arena_free(arena_t *a);
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+// audio output. the render loop hands every finished block to one backend,
+// picked by name from audio.backend or --backend, "name" or "name:arg"
+//   portaudio          default output device
+//   null               discards, never waits, for benchmarking
+//   null:paced         discards at the real time rate
+//   wav:path           float wav file at the real time rate
+//   shm:name           posix shared memory ring, see shmring.h
+// blocks are interleaved frames of the configured number of channels
+
+typedef enum BackendStatus {
+  BACKEND_OK = 0,
+  BACKEND_XRUN,  // the block was late, output had a gap
+  BACKEND_ERROR, // the backend is unusable
+} BackendStatus;
+
+typedef struct audio_backend {
+  const char *name;
+  bool (*open)(struct audio_backend *b, const char *arg, int sample_rate,
+               size_t buffer_size, int channels);
+  // blocks until the device or the clock is ready for the next block
+  BackendStatus (*write)(struct audio_backend *b, const float *block,
+                         size_t frames);
+  void (*close)(struct audio_backend *b);
+  void *state;
+} audio_backend_t;
+
+// NULL and an error logged for an unknown name or a failed open
+audio_backend_t *backend_open(const char *spec, int sample_rate,
+                              size_t buffer_size, int channels);
+void backend_close(audio_backend_t *b);
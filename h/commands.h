@@ -1,8 +1,11 @@
 #pragma once
 #include <stdbool.h>
+#include "events.h"
+#include "snapshot.h"
 #include "synth.h"
 
-typedef void (*command_fn)(char *);
+// arg is the command tail, channel the optional third word, 0 if missing
+typedef void (*command_fn)(char *arg, int channel);
 
 typedef struct command_map {
     char *command;
@@ -12,9 +15,28 @@ typedef struct command_map {
 typedef struct key_state {
     bool val;
     bool change;
+    bool retrigger; // a sequencer note on, restarts a sounding voice
 } key_state_t; 
 
-void key_pressed(char* userdata);
-void key_released(char* userdata);
+void key_pressed(char* userdata, int channel);
+void key_released(char* userdata, int channel);
+void stats(char *userdata, int channel);
+void set_tuning(char *userdata, int channel);
+void sequencer_transport(char *userdata, int channel);
+void write_profile(char *userdata, int channel);
+void save_snapshot(char *userdata, int channel);
+void program_change(char *userdata, int channel);
 command_fn find_function_by_command(const char *command);
-void handle_keys(Synth *synth);
\ No newline at end of file
+void applyEvent(Synth *synth, const synth_event_t *ev);
+bool scheduleEvent(const synth_event_t *ev);
+// free slots in the schedule, for callers that need several at once
+size_t scheduleRoom(void);
+void drainEvents(Synth *synth);
+uint64_t applyDueEvents(Synth *synth, uint64_t time);
+void resetKeys(void);
+void clearSchedule(void);
+void saveEventState(snap_buf_t *b);
+bool loadEventState(snap_buf_t *b);
+// starts and releases voices for the keys that changed, time is the sample
+// the block segment starts at
+void handle_keys(Synth *synth, uint64_t time);
\ No newline at end of file
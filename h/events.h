@@ -0,0 +1,84 @@
+#pragma once
+#include "params.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// control events travel from the control threads to the audio thread through
+// single producer rings. the audio thread stamps each one with the sample
+// clock when it is applied, which is also what the event log records
+
+#define EVENT_QUEUE_SIZE 1024 // power of two
+#define EVENT_PENDING_SIZE 4096 // scheduled events waiting for their time
+// slots script events can not take, so live input still gets scheduled while
+// a long synth::submit waits for its turn
+#define EVENT_PENDING_RESERVED 256
+#define EVENT_LOG_MAGIC 0x56455354 // "TSEV"
+#define EVENT_LOG_VERSION 4
+#define EVENT_LOG_FTZ 1u // recorded with flush to zero, see rt_set_ftz_daz
+
+typedef enum EventType {
+  EVENT_NOTE_ON = 1,
+  EVENT_NOTE_OFF,
+  EVENT_PROGRAM,
+  EVENT_PARAM, // note is the PatchParam
+  // per note expression, note is the key, held until the next one
+  EVENT_BEND,     // semitones
+  EVENT_PRESSURE, // 0 to 1
+  EVENT_TIMBRE,   // -1 to 1, 0 is the patch as written
+} EventType;
+
+typedef enum EventFlag {
+  // played by the sequencer: not taken by the arpeggiator, and a note on
+  // restarts the envelope of a key that is still sounding
+  EVENT_FLAG_SEQUENCER = 1,
+} EventFlag;
+
+typedef struct synth_event {
+  uint64_t time; // sample clock, 0 on the control side means as soon as possible
+  uint8_t type;  // EventType
+  uint8_t note;  // key index
+  uint8_t channel; // parts listening on it receive the event
+  uint8_t flags; // EventFlag
+  float value; // program number or parameter value
+} synth_event_t;
+
+typedef struct event_queue {
+  _Atomic size_t head; // consumer
+  _Atomic size_t tail; // producer
+  synth_event_t events[EVENT_QUEUE_SIZE];
+} event_queue_t;
+
+// socket commands and tcl scripts, one producer each
+extern event_queue_t g_control_events;
+extern event_queue_t g_script_events;
+// sample clock at the end of the last rendered block, for scheduling
+extern _Atomic uint64_t g_sample_clock;
+// samples between rendering an event and hearing it, the master bus delay.
+// schedule this much earlier to line up with something outside the synth
+extern _Atomic uint32_t g_output_latency;
+
+bool event_push(event_queue_t *q, const synth_event_t *ev);
+bool event_pop(event_queue_t *q, synth_event_t *ev);
+size_t event_queue_depth(event_queue_t *q);
+
+// the log file starts with everything needed to render the same output
+typedef struct event_log_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sample_rate;
+  uint32_t buffer_size;
+  uint32_t channels;
+  uint32_t flags; // EVENT_LOG_*
+  synth_params_t params;
+} event_log_header_t;
+
+bool event_record_start(const char *path, int sample_rate, size_t buffer_size,
+                        int channels, uint32_t flags,
+                        const synth_params_t *params);
+void event_record(const synth_event_t *ev);
+void event_record_stop(void);
+
+synth_event_t *event_log_read(const char *path, event_log_header_t *header,
+                              size_t *count);
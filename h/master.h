@@ -0,0 +1,66 @@
+#pragma once
+#include "oversample.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// master bus: an optional 2x oversampled soft clipper followed by a look
+// ahead peak limiter, run on the finished block. the limiter delays the
+// output by its look ahead, so the gain is already down when a peak
+// arrives, and the output never goes above the ceiling. with more than one
+// channel the clipper runs per channel and the limiter is linked, every
+// channel gets the gain the loudest one needs
+
+#define MASTER_MAX_LOOKAHEAD 512 // samples, 5 ms at 96 kHz fits
+// through the clipper's half-band interpolator and decimator it is 14.5
+// samples, rounded up
+#define MASTER_CLIPPER_LATENCY 15
+#define MAX_CHANNELS 8 // output channels, the bus keeps state for each
+
+typedef struct master_params {
+  bool limiter;
+  float ceiling;      // dBFS
+  float lookahead_ms; // also the added latency
+  float release_ms;   // time for the gain to recover by about 63%
+  bool clipper;
+  float drive; // dB into the clipper
+} master_params_t;
+
+typedef struct MasterBus {
+  master_params_t params;
+  int lookahead; // samples
+  int latency;   // samples from render to output, lookahead plus clipper
+  float ceiling; // linear
+  float release; // per sample coefficient
+  float drive;   // linear
+  int channels;
+
+  // per channel the last lookahead input samples, the rest of the block
+  // follows them. channel c starts at history + c * history_stride
+  float *history;
+  size_t history_stride; // MASTER_MAX_LOOKAHEAD + block length
+
+  // sliding minimum of the needed gain over lookahead + 1 samples, a
+  // monotonic deque so each sample costs O(1)
+  float min_value[MASTER_MAX_LOOKAHEAD + 1];
+  uint64_t min_index[MASTER_MAX_LOOKAHEAD + 1];
+  int min_head, min_count;
+  uint64_t index;
+
+  float follower; // released minimum
+  // moving average over lookahead samples, smooths the gain into a ramp
+  float box[MASTER_MAX_LOOKAHEAD];
+  float box_sum;
+  int box_pos;
+
+  HalfbandDecimator up[MAX_CHANNELS], down[MAX_CHANNELS];
+} MasterBus;
+
+void masterDefaults(master_params_t *p);
+// takes new params, state is only reset when the latency changes. returns
+// true if it did
+bool masterConfigure(MasterBus *m, const master_params_t *p, int sample_rate);
+// in place on planar channels stride floats apart, scratch holds 2 * n
+// floats
+void masterProcess(MasterBus *m, float *signal, size_t stride, float *scratch,
+                   size_t n);
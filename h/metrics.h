@@ -0,0 +1,61 @@
+#pragma once
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_DEFAULT_PORT 9464 // prometheus text endpoint, 0 disables it
+#define METRICS_EMA_WEIGHT 0.05f  // smoothing of the average dsp load
+
+typedef enum MetricsQueue {
+  QUEUE_LOG = 0, // per thread log rings, deepest one
+  QUEUE_EVENTS,  // control events waiting for the audio thread
+  QUEUE_SCRIPT,  // tcl script events waiting for the audio thread
+  QUEUE_PENDING, // events scheduled for a later sample time
+  QUEUE_COUNT
+} MetricsQueue;
+
+typedef struct queue_metrics {
+  _Atomic size_t depth;
+  _Atomic size_t high_water;
+} queue_metrics_t;
+
+// written by the audio and networking threads with relaxed atomics, read by
+// whoever formats them, nothing here takes a lock
+typedef struct engine_metrics {
+  _Atomic uint64_t blocks;
+  _Atomic float dsp_load; // render time of the last block, % of its deadline
+  _Atomic float dsp_load_avg;
+  _Atomic float dsp_load_peak;
+  _Atomic uint64_t xruns; // output underflows reported by the backend
+
+  _Atomic uint32_t active_voices;
+  _Atomic uint32_t active_voices_peak;
+
+  queue_metrics_t queues[QUEUE_COUNT];
+
+  _Atomic uint64_t net_bytes_in;
+  _Atomic uint64_t net_bytes_out;
+
+  _Atomic uint64_t analyzer_frames;
+  _Atomic uint64_t analyzer_frames_skipped; // late frames and full sockets
+  _Atomic uint32_t analyzer_clients;
+
+  _Atomic uint64_t recorder_bytes;    // sample data in the current file
+  _Atomic uint64_t recorder_overruns; // frames dropped for a full ring
+
+  int sample_rate;
+  size_t buffer_size;
+} engine_metrics_t;
+
+extern engine_metrics_t g_metrics;
+
+void metrics_init(int sample_rate, size_t buffer_size);
+void metrics_record_block(uint64_t render_ns, uint32_t active_voices);
+void metrics_record_xrun(void);
+void metrics_queue_depth(MetricsQueue q, size_t depth);
+void metrics_net_in(size_t bytes);
+void metrics_net_out(size_t bytes);
+
+size_t metrics_format_text(char *buf, size_t size);
+size_t metrics_format_prometheus(char *buf, size_t size);
+void metrics_start_http(int port);
@@ -0,0 +1,19 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "simd.h"
+
+// numerically controlled oscillator, phase is a uint32 that wraps for free
+// https://zipcpu.com/dsp/2017/12/09/nco.html
+
+#define NCO_TABLE_BITS 11
+#define NCO_TABLE_SIZE (1 << NCO_TABLE_BITS)
+#define NCO_FRAC_BITS (32 - NCO_TABLE_BITS)
+#define NCO_PHASE_SCALE (1.0f / 4294967296.0f) // 2^-32, uint32 phase to [0,1)
+
+void initNCOTables(void);
+uint32_t ncoPhaseIncrement(float freq, int sample_rate);
+void ncoPhaseBlock(uint32_t *phases, uint32_t *acc, uint32_t inc, size_t n);
+float ncoSine(uint32_t phase);
+void ncoSineBlock(float *out, const uint32_t *phases, size_t n);
+v4f ncoSineV4(v4u phase);
@@ -2,6 +2,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/select.h>
@@ -9,6 +10,15 @@
 #define PORT 5000
 #define MSG_BUFFER_SIZE 1024
 
+// everything sent to the client is framed: a type byte, the payload length
+// as 32 bit big endian, then the payload. see tcl/networking.tcl
+#define NET_FRAME_HEADER 5
+#define NET_FRAME_MAX 4096 // payload bytes
+enum {
+  NET_FRAME_SCOPE = 0, // int8 samples of the first channel, decimated
+  NET_FRAME_TEXT = 1,  // reply to a command
+};
+
 typedef struct network_cfg {
   int server_fd;
   int client_fd;
@@ -22,4 +32,17 @@ typedef struct network_cfg {
   fd_set readfds;
   int max_sd;
 
-} network_cfg_t;
\ No newline at end of file
+  // SIGINT and SIGTERM, read in the loop like the sockets
+  int signal_fd;
+
+  // decimated scope data, sized from the synth block length at startup
+  int8_t *scope_buffer;
+  size_t scope_length;
+
+  // the frame being sent, a non-blocking send may take only part of it
+  char out[NET_FRAME_HEADER + NET_FRAME_MAX];
+  size_t out_sent, out_pending;
+
+} network_cfg_t;
+
+void net_reply(const char *data, size_t len);
@@ -1,11 +1,11 @@
 #pragma once
 #include "math.h"
 #include "stddef.h"
+#include "stdbool.h"
+#include "stdint.h"
 
-#define SAMPLE_RATE 44100
-#define SAMPLE_DURATION (1.0f / SAMPLE_RATE)
-#define STREAM_BUFFER_SIZE 1024
-#define NUM_OSCILLATORS 32
+#define NUM_OSCILLATORS 32 // voice pool shared by all parts
+#define NUM_KEYS 12
 #define BASE_NOTE_FREQ 440
 
 typedef enum ADSR_state_t {
@@ -30,6 +30,8 @@ typedef struct ADSR {
 typedef struct Oscillator {
   float phase;
   float phase_dt;
+  uint32_t phase_acc; // nco mode, phase as a fraction of 2^32
+  uint32_t phase_inc;
   float freq;
   float amplitude;
   float shape_parameter_0;
@@ -42,7 +44,7 @@ typedef struct OscillatorArray {
 } OscillatorArray;
 
 Oscillator *makeOscillator(OscillatorArray *oscArray);
-void updateOsc(Oscillator *osc, float freq_modulation);
+void updateOsc(Oscillator *osc, float freq_modulation, float sample_duration);
 void updateADSR(ADSR *envelope, float delta_time);
 void clearOscillatorArray(OscillatorArray *oscArray);
 float bandlimitedRipple(float phase, float phase_dt);
@@ -56,6 +58,8 @@ float triangleShape(const Oscillator osc);
 float squareShape(const Oscillator osc);
 float roundedSquareShape(const Oscillator osc);
 
+bool shapeNeedsOversampling(WaveShapeFn fn);
+
 static float getFrequencyForSemitone(float semitone) {
   // fn = 2^(n/12) × 440 Hz
   // 2^(n/12) <-- semitone value to a freq ratio
@@ -67,8 +71,32 @@ static float getSemitoneForFrequency(float freq) {
   return 12.f * log2f(freq / BASE_NOTE_FREQ);
 }
 
+// cheap deterministic noise for note starts, each note seeds its own state
+// so a replay draws the same numbers
+static inline uint32_t xorshift32(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
 #define ENVELOPE_DEFAULT_ATTACK_TIME (0.1f * 5) // 100 ms
 #define ENVELOPE_DEFAULT_DECAY_TIME (0.2f * 5)  // 200 ms
 #define ENVELOPE_DEFAULT_SUSTAIN_LEVEL 0.7f // 70% of the peak amplitude
 #define ENVELOPE_DEFAULT_SUSTAIN_TIME (0.3f * 100)
-#define ENVELOPE_DEFAULT_RELEASE_TIME (0.3f * 100) // 300 ms
\ No newline at end of file
+#define ENVELOPE_DEFAULT_RELEASE_TIME (0.3f * 100) // 300 ms
+#define ENVELOPE_SUSTAIN_GLIDE 0.001f // per sample, about 20 ms
+
+// stable ids for the shapes, stored in compiled patches
+typedef enum ShapeId {
+  SHAPE_SINE = 0,
+  SHAPE_SAWTOOTH,
+  SHAPE_SQUARE,
+  SHAPE_TRIANGLE,
+  SHAPE_ROUNDED_SQUARE,
+  SHAPE_COUNT
+} ShapeId;
+
+WaveShapeFn shapeFromId(ShapeId id);
+int shapeIdFromName(const char *name);
@@ -0,0 +1,35 @@
+#pragma once
+#include "stddef.h"
+
+// 31 tap half-band lowpass, only the centre tap and the odd offsets from it
+// are nonzero, so one decimated output costs HALFBAND_PAIRS multiplies
+#define HALFBAND_TAPS 31
+#define HALFBAND_PAIRS 8
+#define OVERSAMPLE_MAX_FACTOR 8
+#define OVERSAMPLE_MAX_STAGES 3
+// harmonics of the fundamental that should stay below nyquist before a voice
+// is oversampled, see chooseOversampleFactor
+#define OVERSAMPLE_HARMONICS 32
+
+typedef enum OversampleMode {
+  OVERSAMPLE_OFF = 0,
+  OVERSAMPLE_VOICE, // per voice, factor picked from the note frequency
+  OVERSAMPLE_BUS    // whole bus at a fixed factor, one decimator
+} OversampleMode;
+
+typedef struct HalfbandDecimator {
+  // doubled ring so the last HALFBAND_TAPS inputs are always contiguous
+  float history[2 * HALFBAND_TAPS];
+  size_t pos;
+} HalfbandDecimator;
+
+typedef struct Oversampler {
+  int factor; // 1, 2, 4 or 8
+  HalfbandDecimator stage[OVERSAMPLE_MAX_STAGES];
+} Oversampler;
+
+void resetOversampler(Oversampler *os, int factor);
+float decimateHalfband(HalfbandDecimator *d, float x0, float x1);
+void interpolateHalfband(HalfbandDecimator *d, float x, float out[2]);
+float decimateOversampled(Oversampler *os, const float *in);
+int chooseOversampleFactor(float freq, float sample_rate);
@@ -0,0 +1,39 @@
+#pragma once
+#include "hash.h"
+#include "master.h"
+#include "oscillator.h"
+#include "oversample.h"
+#include <stdbool.h>
+
+// sound parameters that can change while running. the audio thread only ever
+// sees immutable snapshots, a reload builds a new one and swaps the pointer
+
+#define NUM_PARTS 4
+
+// a part is one timbre: its own program, voice budget and the notes it
+// answers to. parts on the same channel layer, key ranges split
+typedef struct part_params {
+  int channel; // control channel the part listens on, -1 mutes it
+  int key_low; // key range, inclusive
+  int key_high;
+  int voices;  // most voices the part may hold at once
+  int program; // selected at startup, -1 is the default patch
+} part_params_t;
+
+typedef struct synth_params {
+  unsigned long version;
+  ADSR envelope;
+  OversampleMode oversample_mode;
+  int oversample_factor; // only used by OVERSAMPLE_BUS
+  bool nco;              // integer phase accumulators instead of float phase
+  part_params_t parts[NUM_PARTS];
+  master_params_t master;
+} synth_params_t;
+
+void params_defaults(synth_params_t *p);
+void params_apply_config(synth_params_t *p, hash_t *config);
+
+void params_init(const synth_params_t *initial);
+const synth_params_t *params_acquire(void);
+void params_publish(const synth_params_t *p);
+void params_start_watcher(const char *path);
@@ -0,0 +1,82 @@
+#pragma once
+#include "oscillator.h"
+#include <stdint.h>
+
+// patches are written as small yaml files and compiled into a flat bank:
+// a header followed by fixed size records, native byte order. a bank is
+// mmapped as is, selecting a program is a pointer into the mapping
+
+#define PATCH_MAGIC 0x4b4e4254 // "TBNK"
+#define PATCH_VERSION 2
+#define PATCH_NAME_LEN 32
+#define PATCH_MAX_PROGRAMS 128
+
+typedef struct patch_bank_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;
+  uint32_t record_size; // sizeof(patch_t) when written, checked on load
+} patch_bank_header_t;
+
+typedef struct patch {
+  char name[PATCH_NAME_LEN];
+  uint32_t shape; // ShapeId
+  float amplitude;
+  float shape_parameter_0;
+  float attack_time;
+  float decay_time;
+  float sustain_level;
+  float sustain_time;
+  float release_time;
+  float filter_cutoff;        // one pole lowpass per voice in Hz, 0 is open
+  uint32_t unison_voices;     // detuned copies per note, 0 or 1 is off
+  float unison_detune;        // cents between the outermost copies and the note
+  float unison_spread;        // stereo width of the copies, 0 to 1
+  uint32_t additive_partials; // sine partials per note, 0 is off
+  float additive_tilt;        // partial k has amplitude k^-tilt
+  float additive_stretch;     // inharmonicity, 0 is harmonic
+  float waveguide_decay;      // plucked string, seconds to -60 dB, 0 is off
+  float waveguide_brightness; // 0 to 1, the string loses highs faster at 0
+  float waveguide_position;   // where the string is plucked, 0 to 1
+  float pan;                  // -1 first output channel to 1 the last
+  uint32_t reserved[5];       // zero, room for fields without a version bump
+} patch_t;
+
+// patch fields that can be set one at a time, names match the yaml keys
+typedef enum PatchParam {
+  PARAM_SHAPE = 0,
+  PARAM_AMPLITUDE,
+  PARAM_SHAPE_PARAMETER_0,
+  PARAM_ATTACK_TIME,
+  PARAM_DECAY_TIME,
+  PARAM_SUSTAIN_LEVEL,
+  PARAM_SUSTAIN_TIME,
+  PARAM_RELEASE_TIME,
+  PARAM_FILTER_CUTOFF,
+  PARAM_UNISON_VOICES,
+  PARAM_UNISON_DETUNE,
+  PARAM_UNISON_SPREAD,
+  PARAM_ADDITIVE_PARTIALS,
+  PARAM_ADDITIVE_TILT,
+  PARAM_ADDITIVE_STRETCH,
+  PARAM_WAVEGUIDE_DECAY,
+  PARAM_WAVEGUIDE_BRIGHTNESS,
+  PARAM_WAVEGUIDE_POSITION,
+  PARAM_PAN,
+  PARAM_COUNT
+} PatchParam;
+
+typedef struct patch_bank {
+  void *map;
+  size_t map_size;
+  const patch_t *patches;
+  uint32_t count;
+} patch_bank_t;
+
+void patch_defaults(patch_t *p);
+int patchParamFromName(const char *name);
+void patchSetParam(patch_t *p, PatchParam param, float value);
+float patchGetParam(const patch_t *p, PatchParam param);
+int patch_compile_bank(const char *out, char **sources, int count);
+patch_bank_t *patch_bank_load(const char *path);
+void patch_bank_free(patch_bank_t *bank);
@@ -0,0 +1,72 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// per stage profiler for the render loop and the networking thread. every
+// stage is a span of two timestamps in a ring of the thread that ran it, the
+// newest spans win. a dump writes them all as a chrome trace, open it in
+// chrome://tracing or perfetto
+//
+// compiled in with cmake -DPROFILER=ON, otherwise the macros are empty and
+// the dump only reports that the build has no profiler. timestamps are the
+// tsc on x86, calibrated against CLOCK_MONOTONIC at the first thread init,
+// and CLOCK_MONOTONIC elsewhere
+
+#define PROFILER_RING_SPANS 65536 // per thread, power of two
+
+typedef enum ProfileStage {
+  // audio thread
+  PROF_BLOCK = 0, // everything up to the output write
+  PROF_PARAMS,    // parameter snapshot and tuning
+  PROF_DRAIN,     // control events into the schedule
+  PROF_SEQUENCER,
+  PROF_RENDER, // renderBlock, the next four run inside it
+  PROF_EVENTS, // due events of a segment
+  PROF_KEYS,   // handle_keys
+  PROF_VOICES, // oscillators, envelopes and filters, fused per sample
+  PROF_MASTER,
+  PROF_ANALYZER,
+  PROF_RECORDER,
+  PROF_OUTPUT, // backend write, includes waiting for the device
+  // networking thread
+  PROF_NET_ACCEPT,
+  PROF_NET_READ,
+  PROF_NET_PARSE, // command lookup and the command itself
+  PROF_NET_SEND,  // scope data
+  PROF_STAGE_COUNT
+} ProfileStage;
+
+#ifdef PROFILER
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t profileNow(void) { return __rdtsc(); }
+#else
+#include <time.h>
+static inline uint64_t profileNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+// audio thread safe, nothing but a store into the thread's ring
+void profileSpan(ProfileStage stage, uint64_t start);
+
+#define PROFILE_BEGIN(stage) uint64_t profile_start_##stage = profileNow()
+#define PROFILE_END(stage) profileSpan(stage, profile_start_##stage)
+
+#else
+
+#define PROFILE_BEGIN(stage) ((void)0)
+#define PROFILE_END(stage) ((void)0)
+
+#endif
+
+// registers a ring for the calling thread under a name for the trace. the
+// one allocation happens here, spans of threads that never called it are
+// not recorded
+void profiler_thread_init(const char *name);
+// writes the spans of every thread as chrome trace json, false if the file
+// can not be written or the profiler is not compiled in
+bool profiler_dump(const char *path);
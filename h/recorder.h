@@ -0,0 +1,26 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+// disk recorder for the finished output. the audio thread only copies each
+// block into a ring and never waits, a block that does not fit is dropped
+// and counted. a writer thread drains the ring into a 32 bit float wav in
+// large aligned writes, optionally with O_DIRECT so a long session does not
+// fill the page cache. files past 4 GiB are finished as rf64
+//
+// the samples start RECORDER_ALIGN bytes into the file, after the header and
+// a JUNK chunk that pads it, so every write lands on an aligned offset
+
+#define RECORDER_RING_SECONDS 8 // capacity, rounded up to a power of two
+#define RECORDER_ALIGN 4096     // file offsets and buffers, O_DIRECT needs it
+#define RECORDER_CHUNK (256 * 1024) // bytes per write, multiple of the above
+#define RECORDER_POLL_MS 10         // writer sleep when the ring is empty
+
+// false if the file can not be created or a recording is already running
+bool recorder_start(const char *path, int sample_rate, int channels,
+                    bool direct);
+// waits for the writer to drain the ring and finish the file
+void recorder_stop(void);
+bool recorder_running(void);
+// audio thread, once per block, frames of interleaved samples
+void recorder_push(const float *signal, size_t frames);
@@ -0,0 +1,72 @@
+#pragma once
+#include "events.h"
+#include "synth.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// renders an event log offline, without an audio device, and optionally
+// checks the result against a known hash or a reference render
+
+#define REPLAY_TAIL_SECONDS 60 // keep rendering this long after the last event
+#define REPLAY_SNAPSHOT_SECONDS 10 // of the sample clock between snapshots
+// rendered and thrown away before a segment that has no snapshot to start
+// from, so envelopes, filters and the limiter have settled by its first
+// sample
+#define REPLAY_PREROLL_SECONDS 5
+#define REPLAY_SEGMENT_SECONDS 5 // shortest segment handed to a worker
+#define REPLAY_SEGMENTS_PER_WORKER 4 // more than one evens out the load
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+
+typedef struct replay_opts {
+  const char *log_path;
+  const char *bank_path;
+  const char *scl_path; // tuning as in conf.yaml, see tuning_load_or_equal
+  const char *kbm_path;
+  const char *render_path;  // raw float32 output, optional
+  const char *expect_hash;  // 16 hex digits, optional
+  const char *compare_path; // raw float32 reference, optional
+  float tolerance;          // max sample difference against compare_path
+  // snapshots every REPLAY_SNAPSHOT_SECONDS go into this directory as
+  // <sample clock>.snap, optional
+  const char *snapshot_dir;
+  // starts from this snapshot instead of silence, the output and its hash
+  // begin at its sample clock. optional
+  const char *restore_path;
+  // worker processes rendering segments of the log side by side, 1 renders
+  // in this process and 0 uses one per cpu. with snapshot_dir the segments
+  // start at the snapshots found there and the output is the same as a
+  // serial render, without it they start after a pre-roll and come close
+  int workers;
+} replay_opts_t;
+
+// an event log read into memory
+typedef struct replay_log {
+  event_log_header_t header;
+  synth_event_t *events;
+  size_t count;
+  uint64_t last; // time of the last event
+  uint64_t end;  // rendering stops here even if voices still sound
+} replay_log_t;
+
+uint64_t hashSamples(uint64_t hash, const float *samples, size_t count);
+int replay_main(const replay_opts_t *opts);
+
+bool replay_open(const replay_opts_t *opts, replay_log_t *log);
+// the synth at the start of the log, keyOscillators already set
+bool replay_synth_init(Synth *synth, const replay_log_t *log,
+                       const replay_opts_t *opts);
+void replay_synth_free(Synth *synth);
+// schedules the events up to the end of the next block and renders it,
+// false once the log is over and every voice is silent
+bool replayBlock(Synth *synth, const replay_log_t *log, size_t *next);
+// reads n reference samples and tracks how far they are off
+void replay_compare(FILE *ref, const float *samples, size_t n,
+                    float *expected, float *max_diff, bool *ref_short);
+// prints the hash and the comparisons, returns replay_main's result
+int replay_report(const replay_opts_t *opts, size_t count, uint64_t samples,
+                  uint64_t hash, FILE *ref, float max_diff, bool ref_short);
+// replay_main with opts->workers other than 1, see replay_parallel.c
+int replay_parallel(const replay_opts_t *opts);
@@ -0,0 +1,27 @@
+#pragma once
+#include "hash.h"
+#include "synth.h"
+#include <stdbool.h>
+
+// opt in real time mode for the audio thread. every step is tried on its
+// own and reported at startup, a step that fails (usually for lack of
+// CAP_SYS_NICE or a low RLIMIT_MEMLOCK) leaves the others in place
+
+#define RT_DEFAULT_PRIORITY 70
+#define RT_STACK_PREFAULT (256 * 1024) // audio thread stack touched up front
+
+typedef struct rt_cfg {
+  bool enabled;
+  int priority; // SCHED_FIFO, 1 to 99
+  int cpu;      // core to pin the audio thread to, -1 leaves it floating
+} rt_cfg_t;
+
+void rt_defaults(rt_cfg_t *cfg);
+void rt_apply_config(rt_cfg_t *cfg, hash_t *config);
+// flush to zero and denormals are zero for the calling thread, decaying
+// envelopes and filter states otherwise crawl through the slow denormal
+// range. false where the cpu has no such mode
+bool rt_set_ftz_daz(void);
+// call on the audio thread once everything it renders from is allocated,
+// returns the number of steps that failed
+int rt_enter(const rt_cfg_t *cfg, const Synth *synth);
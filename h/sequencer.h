@@ -0,0 +1,81 @@
+#pragma once
+#include "events.h"
+#include "patch.h"
+#include "snapshot.h"
+#include "synth.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// step sequencer and arpeggiator on the audio clock. steps are counted in
+// samples from the start, so a step lands on the same sample however late
+// the control side was, and the notes go into the same schedule as every
+// other event. nothing crosses the network per step
+//
+// the pattern is built on the control side and swapped in between blocks,
+// the same handover as the parameter snapshots. the notes it plays are
+// recorded like any other event, so a replay needs no sequencer
+
+#define SEQ_MAX_STEPS 64
+#define SEQ_MAX_LOCKS 4   // parameter locks per step
+#define SEQ_MAX_RATCHET 8 // hits per step
+#define SEQ_REST 0xff     // step note for a step that plays nothing
+#define SEQ_HIT 0xfe      // an arpeggiator step, a rest in step mode
+
+typedef enum SeqMode {
+  SEQ_STEPS = 0, // steps play their own keys
+  SEQ_ARP, // steps that are not rests play the keys held on the channel
+} SeqMode;
+
+typedef enum ArpOrder {
+  ARP_UP = 0,
+  ARP_DOWN,
+  ARP_UPDOWN, // the top and bottom keys once per cycle
+  ARP_PLAYED, // in the order they were pressed
+  ARP_RANDOM,
+} ArpOrder;
+
+typedef struct seq_lock {
+  uint8_t param; // PatchParam, held for the one step
+  float value;
+} seq_lock_t;
+
+typedef struct seq_step {
+  uint8_t note;    // key, SEQ_REST or SEQ_HIT. the arpeggiator ignores keys
+  uint8_t ratchet; // hits spread evenly over the step, 1 is a plain step
+  uint8_t lock_count;
+  float gate; // of the step, or of one hit when ratcheted. 0 is the default
+  seq_lock_t locks[SEQ_MAX_LOCKS];
+} seq_step_t;
+
+typedef struct sequence {
+  bool running;
+  uint64_t start_time; // sample clock of the first step, 0 is the next block
+  uint8_t channel;
+  uint8_t mode;  // SeqMode
+  uint8_t order; // ArpOrder
+  float bpm;
+  int steps_per_beat; // 4 for sixteenths
+  float swing;        // 0 to 0.5, odd steps come that much of a step late
+  float gate;         // default gate, 0 to 1
+  int length;         // steps, 1 to SEQ_MAX_STEPS
+  seq_step_t steps[SEQ_MAX_STEPS];
+} sequence_t;
+
+// a stopped 16 step pattern of rests at 120 bpm
+void sequence_defaults(sequence_t *s);
+// control side: a copy of the latest pattern to edit, which has to be
+// published or discarded. edits are serialized, so any thread may edit
+sequence_t *sequence_edit(void);
+void sequence_publish(sequence_t *s);
+void sequence_discard(sequence_t *s);
+
+// audio thread, once per block before rendering: schedules every step that
+// starts inside the block, with its note offs and lock releases
+void sequencerRun(Synth *synth);
+// audio thread: true when the arpeggiator took a note event as a held key,
+// the event then neither plays nor goes into the event log
+bool sequencerTakes(const synth_event_t *ev);
+// position, held keys, locks and the pattern, see snapshot.h. a load is
+// only safe while the audio thread is not running
+void sequencerSave(snap_buf_t *b);
+bool sequencerLoad(snap_buf_t *b);
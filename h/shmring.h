@@ -0,0 +1,49 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// layout of the posix shared memory ring the shm backend writes into.
+// one writer, any number of readers, nobody takes a lock and the writer
+// never waits: a reader that falls more than capacity frames behind has
+// lost audio and can tell from write_pos. readers map the segment read only
+// and use the samples where they are
+
+#define SHM_RING_MAGIC 0x4d485354 // "TSHM"
+#define SHM_RING_VERSION 1
+#define SHM_RING_DEFAULT_NAME "/tinysynth"
+#define SHM_RING_DATA_OFFSET 4096 // samples start on their own page
+
+typedef struct shm_ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sample_rate;
+  uint32_t channels;     // interleaved
+  uint32_t capacity;     // frames, power of two
+  uint32_t block_frames; // frames the writer adds at a time
+  // frames ever written, the newest frame is write_pos - 1. on its own
+  // cache line so readers polling it do not share one with the fields above
+  _Alignas(64) _Atomic uint64_t write_pos;
+} shm_ring_header_t;
+
+static inline float *shm_ring_data(shm_ring_header_t *h) {
+  return (float *)((char *)h + SHM_RING_DATA_OFFSET);
+}
+
+static inline size_t shm_ring_size(uint32_t capacity, uint32_t channels) {
+  return SHM_RING_DATA_OFFSET + (size_t)capacity * channels * sizeof(float);
+}
+
+// frame index inside the ring for an absolute frame position
+static inline size_t shm_ring_index(const shm_ring_header_t *h, uint64_t pos) {
+  return pos & (h->capacity - 1);
+}
+
+// true if the frames from pos on are still intact. check after reading
+// them, the writer may have lapped the reader in the meantime
+static inline bool shm_ring_valid(shm_ring_header_t *h, uint64_t pos) {
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&h->write_pos, memory_order_relaxed) - pos <=
+         h->capacity;
+}
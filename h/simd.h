@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+// gcc/clang vector extensions, the compiler lowers these to sse/neon or to
+// scalar code on targets without either, so there are no intrinsics here
+
+#define SIMD_WIDTH 4
+
+typedef float v4f __attribute__((vector_size(16)));
+typedef uint32_t v4u __attribute__((vector_size(16)));
+typedef int32_t v4i __attribute__((vector_size(16)));
+
+// unaligned loads and stores, memcpy compiles down to a single movups
+static inline v4f v4f_load(const float *p) {
+  v4f v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void v4f_store(float *p, v4f v) { memcpy(p, &v, sizeof(v)); }
+
+static inline v4u v4u_load(const uint32_t *p) {
+  v4u v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void v4u_store(uint32_t *p, v4u v) { memcpy(p, &v, sizeof(v)); }
+
+static inline v4f v4f_set1(float x) { return (v4f){x, x, x, x}; }
+static inline v4u v4u_set1(uint32_t x) { return (v4u){x, x, x, x}; }
+
+static inline v4f v4f_from_u32(v4u x) { return __builtin_convertvector(x, v4f); }
+
+// lanes of a where mask is set (all ones), of b elsewhere
+static inline v4f v4f_select(v4i mask, v4f a, v4f b) {
+  v4i ai, bi;
+  memcpy(&ai, &a, sizeof(ai));
+  memcpy(&bi, &b, sizeof(bi));
+  v4i r = (mask & ai) | (~mask & bi);
+  v4f out;
+  memcpy(&out, &r, sizeof(out));
+  return out;
+}
+
+static inline v4f v4f_abs(v4f x) { return v4f_select(x < 0.0f, -x, x); }
+static inline v4f v4f_min(v4f a, v4f b) { return v4f_select(a < b, a, b); }
+static inline v4f v4f_max(v4f a, v4f b) { return v4f_select(a > b, a, b); }
+
+static inline float v4f_sum(v4f v) { return (v[0] + v[1]) + (v[2] + v[3]); }
+
+// a0 b0 a1 b1 and a2 b2 a3 b3, two planar channels into interleaved frames
+static inline v4f v4f_zip_lo(v4f a, v4f b) {
+  return __builtin_shufflevector(a, b, 0, 4, 1, 5);
+}
+static inline v4f v4f_zip_hi(v4f a, v4f b) {
+  return __builtin_shufflevector(a, b, 2, 6, 3, 7);
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include "synth.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// the whole engine state at a block boundary in one binary blob: voices
+// with their phases, envelopes, filters, unison lanes, additive phasors and
+// string delay lines, the oversamplers, the master bus with its look ahead,
+// held keys, expression, scheduled events and the sequencer's position.
+// restoring it into a synth set up the same way continues the output on the
+// same sample
+//
+// the audio thread captures it when asked, between two blocks, by copying
+// into the one of two buffers the control side is not reading, so it never
+// waits. tuning, patch bank and config are not in it, the restoring synth
+// loads its own
+
+#define SNAPSHOT_MAGIC 0x504e5354 // "TSNP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_INITIAL_BYTES (256 * 1024) // grown when a capture needs more
+
+typedef struct snapshot_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t layout; // struct sizes of the build that wrote it
+  uint32_t sample_rate;
+  uint32_t buffer_size;
+  uint32_t channels;
+  uint64_t sample_clock; // first sample rendered after a restore
+  uint64_t size;         // bytes including this header
+} snapshot_header_t;
+
+// a capture appends to it, a restore reads it front to back. size goes on
+// counting past capacity, so a failed capture tells how much it needed
+typedef struct snap_buf {
+  uint8_t *data;
+  size_t size; // written, or read so far
+  size_t capacity;
+  bool failed; // out of room, or read past the end
+} snap_buf_t;
+
+static inline void snapPut(snap_buf_t *b, const void *p, size_t n) {
+  if (b->size + n <= b->capacity)
+    memcpy(b->data + b->size, p, n);
+  else
+    b->failed = true;
+  b->size += n;
+}
+
+static inline void snapGet(snap_buf_t *b, void *p, size_t n) {
+  if (b->failed || b->size + n > b->capacity) {
+    b->failed = true;
+    memset(p, 0, n);
+    return;
+  }
+  memcpy(p, b->data + b->size, n);
+  b->size += n;
+}
+
+// writes the state of synth at its current sample clock, no allocation
+bool snapshotCapture(const Synth *synth, snap_buf_t *b);
+// into a synth initialized with the same rate, block size and channels,
+// its bank, tuning and parameters already set up. false leaves it as it was
+// only when the header does not match, a truncated body can leave it half
+// way
+bool snapshotRestore(Synth *synth, const void *data, size_t size);
+
+// audio thread, once per block boundary: serves a pending snapshot_save
+void snapshotPoll(const Synth *synth);
+// control side: has the audio thread capture the next block boundary and
+// writes it to path. waits at most a second
+bool snapshot_save(const char *path);
+// reads path and restores it, before the audio thread starts
+bool snapshot_load(Synth *synth, const char *path);
+bool snapshot_write_file(const char *path, const void *data, size_t size);
@@ -1,19 +1,130 @@
 #pragma once
 #include "oscillator.h"
+#include "nco.h"
+#include "oversample.h"
+#include "params.h"
+#include "patch.h"
+#include "unison.h"
+#include "additive.h"
+#include "master.h"
+#include "tuning.h"
+#include "waveguide.h"
 
-#define SAMPLE_RATE 44100
-#define NUM_KEYS 12
-#define BASE_SEMITONE 0 // A4 = 440 Hz
+#define DEFAULT_SAMPLE_RATE 44100
+#define DEFAULT_STREAM_BUFFER_SIZE 1024
+#define MIN_STREAM_BUFFER_SIZE 32
+#define MAX_STREAM_BUFFER_SIZE 4096
+#define DEFAULT_CHANNELS 2
+// the envelopes advance by this many frames' worth of time every sample,
+// the patch times were tuned when that was the 1024 frame block
+#define ENVELOPE_FRAMES_PER_SAMPLE 1024
+
+// one pole lowpass state of a voice, coeff 1 is open. a unison voice
+// spread over several channels filters each one on its own
+typedef struct VoiceFilter {
+  float coeff;
+  float state;
+  float channel_state[MAX_CHANNELS];
+} VoiceFilter;
+
+typedef struct Part {
+  // either a record in the mmapped bank, default_patch, or edit_patch once
+  // a parameter has been set on the part
+  const patch_t *patch;
+  int program;
+  patch_t edit_patch;
+  part_params_t config;
+} Part;
+
+_Static_assert(NUM_OSCILLATORS <= 32, "voice_active has one bit per voice");
 
 typedef struct Synth {
+  // voice pool of NUM_OSCILLATORS, every voice belongs to the part and key
+  // in voice_part and voice_key while it sounds
   OscillatorArray keyOscillators;
+  uint8_t voice_part[NUM_OSCILLATORS];
+  uint8_t voice_key[NUM_OSCILLATORS];
+  // bit v is set from note on until voice v's envelope is OFF, the voice
+  // loops walk the set bits and never look at a silent voice
+  uint32_t voice_active;
+  // set on note on and scaled at block rate by pressure and timbre
+  float voice_amplitude[NUM_OSCILLATORS];
+  float voice_brightness[NUM_OSCILLATORS]; // times the filter cutoff
+  VoiceFilter voice_filters[NUM_OSCILLATORS];
+  Unison voice_unison[NUM_OSCILLATORS];
+  Additive voice_additive[NUM_OSCILLATORS];
+  Waveguide voice_waveguide[NUM_OSCILLATORS];
+  uint32_t rng; // seed of the note start noise, see noteSeed
+
+  // planar, channel c of the block starts at signal + c * channel_stride.
+  // voices are rendered once and panned into the channels
   float *signal;
   size_t signal_length;
+  size_t channel_stride; // signal_length, the stride of the whole block
+  int channels;
+  // the finished block interleaved for the outputs, signal itself in mono
+  float *output;
+  int sample_rate;
+  float sample_duration;
   float audio_frame_duration;
-  float delta_time_last_frame;
+  float delta_time_last_frame; // envelope step per sample in ms
+  uint64_t sample_clock;       // samples rendered so far
+
+  const tuning_t *tuning; // picked up at the start of every block
+  Part parts[NUM_PARTS];
+  const patch_bank_t *bank;
+  patch_t default_patch; // follows the envelope in conf.yaml
+
+  unsigned long params_version; // snapshot the fields below came from
+  OversampleMode oversample_mode;
+  int oversample_factor; // only used by OVERSAMPLE_BUS
+  Oversampler voiceOversamplers[NUM_OSCILLATORS];
+  Oversampler busOversamplers[MAX_CHANNELS];
+  // per channel signal_length * OVERSAMPLE_MAX_FACTOR, the bus channels in
+  // bus mode and scratch for the master bus
+  float *bus_scratch;
+  size_t bus_idle; // samples since a voice last fed the bus oversampler
+
+  bool nco;
+  uint32_t *nco_phases;
+  float *nco_samples;
+
+  float *additive_pool;    // NUM_OSCILLATORS * ADDITIVE_VOICE_FLOATS
+  float *additive_scratch; // signal_length * SIMD_WIDTH
+  float *waveguide_pool;   // NUM_OSCILLATORS * WAVEGUIDE_SLOT_FLOATS
+
+  // one voice before it is panned, oversampled in bus mode
+  float *voice_signal; // signal_length * OVERSAMPLE_MAX_FACTOR
+  float *voice_gain;   // signal_length, envelope times amplitude
+  float *lane_signal;  // unison lanes per channel, before the filter
+
+  MasterBus master; // limiter and clipper on the finished block
 } Synth;
 
-void zeroSignal(float *signal);
+bool isValidSampleRate(int sample_rate);
+bool isValidBufferSize(size_t buffer_size);
+bool isValidChannelCount(int channels);
+bool initSynth(Synth *synth, int sample_rate, size_t buffer_size,
+               int channels);
+void freeSynth(Synth *synth);
+void initVoices(Synth *synth, const ADSR *envelope);
+
+void zeroSignal(float *signal, size_t length);
+size_t countActiveVoices(const Synth *synth);
+
+// lowest voice left in mask, which loses its bit. walking a copy of
+// voice_active visits the sounding voices in pool order
+static inline size_t nextVoice(uint32_t *mask) {
+  size_t v = __builtin_ctz(*mask);
+  *mask &= *mask - 1;
+  return v;
+}
+void applySynthParams(Synth *synth, const synth_params_t *params);
+void initParts(Synth *synth, const synth_params_t *params);
+void selectProgram(Synth *synth, Part *part, int program);
+Oscillator *allocVoice(Synth *synth, int part, int key);
+void renderBlock(Synth *synth);
 
-void updateOscArray(WaveShapeFn base_osc_shape_fn, Synth *synth,
-                    OscillatorArray osc_array);
\ No newline at end of file
+// renders n samples of every voice into the block from offset on
+void updateOscArray(Synth *synth, OscillatorArray osc_array, size_t offset,
+                    size_t n);
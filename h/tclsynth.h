@@ -0,0 +1,12 @@
+#pragma once
+#include "tcl.h"
+
+// registers the synth package: note_on, note_off, program, set, at, submit
+// and now in the ::synth namespace. every command goes straight into
+// g_script_events, no socket or text protocol in between. note and program
+// commands take an optional channel after their arguments
+int Synth_Init(Tcl_Interp *interp);
+
+// runs path in a fresh interpreter with the synth package loaded, on its own
+// thread so a long script never holds up the audio loop
+void tclsynth_run_script(const char *path);
@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+
+// microtuning: the frequency and nco phase increment of every midi note,
+// worked out once when a scale is loaded. a note on is a table lookup and
+// a retune swaps the table pointer between blocks
+//
+// scales are scala files, .scl for the pitches and an optional .kbm for the
+// keyboard mapping, https://www.huygens-fokker.org/scala/scl_format.html
+
+#define TUNING_NOTES 128
+#define TUNING_BEND_RANGE 48  // semitones either way
+#define TUNING_BEND_STEPS 64  // bend table entries per semitone
+#define TUNING_MAX_DEGREES 256
+
+typedef struct tuning {
+  char name[64];
+  int sample_rate;
+  float freq[TUNING_NOTES]; // 0 for notes the keyboard mapping leaves out
+  uint32_t inc[TUNING_NOTES];
+} tuning_t;
+
+// twelve tone equal temperament, A4 = 440 Hz
+tuning_t *tuning_equal(int sample_rate);
+// kbm may be NULL for the linear mapping with 1/1 on middle C and A4 at 440
+// Hz. NULL and an error logged if either file does not parse
+tuning_t *tuning_load(const char *scl, const char *kbm, int sample_rate);
+// tuning_load, or equal temperament for an empty scl or "equal" and when the
+// files do not parse. an empty kbm or "default" is the linear mapping
+tuning_t *tuning_load_or_equal(const char *scl, const char *kbm,
+                               int sample_rate);
+
+// the first table, before any audio thread runs, takes ownership
+void tuning_init(tuning_t *initial);
+// audio thread, once per block
+const tuning_t *tuning_acquire(void);
+// swaps t in and frees the old table once the audio thread has moved on
+void tuning_publish(tuning_t *t);
+
+// 2^(semitones / 12) from a table, clamped to TUNING_BEND_RANGE
+float tuningBendRatio(float semitones);
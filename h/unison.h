@@ -0,0 +1,32 @@
+#pragma once
+#include "oscillator.h"
+#include "simd.h"
+
+// unison: one note plays up to UNISON_MAX_VOICES detuned copies of its
+// oscillator. the copies live in SIMD lanes of a single voice, structure of
+// arrays, so a 16 voice supersaw is four vector oscillators and not sixteen
+// entries in the voice pool
+
+#define UNISON_MAX_VOICES 16
+#define UNISON_GROUPS (UNISON_MAX_VOICES / SIMD_WIDTH)
+
+typedef struct Unison {
+  int count; // 0 or 1 is off, the voice renders as a plain oscillator
+  _Alignas(16) uint32_t phase[UNISON_MAX_VOICES];
+  _Alignas(16) float ratio[UNISON_MAX_VOICES]; // detune, times the note freq
+  _Alignas(16) float gain[UNISON_MAX_VOICES];  // 0 for lanes past count
+  // -1 left to 1 right around the voice's pan, mono ignores it
+  _Alignas(16) float pan[UNISON_MAX_VOICES];
+} Unison;
+
+// spreads count copies evenly over +-detune_cents around the note, starting
+// at random phases drawn from rng so replays stay identical
+void unisonStart(Unison *u, int count, float detune_cents, float spread,
+                 uint32_t *rng);
+// adds n samples of the summed lanes to each of channels outputs, stride
+// floats apart. lane k goes into channel c times gains[c][k], the lanes are
+// rendered once whatever the channel count
+void unisonRender(Unison *u, ShapeId shape, float freq,
+                  float shape_parameter_0, int sample_rate,
+                  const float (*gains)[UNISON_MAX_VOICES], int channels,
+                  float *out, size_t stride, size_t n);
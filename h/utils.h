@@ -2,12 +2,15 @@
 
 #include <limits.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define DOWNSAMPLE_FACTOR 8
-#define DOWNSAMPLE_SIZE (STREAM_BUFFER_SIZE / DOWNSAMPLE_FACTOR)
 
 typedef enum {
   ERROR,
@@ -38,15 +41,137 @@ LogLevel get_current_log_level();
     }                                                                          \
   } while (0)
 
+// ----------------------------
+// asynchronous logging
+// ----------------------------
+// log_message never formats or writes on the calling thread. it copies the
+// format pointer and the raw arguments into a per thread ring and a
+// background thread formats and prints them. a full ring drops the entry and
+// counts it, it never blocks, so it is safe to call from the audio thread
+
+#define LOG_MAX_ARGS 8
+#define LOG_STR_BYTES 96     // room for %s arguments, copied at call time
+#define LOG_RING_ENTRIES 256 // per thread, power of two
+
+typedef enum {
+  LOG_ARG_INT,
+  LOG_ARG_UINT,
+  LOG_ARG_DOUBLE,
+  LOG_ARG_PTR,
+  LOG_ARG_STR,
+} LogArgType;
+
+typedef struct {
+  LogArgType type;
+  union {
+    long long i;
+    unsigned long long u;
+    double d;
+    const void *p;
+  } v;
+} LogArg;
+
+typedef struct {
+  LogLevel level;
+  int line;
+  int nargs;
+  const char *file;
+  const char *format;
+  struct timespec time;
+  LogArg args[LOG_MAX_ARGS];
+  char strings[LOG_STR_BYTES];
+} LogEntry;
+
+typedef struct LogRing {
+  _Atomic size_t head; // consumer
+  _Atomic size_t tail; // producer
+  _Atomic unsigned long dropped;
+  unsigned long dropped_reported;
+  _Atomic bool dead; // its thread exited, freed once drained
+  struct LogRing *next;
+  LogEntry entries[LOG_RING_ENTRIES];
+} LogRing;
+
+void log_submit(LogLevel level, const char *file, int line, const char *format,
+                const LogArg *args, int nargs);
+void log_thread_init(void);
+void log_start(void);
+void log_flush(void);
+unsigned long log_dropped_total(void);
+
+static inline LogArg log_arg_int(long long x) {
+  return (LogArg){.type = LOG_ARG_INT, .v.i = x};
+}
+static inline LogArg log_arg_uint(unsigned long long x) {
+  return (LogArg){.type = LOG_ARG_UINT, .v.u = x};
+}
+static inline LogArg log_arg_double(double x) {
+  return (LogArg){.type = LOG_ARG_DOUBLE, .v.d = x};
+}
+static inline LogArg log_arg_ptr(const void *x) {
+  return (LogArg){.type = LOG_ARG_PTR, .v.p = x};
+}
+static inline LogArg log_arg_str(const char *x) {
+  return (LogArg){.type = LOG_ARG_STR, .v.p = x};
+}
+
+// picks the storage class of an argument from its C type
+#define LOG_ARG(x)                                                             \
+  _Generic((x),                                                                \
+      _Bool: log_arg_uint,                                                     \
+      char: log_arg_int,                                                       \
+      signed char: log_arg_int,                                                \
+      unsigned char: log_arg_uint,                                             \
+      short: log_arg_int,                                                      \
+      unsigned short: log_arg_uint,                                            \
+      int: log_arg_int,                                                        \
+      unsigned int: log_arg_uint,                                              \
+      long: log_arg_int,                                                       \
+      unsigned long: log_arg_uint,                                             \
+      long long: log_arg_int,                                                  \
+      unsigned long long: log_arg_uint,                                        \
+      float: log_arg_double,                                                   \
+      double: log_arg_double,                                                  \
+      long double: log_arg_double,                                             \
+      char *: log_arg_str,                                                     \
+      const char *: log_arg_str,                                               \
+      default: log_arg_ptr)(x)
+
+#define LOG_ARGS_0()
+#define LOG_ARGS_1(a) LOG_ARG(a),
+#define LOG_ARGS_2(a, ...) LOG_ARG(a), LOG_ARGS_1(__VA_ARGS__)
+#define LOG_ARGS_3(a, ...) LOG_ARG(a), LOG_ARGS_2(__VA_ARGS__)
+#define LOG_ARGS_4(a, ...) LOG_ARG(a), LOG_ARGS_3(__VA_ARGS__)
+#define LOG_ARGS_5(a, ...) LOG_ARG(a), LOG_ARGS_4(__VA_ARGS__)
+#define LOG_ARGS_6(a, ...) LOG_ARG(a), LOG_ARGS_5(__VA_ARGS__)
+#define LOG_ARGS_7(a, ...) LOG_ARG(a), LOG_ARGS_6(__VA_ARGS__)
+#define LOG_ARGS_8(a, ...) LOG_ARG(a), LOG_ARGS_7(__VA_ARGS__)
+#define LOG_ARGS_PICK(_0, _1, _2, _3, _4, _5, _6, _7, _8, N, ...) N
+#define LOG_ARGS(...)                                                          \
+  LOG_ARGS_PICK(_0, ##__VA_ARGS__, LOG_ARGS_8, LOG_ARGS_7, LOG_ARGS_6,         \
+                LOG_ARGS_5, LOG_ARGS_4, LOG_ARGS_3, LOG_ARGS_2, LOG_ARGS_1,    \
+                LOG_ARGS_0)                                                    \
+  (__VA_ARGS__)
+
 // SOURCE_PATH_SIZE defined in cmake
 #define __RELATIVE_FILE__ (__FILE__ + SOURCE_PATH_SIZE)
 
+// levels above this are removed at compile time, set from cmake
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL DEBUG
+#endif
+
 #define LOGGING
 
 #ifdef LOGGING
-  #define log_message(level, message, ...)                                       \
-    log_message_impl(level, __RELATIVE_FILE__, __LINE__, message, ##__VA_ARGS__)
+  #define log_message(level, message, ...)                                     \
+    do {                                                                       \
+      if ((level) <= LOG_COMPILE_LEVEL) {                                      \
+        const LogArg log_args_[] = {LOG_ARGS(__VA_ARGS__) log_arg_int(0)};     \
+        log_submit(level, __RELATIVE_FILE__, __LINE__, message, log_args_,     \
+                   sizeof(log_args_) / sizeof(LogArg) - 1);                    \
+      }                                                                        \
+    } while (0)
 #else
   #define log_message(level, message, ...)
 #endif
-//
\ No newline at end of file
@@ -0,0 +1,36 @@
+#pragma once
+#include "simd.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// plucked string: a noise burst circulates in a delay line through a loop
+// filter (karplus-strong). the delay lines live in one pool that initSynth
+// allocates, a note start only fills its ring, nothing is allocated
+
+#define WAVEGUIDE_RING 2048 // power of two, the longest delay in samples
+#define WAVEGUIDE_MASK (WAVEGUIDE_RING - 1)
+// the slots are a cache line longer than the ring, so voices that write at
+// the same ring position land in different cache sets
+#define WAVEGUIDE_SLOT_FLOATS (WAVEGUIDE_RING + 16)
+#define WAVEGUIDE_GUARD 8 // floats before the ring, see waveguideRender
+
+typedef struct Waveguide {
+  float *ring;  // WAVEGUIDE_RING floats, ring[-2] and ring[-1] mirror the end
+  int active;   // 0 is off, the voice uses its oscillator
+  int write;    // ring index of the next output sample
+  int delay;    // whole samples of the loop, at least SIMD_WIDTH
+  float taps[3]; // y[n] = taps . (y[n-delay], y[n-delay-1], y[n-delay-2])
+  float freq;    // the taps are for this freq
+  float decay;   // seconds to -60 dB
+  float damping; // weight of the older sample in the loop lowpass, 0 to 0.5
+} Waveguide;
+
+// ring points into a slot of WAVEGUIDE_SLOT_FLOATS
+void waveguideInit(Waveguide *w, float *slot);
+// fills the delay line with a noise burst, position 0 to 1 along the string
+// is where it is plucked, brightness 0 to 1 sets the loop lowpass
+void waveguideStart(Waveguide *w, float freq, int sample_rate, float decay,
+                    float brightness, float position, uint32_t *rng);
+// writes n samples to out
+void waveguideRender(Waveguide *w, float freq, int sample_rate, float *out,
+                     size_t n);
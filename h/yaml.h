@@ -1,12 +1,23 @@
 #ifndef YAML_H
 #define YAML_H
 
+#include "arena.h"
 #include "hash.h"
 
 /*
 originally from https://github.com/pbrandt1/yaml with some fixes and changes
+rewritten as a single pass over the mmapped file, keys and values live in
+the document's arena and are released together by yaml_free
 */
 
-hash_t * yaml_read(char *file);
+#define YAML_MAX_DEPTH 16
+
+typedef struct yaml_doc {
+  hash_t *hash; // "section.key" -> value, both point into arena
+  arena_t arena;
+} yaml_doc_t;
+
+yaml_doc_t *yaml_read(const char *file);
+void yaml_free(yaml_doc_t *doc);
 
 #endif
@@ -0,0 +1,112 @@
+#include "additive.h"
+#include <math.h>
+#include <string.h>
+
+void additiveInit(Additive *a, float *mem) {
+  memset(a, 0, sizeof(*a));
+  a->re = mem;
+  a->im = a->re + ADDITIVE_MAX_PARTIALS;
+  a->rot_re = a->im + ADDITIVE_MAX_PARTIALS;
+  a->rot_im = a->rot_re + ADDITIVE_MAX_PARTIALS;
+  a->level = a->rot_im + ADDITIVE_MAX_PARTIALS;
+  a->ratio = a->level + ADDITIVE_MAX_PARTIALS;
+}
+
+void additiveStart(Additive *a, int count, float tilt, float stretch) {
+  if (count > ADDITIVE_MAX_PARTIALS)
+    count = ADDITIVE_MAX_PARTIALS;
+  a->count = count > 0 ? count : 0;
+  a->active = 0;
+  a->freq = 0.0f; // retuned on the first render
+  if (stretch < 0.0f)
+    stretch = 0.0f; // keeps the ratios rising, culling relies on it
+
+  double power = 0.0;
+  for (int k = 0; k < a->count; k++) {
+    float n = k + 1;
+    a->ratio[k] = n * sqrtf(1.0f + stretch * n * n);
+    a->level[k] = powf(n, -tilt);
+    power += (double)a->level[k] * a->level[k];
+  }
+  float norm = power > 0.0 ? (float)(1.0 / sqrt(power)) : 0.0f;
+  for (int k = 0; k < a->count; k++) {
+    a->level[k] *= norm;
+    // every partial starts at phase 0, the note starts from silence
+    a->re[k] = 1.0f;
+    a->im[k] = 0.0f;
+  }
+  // the last pass can run past count, those lanes must stay silent
+  for (int k = a->count; k < ADDITIVE_MAX_PARTIALS && k % ADDITIVE_LANES; k++)
+    a->level[k] = a->ratio[k] = 0.0f;
+}
+
+// rotations for a new fundamental, partials past the last one below
+// nyquist are culled from the render loop
+static void additiveRetune(Additive *a, float freq, int sample_rate) {
+  float nyquist = sample_rate / 2;
+  float w0 = 2.0f * (float)M_PI * freq / sample_rate;
+  int active = 0;
+  for (int k = 0; k < a->count; k++) {
+    float w = w0 * a->ratio[k];
+    a->rot_re[k] = cosf(w);
+    a->rot_im[k] = sinf(w);
+    if (freq * a->ratio[k] < nyquist)
+      active = k + 1;
+  }
+  a->active = (active + ADDITIVE_LANES - 1) & ~(ADDITIVE_LANES - 1);
+  a->freq = freq;
+}
+
+void additiveRender(Additive *a, float freq, int sample_rate, float *out,
+                    float *scratch, size_t n) {
+  if (freq != a->freq)
+    additiveRetune(a, freq, sample_rate);
+
+  v4f nyquist = v4f_set1(sample_rate / 2);
+  v4f *acc = (v4f *)scratch;
+  for (size_t t = 0; t < n; t++)
+    acc[t] = v4f_set1(0.0f);
+
+  // each phasor update depends on the previous sample, ADDITIVE_LANES
+  // independent vectors per pass keep the multipliers busy instead of
+  // waiting on that chain
+  for (int k = 0; k < a->active; k += ADDITIVE_LANES) {
+    v4f re[ADDITIVE_VECTORS], im[ADDITIVE_VECTORS], c[ADDITIVE_VECTORS],
+        s[ADDITIVE_VECTORS], level[ADDITIVE_VECTORS];
+    for (int j = 0; j < ADDITIVE_VECTORS; j++) {
+      int p = k + j * SIMD_WIDTH;
+      re[j] = v4f_load(&a->re[p]);
+      im[j] = v4f_load(&a->im[p]);
+      c[j] = v4f_load(&a->rot_re[p]);
+      s[j] = v4f_load(&a->rot_im[p]);
+      // lanes past count have level 0, the ones above nyquist in the last
+      // pass are masked here
+      level[j] = v4f_select(v4f_load(&a->ratio[p]) * freq < nyquist,
+                            v4f_load(&a->level[p]), v4f_set1(0.0f));
+    }
+
+    for (size_t t = 0; t < n; t++) {
+      v4f sum = acc[t];
+      for (int j = 0; j < ADDITIVE_VECTORS; j++) {
+        sum += im[j] * level[j];
+        v4f r = re[j] * c[j] - im[j] * s[j];
+        im[j] = re[j] * s[j] + im[j] * c[j];
+        re[j] = r;
+      }
+      acc[t] = sum;
+    }
+
+    // rounding makes the phasors drift off the unit circle, one newton
+    // step per block pulls them back
+    for (int j = 0; j < ADDITIVE_VECTORS; j++) {
+      int p = k + j * SIMD_WIDTH;
+      v4f g = v4f_set1(1.5f) -
+              v4f_set1(0.5f) * (re[j] * re[j] + im[j] * im[j]);
+      v4f_store(&a->re[p], re[j] * g);
+      v4f_store(&a->im[p], im[j] * g);
+    }
+  }
+
+  for (size_t t = 0; t < n; t++)
+    out[t] += v4f_sum(acc[t]);
+}
@@ -0,0 +1,413 @@
+#include "analyzer.h"
+#include "metrics.h"
+#include "synth.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// output samples, written by the audio thread only. write_pos counts every
+// sample ever published, the ring holds the last ANALYZER_RING_SIZE of them
+static float ring[ANALYZER_RING_SIZE];
+static _Atomic uint64_t write_pos = 0;
+
+void analyzer_defaults(analyzer_cfg_t *cfg) {
+  *cfg = (analyzer_cfg_t){.port = ANALYZER_DEFAULT_PORT,
+                          .fft_size = 2048,
+                          .overlap = 0.5f,
+                          .frame_rate = 30,
+                          .bins = 64,
+                          .min_freq = 20.0f};
+}
+
+static int is_power_of_two(int n) { return n > 0 && !(n & (n - 1)); }
+
+void analyzer_apply_config(analyzer_cfg_t *cfg, hash_t *config) {
+  char *str;
+
+  if ((str = hash_get(config, "analyzer.port")))
+    cfg->port = atoi(str);
+  if ((str = hash_get(config, "analyzer.size"))) {
+    int size = atoi(str);
+    if (is_power_of_two(size) && size >= ANALYZER_MIN_FFT &&
+        size <= ANALYZER_MAX_FFT)
+      cfg->fft_size = size;
+    else
+      log_message(ERROR, "analyzer.size must be a power of two in %d..%d",
+                  ANALYZER_MIN_FFT, ANALYZER_MAX_FFT);
+  }
+  if ((str = hash_get(config, "analyzer.overlap"))) {
+    float overlap = strtof(str, NULL);
+    if (overlap >= 0.0f && overlap <= 0.9375f)
+      cfg->overlap = overlap;
+    else
+      log_message(ERROR, "analyzer.overlap must be within 0..0.9375");
+  }
+  if ((str = hash_get(config, "analyzer.fps"))) {
+    int fps = atoi(str);
+    if (fps > 0 && fps <= 240)
+      cfg->frame_rate = fps;
+    else
+      log_message(ERROR, "analyzer.fps must be within 1..240");
+  }
+  if ((str = hash_get(config, "analyzer.bins"))) {
+    int bins = atoi(str);
+    if (bins > 0 && bins <= ANALYZER_MAX_BINS)
+      cfg->bins = bins;
+    else
+      log_message(ERROR, "analyzer.bins must be within 1..%d",
+                  ANALYZER_MAX_BINS);
+  }
+  if ((str = hash_get(config, "analyzer.min_freq")))
+    cfg->min_freq = strtof(str, NULL);
+}
+
+// audio thread, once per block: a copy and one release store
+void analyzer_publish(const float *signal, size_t n) {
+  uint64_t pos = atomic_load_explicit(&write_pos, memory_order_relaxed);
+  size_t start = pos & (ANALYZER_RING_SIZE - 1);
+  size_t first = n < ANALYZER_RING_SIZE - start ? n : ANALYZER_RING_SIZE - start;
+
+  memcpy(ring + start, signal, first * sizeof(float));
+  memcpy(ring, signal + first, (n - first) * sizeof(float));
+  atomic_store_explicit(&write_pos, pos + n, memory_order_release);
+}
+
+// copies the window that ends at end, false if the audio thread may have
+// written over part of it. it writes a block past write_pos before it
+// publishes it, so the block in flight counts too
+static bool read_window(float *out, uint64_t end, size_t n) {
+  uint64_t start = end - n;
+  for (size_t i = 0; i < n; i++)
+    out[i] = ring[(start + i) & (ANALYZER_RING_SIZE - 1)];
+
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t pos = atomic_load_explicit(&write_pos, memory_order_relaxed);
+  return pos + MAX_STREAM_BUFFER_SIZE - start <= ANALYZER_RING_SIZE;
+}
+
+typedef struct analyzer {
+  analyzer_cfg_t cfg;
+  int sample_rate;
+  int hop;
+
+  float *window;     // hann
+  float *cos_table;  // fft twiddles, fft_size / 2 each
+  float *sin_table;
+  uint32_t *bit_reverse;
+  float *re, *im;
+  float *power;      // averaged |X|^2 per fft bin, fft_size / 2 + 1
+  int *bin_edges;    // first fft bin of each log bin, bins + 1 entries
+  float norm_db;     // full scale sine to 0 dB
+
+  int listen_fd;
+  int clients[ANALYZER_MAX_CLIENTS];
+  uint8_t *frame;    // header and bins, sent as one write
+} analyzer_t;
+
+static bool init_tables(analyzer_t *a) {
+  int n = a->cfg.fft_size;
+
+  a->window = malloc(n * sizeof(float));
+  a->cos_table = malloc(n / 2 * sizeof(float));
+  a->sin_table = malloc(n / 2 * sizeof(float));
+  a->bit_reverse = malloc(n * sizeof(uint32_t));
+  a->re = malloc(n * sizeof(float));
+  a->im = malloc(n * sizeof(float));
+  a->power = malloc((n / 2 + 1) * sizeof(float));
+  a->bin_edges = malloc((a->cfg.bins + 1) * sizeof(int));
+  a->frame = malloc(sizeof(spectrum_frame_header_t) + a->cfg.bins);
+  if (!a->window || !a->cos_table || !a->sin_table || !a->bit_reverse ||
+      !a->re || !a->im || !a->power || !a->bin_edges || !a->frame)
+    return false;
+
+  for (int i = 0; i < n; i++)
+    a->window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / n);
+  for (int i = 0; i < n / 2; i++) {
+    a->cos_table[i] = cosf(2.0f * (float)M_PI * i / n);
+    a->sin_table[i] = -sinf(2.0f * (float)M_PI * i / n);
+  }
+
+  int bits = 0;
+  while ((1 << bits) < n)
+    bits++;
+  for (int i = 0; i < n; i++) {
+    uint32_t r = 0;
+    for (int b = 0; b < bits; b++)
+      r |= ((i >> b) & 1) << (bits - 1 - b);
+    a->bit_reverse[i] = r;
+  }
+
+  // a hann windowed sine of amplitude 1 peaks at n / 4
+  a->norm_db = 20.0f * log10f(n / 4.0f);
+
+  // log spaced edges, a bin narrower than the fft resolution still gets
+  // the one fft bin its edge falls into
+  float nyquist = a->sample_rate / 2.0f;
+  float min_freq = a->cfg.min_freq > 0.0f && a->cfg.min_freq < nyquist
+                       ? a->cfg.min_freq
+                       : 20.0f;
+  a->cfg.min_freq = min_freq;
+  for (int b = 0; b <= a->cfg.bins; b++) {
+    float f = min_freq * powf(nyquist / min_freq, (float)b / a->cfg.bins);
+    int k = (int)(f * n / a->sample_rate);
+    a->bin_edges[b] = k > n / 2 ? n / 2 : k;
+  }
+  return true;
+}
+
+// in place radix 2 on re/im
+static void fft(analyzer_t *a) {
+  int n = a->cfg.fft_size;
+  float *re = a->re, *im = a->im;
+
+  for (int i = 0; i < n; i++) {
+    uint32_t j = a->bit_reverse[i];
+    if (j > (uint32_t)i) {
+      float t = re[i];
+      re[i] = re[j];
+      re[j] = t;
+      t = im[i];
+      im[i] = im[j];
+      im[j] = t;
+    }
+  }
+
+  for (int len = 2; len <= n; len <<= 1) {
+    int half = len / 2, step = n / len;
+    for (int i = 0; i < n; i += len) {
+      for (int k = 0; k < half; k++) {
+        float wr = a->cos_table[k * step], wi = a->sin_table[k * step];
+        float *ur = &re[i + k], *ui = &im[i + k];
+        float *vr = &re[i + k + half], *vi = &im[i + k + half];
+        float tr = *vr * wr - *vi * wi;
+        float ti = *vr * wi + *vi * wr;
+        *vr = *ur - tr;
+        *vi = *ui - ti;
+        *ur += tr;
+        *ui += ti;
+      }
+    }
+  }
+}
+
+// adds the power spectrum of the window ending at end to a->power
+static bool analyze_window(analyzer_t *a, uint64_t end) {
+  int n = a->cfg.fft_size;
+  if (end < (uint64_t)n || !read_window(a->re, end, n))
+    return false;
+
+  for (int i = 0; i < n; i++) {
+    a->re[i] *= a->window[i];
+    a->im[i] = 0.0f;
+  }
+  fft(a);
+  for (int k = 0; k <= n / 2; k++)
+    a->power[k] += a->re[k] * a->re[k] + a->im[k] * a->im[k];
+  return true;
+}
+
+static void build_frame(analyzer_t *a, uint32_t frame, uint64_t end,
+                        int windows) {
+  spectrum_frame_header_t *h = (spectrum_frame_header_t *)a->frame;
+  *h = (spectrum_frame_header_t){.sample_time = end,
+                                 .magic = ANALYZER_MAGIC,
+                                 .frame = frame,
+                                 .min_freq = a->cfg.min_freq,
+                                 .max_freq = a->sample_rate / 2.0f,
+                                 .bins = a->cfg.bins,
+                                 .windows = windows};
+
+  uint8_t *out = a->frame + sizeof(*h);
+  for (int b = 0; b < a->cfg.bins; b++) {
+    int lo = a->bin_edges[b], hi = a->bin_edges[b + 1];
+    float sum = 0.0f;
+    if (hi <= lo)
+      hi = lo + 1;
+    for (int k = lo; k < hi; k++)
+      sum += a->power[k];
+
+    float db = 10.0f * log10f(sum / ((hi - lo) * windows) + 1e-20f) -
+               a->norm_db;
+    float scaled = (db - ANALYZER_FLOOR_DB) * (255.0f / -ANALYZER_FLOOR_DB);
+    out[b] = scaled < 0.0f ? 0 : scaled > 255.0f ? 255 : (uint8_t)scaled;
+  }
+}
+
+static void accept_clients(analyzer_t *a) {
+  int fd;
+  while ((fd = accept(a->listen_fd, NULL, NULL)) >= 0) {
+    int slot = -1;
+    for (int i = 0; i < ANALYZER_MAX_CLIENTS; i++)
+      if (a->clients[i] < 0) {
+        slot = i;
+        break;
+      }
+    if (slot < 0) {
+      log_message(ERROR, "analyzer: %d clients already, refusing",
+                  ANALYZER_MAX_CLIENTS);
+      close(fd);
+      continue;
+    }
+
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    a->clients[slot] = fd;
+    atomic_fetch_add_explicit(&g_metrics.analyzer_clients, 1,
+                              memory_order_relaxed);
+    log_message(INFO, "analyzer: client connected");
+  }
+}
+
+static void drop_client(analyzer_t *a, int i) {
+  close(a->clients[i]);
+  a->clients[i] = -1;
+  atomic_fetch_sub_explicit(&g_metrics.analyzer_clients, 1,
+                            memory_order_relaxed);
+  log_message(INFO, "analyzer: client disconnected");
+}
+
+// a client whose socket is full misses this frame, one that only took part
+// of it has lost the framing and is dropped
+static void send_frame(analyzer_t *a) {
+  size_t len = sizeof(spectrum_frame_header_t) + a->cfg.bins;
+  for (int i = 0; i < ANALYZER_MAX_CLIENTS; i++) {
+    if (a->clients[i] < 0)
+      continue;
+
+    ssize_t sent = send(a->clients[i], a->frame, len, MSG_NOSIGNAL);
+    if (sent == (ssize_t)len)
+      metrics_net_out(sent);
+    else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      atomic_fetch_add_explicit(&g_metrics.analyzer_frames_skipped, 1,
+                                memory_order_relaxed);
+    else
+      drop_client(a, i);
+  }
+}
+
+static int listen_on(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(port),
+                             .sin_addr.s_addr = INADDR_ANY};
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 4) < 0) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  return fd;
+}
+
+static void timespec_add_ns(struct timespec *t, long ns) {
+  t->tv_nsec += ns;
+  while (t->tv_nsec >= 1000000000L) {
+    t->tv_nsec -= 1000000000L;
+    t->tv_sec++;
+  }
+}
+
+static void *analyzer_thread(void *arg) {
+  analyzer_t *a = arg;
+  log_thread_init();
+
+  long period_ns = 1000000000L / a->cfg.frame_rate;
+  uint64_t analyzed = atomic_load_explicit(&write_pos, memory_order_acquire);
+  uint32_t frame = 0;
+
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while (1) {
+    timespec_add_ns(&next, period_ns);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    // more than a frame late, the frames in between are not made up
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long late_ns = (now.tv_sec - next.tv_sec) * 1000000000L +
+                   (now.tv_nsec - next.tv_nsec);
+    if (late_ns > period_ns) {
+      atomic_fetch_add_explicit(&g_metrics.analyzer_frames_skipped,
+                                late_ns / period_ns, memory_order_relaxed);
+      next = now;
+    }
+
+    accept_clients(a);
+
+    uint64_t pos = atomic_load_explicit(&write_pos, memory_order_acquire);
+    if (pos < (uint64_t)a->cfg.fft_size)
+      continue;
+    if (analyzed < (uint64_t)a->cfg.fft_size)
+      analyzed = a->cfg.fft_size - a->hop;
+
+    uint64_t pending = (pos - analyzed) / a->hop;
+    if (pending == 0)
+      continue; // output stalled, nothing new to show
+    analyzed += pending * a->hop;
+
+    // only the newest windows, never a backlog
+    int windows = pending > ANALYZER_MAX_WINDOWS ? ANALYZER_MAX_WINDOWS
+                                                 : (int)pending;
+    memset(a->power, 0, (a->cfg.fft_size / 2 + 1) * sizeof(float));
+    int done = 0;
+    for (int w = windows - 1; w >= 0; w--)
+      done += analyze_window(a, analyzed - (uint64_t)w * a->hop);
+    if (done == 0)
+      continue;
+
+    build_frame(a, frame++, analyzed, done);
+    atomic_fetch_add_explicit(&g_metrics.analyzer_frames, 1,
+                              memory_order_relaxed);
+    send_frame(a);
+  }
+  return NULL;
+}
+
+void analyzer_start(const analyzer_cfg_t *cfg, int sample_rate) {
+  if (cfg->port <= 0)
+    return;
+
+  static analyzer_t a;
+  a.cfg = *cfg;
+  a.sample_rate = sample_rate;
+  a.hop = (int)(cfg->fft_size * (1.0f - cfg->overlap));
+  if (a.hop < 1)
+    a.hop = 1;
+  for (int i = 0; i < ANALYZER_MAX_CLIENTS; i++)
+    a.clients[i] = -1;
+
+  if (!init_tables(&a)) {
+    log_message(ERROR, "analyzer: could not allocate fft tables");
+    return;
+  }
+  if ((a.listen_fd = listen_on(cfg->port)) < 0) {
+    log_message(ERROR, "analyzer: could not listen on port %d", cfg->port);
+    return;
+  }
+  log_message(INFO, "analyzer: %d point fft, hop %d, %d bins at %d fps on "
+              "port %d", cfg->fft_size, a.hop, cfg->bins, cfg->frame_rate,
+              cfg->port);
+
+  pthread_t t;
+  pthread_create(&t, NULL, analyzer_thread, &a);
+  pthread_detach(t);
+}
@@ -0,0 +1,42 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+void *arena_alloc(arena_t *a, size_t size) {
+  size = (size + 7) & ~(size_t)7;
+
+  arena_chunk_t *c = a->head;
+  if (!c || c->size - c->used < size) {
+    size_t chunk = size > ARENA_MIN_CHUNK ? size : ARENA_MIN_CHUNK;
+    c = malloc(sizeof(arena_chunk_t) + chunk);
+    if (!c)
+      return NULL;
+    c->next = a->head;
+    c->used = 0;
+    c->size = chunk;
+    a->head = c;
+  }
+
+  void *p = c->data + c->used;
+  c->used += size;
+  return p;
+}
+
+char *arena_strndup(arena_t *a, const char *s, size_t len) {
+  char *p = arena_alloc(a, len + 1);
+  if (!p)
+    return NULL;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+void arena_free(arena_t *a) {
+  arena_chunk_t *c = a->head;
+  while (c) {
+    arena_chunk_t *next = c->next;
+    free(c);
+    c = next;
+  }
+  a->head = NULL;
+}
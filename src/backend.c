@@ -0,0 +1,330 @@
+#include "backend.h"
+#include "shmring.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "portaudio.h"
+
+// backends without a device clock sleep until the next block is due. a block
+// that comes more than one period late is an xrun and the clock restarts
+typedef struct pacer {
+  struct timespec next; // zero until the first block
+  long period_ns;
+} pacer_t;
+
+static void pacer_init(pacer_t *p, int sample_rate, size_t buffer_size) {
+  p->period_ns = (long)(1000000000.0 * buffer_size / sample_rate);
+  p->next = (struct timespec){0};
+}
+
+static BackendStatus pacer_wait(pacer_t *p) {
+  // the clock starts with the first block and not at open, the synth and
+  // the threads set up in between would otherwise count as lateness
+  if (!p->next.tv_sec && !p->next.tv_nsec)
+    clock_gettime(CLOCK_MONOTONIC, &p->next);
+  p->next.tv_nsec += p->period_ns;
+  while (p->next.tv_nsec >= 1000000000L) {
+    p->next.tv_nsec -= 1000000000L;
+    p->next.tv_sec++;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long late_ns = (now.tv_sec - p->next.tv_sec) * 1000000000L +
+                 (now.tv_nsec - p->next.tv_nsec);
+  if (late_ns > p->period_ns) {
+    p->next = now;
+    return BACKEND_XRUN;
+  }
+
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &p->next, NULL);
+  return BACKEND_OK;
+}
+
+// portaudio, blocking writes on the default output device
+
+static bool pa_open(audio_backend_t *b, const char *arg, int sample_rate,
+                    size_t buffer_size, int channels) {
+  (void)arg;
+  PaStream *stream;
+  PaError err = Pa_Initialize();
+  if (err == paNoError)
+    err = Pa_OpenDefaultStream(&stream, 0, channels, paFloat32, sample_rate,
+                               buffer_size, NULL, NULL);
+  if (err == paNoError)
+    err = Pa_StartStream(stream);
+  if (err != paNoError) {
+    log_message(ERROR, "portaudio: %s", Pa_GetErrorText(err));
+    return false;
+  }
+  b->state = stream;
+  return true;
+}
+
+static BackendStatus pa_write(audio_backend_t *b, const float *block,
+                              size_t frames) {
+  PaError err = Pa_WriteStream(b->state, block, frames);
+  if (err == paOutputUnderflowed)
+    return BACKEND_XRUN;
+  return err == paNoError ? BACKEND_OK : BACKEND_ERROR;
+}
+
+static void pa_close(audio_backend_t *b) {
+  Pa_StopStream(b->state);
+  Pa_CloseStream(b->state);
+  Pa_Terminate();
+}
+
+// null, renders as fast as the cpu allows unless paced
+
+static bool null_open(audio_backend_t *b, const char *arg, int sample_rate,
+                      size_t buffer_size, int channels) {
+  (void)channels;
+  if (!arg)
+    return true;
+  if (strcmp(arg, "paced")) {
+    log_message(ERROR, "null: unknown option %s", arg);
+    return false;
+  }
+  pacer_t *p = malloc(sizeof(pacer_t));
+  if (!p)
+    return false;
+  pacer_init(p, sample_rate, buffer_size);
+  b->state = p;
+  return true;
+}
+
+static BackendStatus null_write(audio_backend_t *b, const float *block,
+                                size_t frames) {
+  (void)block;
+  (void)frames;
+  return b->state ? pacer_wait(b->state) : BACKEND_OK;
+}
+
+static void null_close(audio_backend_t *b) { free(b->state); }
+
+// wav, 32 bit float, interleaved channels. the process usually ends with
+// exit() from the networking thread while this one is writing, so instead
+// of relying on close the header sizes are brought up to date about once a
+// second
+
+typedef struct wav_state {
+  FILE *f;
+  int sample_rate;
+  int channels;
+  uint32_t frames;
+  pacer_t pacer;
+} wav_state_t;
+
+typedef struct wav_header {
+  char riff[4];
+  uint32_t riff_size;
+  char wave[4];
+  char fmt[4];
+  uint32_t fmt_size;
+  uint16_t format; // 3, ieee float
+  uint16_t channels;
+  uint32_t sample_rate;
+  uint32_t byte_rate;
+  uint16_t block_align;
+  uint16_t bits;
+  char data[4];
+  uint32_t data_size;
+} wav_header_t;
+
+static void wav_write_header(wav_state_t *w) {
+  uint32_t frame_size = w->channels * sizeof(float);
+  uint32_t data_size = w->frames * frame_size;
+  wav_header_t h = {.riff = {'R', 'I', 'F', 'F'},
+                    .riff_size = 36 + data_size,
+                    .wave = {'W', 'A', 'V', 'E'},
+                    .fmt = {'f', 'm', 't', ' '},
+                    .fmt_size = 16,
+                    .format = 3,
+                    .channels = w->channels,
+                    .sample_rate = w->sample_rate,
+                    .byte_rate = w->sample_rate * frame_size,
+                    .block_align = frame_size,
+                    .bits = 32,
+                    .data = {'d', 'a', 't', 'a'},
+                    .data_size = data_size};
+  fseek(w->f, 0, SEEK_SET);
+  fwrite(&h, sizeof(h), 1, w->f);
+  fseek(w->f, 0, SEEK_END);
+}
+
+static bool wav_open(audio_backend_t *b, const char *arg, int sample_rate,
+                     size_t buffer_size, int channels) {
+  if (!arg) {
+    log_message(ERROR, "wav: needs a path, wav:out.wav");
+    return false;
+  }
+  wav_state_t *w = calloc(1, sizeof(wav_state_t));
+  if (!w || !(w->f = fopen(arg, "wb"))) {
+    log_message(ERROR, "wav: could not open %s", arg);
+    free(w);
+    return false;
+  }
+  w->sample_rate = sample_rate;
+  w->channels = channels;
+  wav_write_header(w);
+  pacer_init(&w->pacer, sample_rate, buffer_size);
+  b->state = w;
+  return true;
+}
+
+static BackendStatus wav_write(audio_backend_t *b, const float *block,
+                               size_t frames) {
+  wav_state_t *w = b->state;
+  size_t samples = frames * w->channels;
+  if (fwrite(block, sizeof(float), samples, w->f) != samples) {
+    log_message(ERROR, "wav: write failed");
+    return BACKEND_ERROR;
+  }
+  uint32_t before = w->frames / w->sample_rate;
+  w->frames += frames;
+  if (w->frames / w->sample_rate != before)
+    wav_write_header(w);
+  return pacer_wait(&w->pacer);
+}
+
+static void wav_close(audio_backend_t *b) {
+  wav_state_t *w = b->state;
+  wav_write_header(w);
+  fclose(w->f);
+  free(w);
+}
+
+// shm, a lock free ring in posix shared memory, readers map it and use the
+// samples in place
+
+#define SHM_RING_SECONDS 2 // capacity, rounded up to a power of two
+
+// the name goes away with the process, readers keep their mapping
+static char shm_unlink_name[64];
+static void shm_unlink_at_exit(void) { shm_unlink(shm_unlink_name); }
+
+typedef struct shm_state {
+  char name[64];
+  shm_ring_header_t *ring;
+  size_t size;
+  pacer_t pacer;
+} shm_state_t;
+
+static bool shm_open_backend(audio_backend_t *b, const char *arg,
+                             int sample_rate, size_t buffer_size,
+                             int channels) {
+  shm_state_t *s = calloc(1, sizeof(shm_state_t));
+  if (!s)
+    return false;
+  snprintf(s->name, sizeof(s->name), "%s", arg ? arg : SHM_RING_DEFAULT_NAME);
+
+  uint32_t capacity = 1;
+  while (capacity < (uint32_t)sample_rate * SHM_RING_SECONDS ||
+         capacity < 2 * buffer_size)
+    capacity <<= 1;
+  s->size = shm_ring_size(capacity, channels);
+
+  int fd = shm_open(s->name, O_CREAT | O_RDWR, 0644);
+  if (fd < 0 || ftruncate(fd, s->size) < 0) {
+    log_message(ERROR, "shm: could not create %s: %s", s->name,
+                strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    free(s);
+    return false;
+  }
+  s->ring = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (s->ring == MAP_FAILED) {
+    log_message(ERROR, "shm: could not map %s", s->name);
+    shm_unlink(s->name);
+    free(s);
+    return false;
+  }
+
+  // readers check the magic last, so it is written after everything else
+  memset(s->ring, 0, s->size);
+  s->ring->version = SHM_RING_VERSION;
+  s->ring->sample_rate = sample_rate;
+  s->ring->channels = channels;
+  s->ring->capacity = capacity;
+  s->ring->block_frames = buffer_size;
+  atomic_store_explicit(&s->ring->write_pos, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  s->ring->magic = SHM_RING_MAGIC;
+
+  pacer_init(&s->pacer, sample_rate, buffer_size);
+  b->state = s;
+  snprintf(shm_unlink_name, sizeof(shm_unlink_name), "%s", s->name);
+  atexit(shm_unlink_at_exit);
+  log_message(INFO, "shm: %s, %u frames", s->name, capacity);
+  return true;
+}
+
+static BackendStatus shm_write(audio_backend_t *b, const float *block,
+                               size_t frames) {
+  shm_state_t *s = b->state;
+  shm_ring_header_t *h = s->ring;
+  float *data = shm_ring_data(h);
+
+  uint64_t pos = atomic_load_explicit(&h->write_pos, memory_order_relaxed);
+  size_t start = shm_ring_index(h, pos);
+  size_t first = frames < h->capacity - start ? frames : h->capacity - start;
+  size_t c = h->channels;
+  memcpy(data + start * c, block, first * c * sizeof(float));
+  memcpy(data, block + first * c, (frames - first) * c * sizeof(float));
+  atomic_store_explicit(&h->write_pos, pos + frames, memory_order_release);
+
+  return pacer_wait(&s->pacer);
+}
+
+static void shm_close(audio_backend_t *b) {
+  shm_state_t *s = b->state;
+  munmap(s->ring, s->size);
+  shm_unlink(s->name);
+  free(s);
+}
+
+static audio_backend_t backends[] = {
+    {"portaudio", pa_open, pa_write, pa_close, NULL},
+    {"null", null_open, null_write, null_close, NULL},
+    {"wav", wav_open, wav_write, wav_close, NULL},
+    {"shm", shm_open_backend, shm_write, shm_close, NULL},
+};
+
+audio_backend_t *backend_open(const char *spec, int sample_rate,
+                              size_t buffer_size, int channels) {
+  char name[32];
+  const char *arg = strchr(spec, ':');
+  size_t len = arg ? (size_t)(arg - spec) : strlen(spec);
+  snprintf(name, sizeof(name), "%.*s", (int)len, spec);
+  if (arg)
+    arg++;
+
+  for (size_t i = 0; i < sizeof(backends) / sizeof(*backends); i++) {
+    audio_backend_t *b = &backends[i];
+    if (strcmp(b->name, name))
+      continue;
+    if (!b->open(b, arg, sample_rate, buffer_size, channels))
+      return NULL;
+    log_message(INFO, "output: %s", spec);
+    return b;
+  }
+
+  log_message(ERROR, "unknown audio backend %s, expected portaudio, null, "
+              "wav or shm", name);
+  return NULL;
+}
+
+void backend_close(audio_backend_t *b) {
+  if (b)
+    b->close(b);
+}
@@ -1,51 +1,154 @@
 #include "commands.h"
+#include "events.h"
 #include "hash.h"
+#include "metrics.h"
+#include "networking.h"
+#include "profiler.h"
+#include "sequencer.h"
 #include "synth.h"
 #include "utils.h"
+#include <math.h>
 #include <stdatomic.h>
+#include <stdlib.h>
 
 static char keyMappings[NUM_KEYS] = {'a', 's', 'd', 'f', 'g', 'h',
                                      'j', 'k', 'l', ';', '\''};
-static int semitoneOffsets[NUM_KEYS] = {-9, -7, -5, -4, -2, 0,
-                                        2,  3,  5,  7,  8,  10};
-static key_state_t keyStates[NUM_KEYS] = {};
+// the midi note each key plays through the tuning table, white keys from
+// middle C
+static uint8_t keyNotes[NUM_KEYS] = {60, 62, 64, 65, 67, 69,
+                                     71, 72, 74, 76, 77, 79};
+// per part, a note on a channel is routed to every part listening on it
+static key_state_t keyStates[NUM_PARTS][NUM_KEYS] = {};
+// per note expression, held until the next event for the key
+typedef struct expression {
+  float bend; // semitones
+  float pressure;
+  float timbre;
+} expression_t;
+static expression_t expressions[NUM_PARTS][NUM_KEYS];
 
-static void key_state_update(key_state_t *ks, bool pressed) {
+static void key_state_update(key_state_t *ks, bool pressed, bool retrigger) {
   if (ks->val != pressed) {
     ks->val = pressed;
     ks->change = true;
+    ks->retrigger = pressed && retrigger;
   }
 }
 
 // refactor this so it can handle multiple arguments if needed
-static command_map_t cmd_map[] = {
-    {"set", key_pressed}, {"res", key_released}, {NULL, NULL}};
+static command_map_t cmd_map[] = {{"set", key_pressed},
+                                   {"res", key_released},
+                                   {"stats", stats},
+                                   {"prg", program_change},
+                                   {"tun", set_tuning},
+                                   {"seq", sequencer_transport},
+                                   {"prof", write_profile},
+                                   {"snap", save_snapshot},
+                                   {NULL, NULL}};
 
-void set_key_pressed(char key, bool pressed) {
+// control thread side: turns a key character into an event for the audio
+// thread, keyStates itself is only touched by the audio thread
+void set_key_pressed(char key, bool pressed, int channel) {
   for (int i = 0; i < NUM_KEYS; ++i) {
     if (keyMappings[i] == key) {
-      key_state_update(&keyStates[i], pressed);
+      synth_event_t ev = {.type = pressed ? EVENT_NOTE_ON : EVENT_NOTE_OFF,
+                          .note = i,
+                          .channel = channel};
+      if (!event_push(&g_control_events, &ev))
+        log_message(ERROR, "event queue full, dropped key %c", key);
       return;
     }
   }
 }
 
-void key_pressed(char *userdata) {
+void key_pressed(char *userdata, int channel) {
   if (strlen(userdata) != 1) {
     log_message(ERROR, "invalid command tail: %s",userdata);
     return;
   }
 
-  set_key_pressed(userdata[0], true);
+  set_key_pressed(userdata[0], true, channel);
 }
 
-void key_released(char *userdata) {
+void key_released(char *userdata, int channel) {
   if (strlen(userdata) != 1) {
     log_message(ERROR, "invalid command tail: %s",userdata);
     return;
   }
 
-  set_key_pressed(userdata[0], false);
+  set_key_pressed(userdata[0], false, channel);
+}
+
+// replies with the engine metrics, one "name value" per line
+void stats(char *userdata, int channel) {
+  (void)userdata;
+  (void)channel;
+  static char buf[2048];
+  size_t len = metrics_format_text(buf, sizeof(buf));
+  net_reply(buf, len);
+}
+
+// selects a program of the loaded bank for the parts on channel, applied at
+// the next block
+void program_change(char *userdata, int channel) {
+  char *end;
+  long program = strtol(userdata, &end, 10);
+  if (*userdata == '\0' || *end != '\0' || program < 0 ||
+      program >= PATCH_MAX_PROGRAMS) {
+    log_message(ERROR, "invalid program: %s", userdata);
+    return;
+  }
+  synth_event_t ev = {
+      .type = EVENT_PROGRAM, .channel = channel, .value = program};
+  if (!event_push(&g_control_events, &ev))
+    log_message(ERROR, "event queue full, dropped program change");
+}
+
+extern Synth *g_synth;
+
+// "tun path.scl" loads a scala scale with the default keyboard mapping, "tun
+// equal" goes back to equal temperament. a tuning applies to every channel
+void set_tuning(char *userdata, int channel) {
+  (void)channel;
+  tuning_t *t = !strcmp(userdata, "equal")
+                    ? tuning_equal(g_synth->sample_rate)
+                    : tuning_load(userdata, NULL, g_synth->sample_rate);
+  if (!t) {
+    log_message(ERROR, "invalid tuning: %s", userdata);
+    return;
+  }
+  tuning_publish(t);
+}
+
+// "seq start" and "seq stop" for the sequencer set up from a script, start
+// begins again from the first step at the next block
+void sequencer_transport(char *userdata, int channel) {
+  (void)channel;
+  bool start = !strcmp(userdata, "start");
+  if (!start && strcmp(userdata, "stop")) {
+    log_message(ERROR, "invalid sequencer command: %s", userdata);
+    return;
+  }
+  sequence_t *s = sequence_edit();
+  if (!s)
+    return;
+  s->running = start;
+  if (start)
+    s->start_time = atomic_load(&g_sample_clock);
+  sequence_publish(s);
+}
+
+// "prof trace.json" writes the spans the profiler holds, see profiler.h
+void write_profile(char *userdata, int channel) {
+  (void)channel;
+  profiler_dump(userdata);
+}
+
+// "snap state.snap" captures the engine at the next block boundary, see
+// snapshot.h
+void save_snapshot(char *userdata, int channel) {
+  (void)channel;
+  snapshot_save(userdata);
 }
 
 command_fn find_function_by_command(const char *command) {
@@ -57,28 +160,280 @@ command_fn find_function_by_command(const char *command) {
   return NULL;
 }
 
-void handle_keys(Synth *synth) {
-  for (int i = 0; i < NUM_KEYS; i++) {
-    Oscillator *osc = &synth->keyOscillators.osc[i];
-    key_state_t *ks = &keyStates[i];
+// every part listening on the event channel gets it, notes only within the
+// part's key range
+void applyEvent(Synth *synth, const synth_event_t *ev) {
+  for (int i = 0; i < NUM_PARTS; i++) {
+    Part *part = &synth->parts[i];
+    if (part->config.channel != ev->channel)
+      continue;
 
-    if (ks->val && ks->change &&
-        osc->envelope.state == OFF) { // key was just pressed, start attack
-      osc->freq = getFrequencyForSemitone(BASE_SEMITONE + semitoneOffsets[i]);;
-      osc->amplitude = 0.5f;
-      osc->shape_parameter_0 = 1.0f;
-      osc->envelope.state = ATTACK;
+    switch (ev->type) {
+    case EVENT_NOTE_ON:
+    case EVENT_NOTE_OFF:
+      if (ev->note >= part->config.key_low &&
+          ev->note <= part->config.key_high && ev->note < NUM_KEYS)
+        key_state_update(&keyStates[i][ev->note],
+                         ev->type == EVENT_NOTE_ON,
+                         ev->flags & EVENT_FLAG_SEQUENCER);
+      break;
+    case EVENT_PROGRAM:
+      selectProgram(synth, part, (int)ev->value);
+      break;
+    case EVENT_PARAM:
+      // edits go to a copy, the bank itself is a read only mapping
+      if (part->patch != &part->edit_patch) {
+        part->edit_patch = *part->patch;
+        part->patch = &part->edit_patch;
+      }
+      patchSetParam(&part->edit_patch, ev->note, ev->value);
+      break;
+    case EVENT_BEND:
+    case EVENT_PRESSURE:
+    case EVENT_TIMBRE:
+      if (ev->note >= part->config.key_low &&
+          ev->note <= part->config.key_high && ev->note < NUM_KEYS) {
+        expression_t *e = &expressions[i][ev->note];
+        if (ev->type == EVENT_BEND)
+          e->bend = fmaxf(-TUNING_BEND_RANGE,
+                          fminf(TUNING_BEND_RANGE, (float)ev->value));
+        else if (ev->type == EVENT_PRESSURE)
+          e->pressure = fmaxf(0.0f, fminf(1.0f, (float)ev->value));
+        else
+          e->timbre = fmaxf(-1.0f, fminf(1.0f, (float)ev->value));
+      }
+      break;
     }
+  }
+}
+
+// events waiting for their sample time, sorted, only the audio thread
+// touches it. a ring from pending_head, so applying the due ones moves
+// nothing however many are left
+static synth_event_t pending[EVENT_PENDING_SIZE];
+static size_t pending_head = 0;
+static size_t pending_count = 0;
+
+_Static_assert((EVENT_PENDING_SIZE & (EVENT_PENDING_SIZE - 1)) == 0,
+               "EVENT_PENDING_SIZE must be a power of two");
+
+// the i-th scheduled event in time order
+static inline synth_event_t *pendingAt(size_t i) {
+  return &pending[(pending_head + i) & (EVENT_PENDING_SIZE - 1)];
+}
+
+// sorted insert, events with equal times keep their arrival order. events
+// mostly arrive in time order, so the scan from the back is short
+bool scheduleEvent(const synth_event_t *ev) {
+  if (pending_count == EVENT_PENDING_SIZE)
+    return false;
+
+  size_t i = pending_count;
+  while (i > 0 && pendingAt(i - 1)->time > ev->time) {
+    *pendingAt(i) = *pendingAt(i - 1);
+    i--;
+  }
+  *pendingAt(i) = *ev;
+  pending_count++;
+  return true;
+}
+
+size_t scheduleRoom(void) { return EVENT_PENDING_SIZE - pending_count; }
+
+static event_queue_t *event_sources[] = {&g_control_events, &g_script_events};
+static const MetricsQueue event_source_metrics[] = {QUEUE_EVENTS,
+                                                    QUEUE_SCRIPT};
+// how full each source may fill the schedule
+static const size_t event_source_limit[] = {
+    EVENT_PENDING_SIZE, EVENT_PENDING_SIZE - EVENT_PENDING_RESERVED};
+
+// audio thread, once per block: moves everything queued since the last
+// block into the schedule. time 0 and times already past mean now. a full
+// schedule leaves events in their queue until there is room, the control
+// socket has the last EVENT_PENDING_RESERVED slots to itself
+void drainEvents(Synth *synth) {
+  for (size_t s = 0; s < sizeof(event_sources) / sizeof(*event_sources);
+       s++) {
+    event_queue_t *q = event_sources[s];
+    metrics_queue_depth(event_source_metrics[s], event_queue_depth(q));
 
-    if (ks->val && !ks->change && osc->envelope.state >= SUSTAIN) {
-      osc->envelope.state = SUSTAIN; // reset state
-      osc->envelope.sustain_time_elapsed = 0.0f;
+    synth_event_t ev;
+    while (pending_count < event_source_limit[s] && event_pop(q, &ev)) {
+      if (ev.time < synth->sample_clock)
+        ev.time = synth->sample_clock;
+      scheduleEvent(&ev);
     }
+  }
+  metrics_queue_depth(QUEUE_PENDING, pending_count);
+}
+
+// applies every scheduled event due at or before time and hands it to the
+// event log, returns the time of the next one or UINT64_MAX
+uint64_t applyDueEvents(Synth *synth, uint64_t time) {
+  while (pending_count && pendingAt(0)->time <= time) {
+    // a copy, applying it may schedule into the slot it leaves
+    synth_event_t ev = *pendingAt(0);
+    pending_head = (pending_head + 1) & (EVENT_PENDING_SIZE - 1);
+    pending_count--;
+    // keys the arpeggiator holds are neither played nor recorded, the
+    // notes it plays instead are
+    if (!sequencerTakes(&ev)) {
+      applyEvent(synth, &ev);
+      event_record(&ev);
+    }
+  }
+  return pending_count ? pendingAt(0)->time : UINT64_MAX;
+}
+
+// forgets held keys and scheduled events, used before replaying into a
+// fresh synth
+void resetKeys(void) {
+  memset(keyStates, 0, sizeof(keyStates));
+  memset(expressions, 0, sizeof(expressions));
+  clearSchedule();
+}
+
+// held keys, expression and the schedule, see snapshot.h
+void saveEventState(snap_buf_t *b) {
+  snapPut(b, keyStates, sizeof(keyStates));
+  snapPut(b, expressions, sizeof(expressions));
+  uint32_t count = pending_count;
+  snapPut(b, &count, sizeof(count));
+  for (size_t i = 0; i < pending_count; i++)
+    snapPut(b, pendingAt(i), sizeof(synth_event_t));
+}
+
+bool loadEventState(snap_buf_t *b) {
+  uint32_t count;
+  snapGet(b, keyStates, sizeof(keyStates));
+  snapGet(b, expressions, sizeof(expressions));
+  snapGet(b, &count, sizeof(count));
+  if (count > EVENT_PENDING_SIZE)
+    return false;
+  snapGet(b, pending, count * sizeof(synth_event_t));
+  pending_head = 0;
+  pending_count = b->failed ? 0 : count;
+  return !b->failed;
+}
+
+// scheduled events only, a replay from a snapshot takes them from the log
+void clearSchedule(void) {
+  pending_head = 0;
+  pending_count = 0;
+}
+
+// the voice part is playing key on, NULL if it has none
+static Oscillator *find_voice(Synth *synth, int part, int key) {
+  for (uint32_t m = synth->voice_active; m;) {
+    size_t v = nextVoice(&m);
+    if (synth->voice_part[v] == part && synth->voice_key[v] == key &&
+        synth->keyOscillators.osc[v].envelope.state != OFF)
+      return &synth->keyOscillators.osc[v];
+  }
+  return NULL;
+}
+
+// block rate modulation: bend moves the note along the tuning table ratio,
+// pressure adds up to the patch amplitude again and timbre moves the filter
+// cutoff two octaves either way. all table lookups, no transcendentals
+static void modulateVoices(Synth *synth) {
+  const tuning_t *tuning = synth->tuning;
+  for (uint32_t m = synth->voice_active; m;) {
+    size_t v = nextVoice(&m);
+    Oscillator *osc = &synth->keyOscillators.osc[v];
+    const expression_t *e =
+        &expressions[synth->voice_part[v]][synth->voice_key[v]];
+    int note = keyNotes[synth->voice_key[v]];
+
+    if (e->bend != 0.0f) {
+      float ratio = tuningBendRatio(e->bend);
+      osc->freq = tuning->freq[note] * ratio;
+      osc->phase_inc = (uint32_t)llround((double)tuning->inc[note] * ratio);
+    } else {
+      osc->freq = tuning->freq[note];
+      osc->phase_inc = tuning->inc[note];
+    }
+    osc->amplitude = synth->voice_amplitude[v] * (1.0f + e->pressure);
+    synth->voice_brightness[v] =
+        e->timbre != 0.0f ? tuningBendRatio(e->timbre * 24.0f) : 1.0f;
+  }
+}
+
+// the noise a note start draws comes from its own sample time, part and key
+// and not from the notes before it, so a render started part way through a
+// log, as the replay workers do, plays every later note the same
+static uint32_t noteSeed(const Synth *synth, uint64_t time, int part,
+                         int key) {
+  uint64_t x = time ^ (uint64_t)part << 48 ^ (uint64_t)key << 56 ^ synth->rng;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  return (uint32_t)x ? (uint32_t)x : 1; // xorshift32 never leaves 0
+}
+
+void handle_keys(Synth *synth, uint64_t time) {
+  for (int p = 0; p < NUM_PARTS; p++) {
+    for (int i = 0; i < NUM_KEYS; i++) {
+      key_state_t *ks = &keyStates[p][i];
+
+      // key was just pressed and is not sounding yet, start attack. the
+      // sequencer restarts a key that is still sounding, so repeated steps
+      // and ratchets are heard. keys the tuning leaves out stay silent
+      int note = keyNotes[i];
+      if (ks->val && ks->change && synth->tuning->freq[note] > 0.0f) {
+        Oscillator *osc = find_voice(synth, p, i);
+        if (!osc)
+          osc = allocVoice(synth, p, i);
+        else if (!ks->retrigger)
+          osc = NULL;
+        if (osc) {
+          const patch_t *patch = synth->parts[p].patch;
+          size_t v = osc - synth->keyOscillators.osc;
+          osc->freq = synth->tuning->freq[note];
+          osc->phase_inc = synth->tuning->inc[note];
+          osc->amplitude = patch->amplitude;
+          synth->voice_amplitude[v] = patch->amplitude;
+          osc->shape_parameter_0 = patch->shape_parameter_0;
+          osc->envelope.attack_time = patch->attack_time;
+          osc->envelope.decay_time = patch->decay_time;
+          osc->envelope.sustain_level = patch->sustain_level;
+          osc->envelope.sustain_time = patch->sustain_time;
+          osc->envelope.release_time = patch->release_time;
+          osc->envelope.state = ATTACK;
+          synth->voice_active |= 1u << v;
+          uint32_t rng = noteSeed(synth, time, p, i);
+          unisonStart(&synth->voice_unison[v], patch->unison_voices,
+                      patch->unison_detune, patch->unison_spread, &rng);
+          additiveStart(&synth->voice_additive[v], patch->additive_partials,
+                        patch->additive_tilt, patch->additive_stretch);
+          Waveguide *w = &synth->voice_waveguide[v];
+          w->active = 0;
+          if (patch->waveguide_decay > 0.0f)
+            waveguideStart(w, osc->freq, synth->sample_rate,
+                           patch->waveguide_decay, patch->waveguide_brightness,
+                           patch->waveguide_position, &rng);
+        }
+      }
+
+      // a key that was just released is left to the state machine
 
-    if (!ks->val && ks->change) { // key was just released
-      // state machine will handle the rest
+      ks->change = false;
+      ks->retrigger = false;
     }
+  }
 
-    ks->change = false;
+  // held keys keep their voice sustaining
+  for (uint32_t m = synth->voice_active; m;) {
+    size_t v = nextVoice(&m);
+    ADSR *env = &synth->keyOscillators.osc[v].envelope;
+    if (env->state >= SUSTAIN &&
+        keyStates[synth->voice_part[v]][synth->voice_key[v]].val) {
+      env->state = SUSTAIN; // reset state
+      env->sustain_time_elapsed = 0.0f;
+    }
   }
-}
\ No newline at end of file
+
+  modulateVoices(synth);
+}
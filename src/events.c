@@ -0,0 +1,153 @@
+#include "events.h"
+#include "metrics.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+event_queue_t g_control_events;
+event_queue_t g_script_events;
+_Atomic uint64_t g_sample_clock;
+_Atomic uint32_t g_output_latency;
+
+bool event_push(event_queue_t *q, const synth_event_t *ev) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+  if (tail - head >= EVENT_QUEUE_SIZE)
+    return false;
+
+  q->events[tail & (EVENT_QUEUE_SIZE - 1)] = *ev;
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+bool event_pop(event_queue_t *q, synth_event_t *ev) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  if (head == tail)
+    return false;
+
+  *ev = q->events[head & (EVENT_QUEUE_SIZE - 1)];
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return true;
+}
+
+size_t event_queue_depth(event_queue_t *q) {
+  return atomic_load_explicit(&q->tail, memory_order_acquire) -
+         atomic_load_explicit(&q->head, memory_order_acquire);
+}
+
+// ----------------------------
+// recording
+// ----------------------------
+// the audio thread pushes applied events into record_queue, the recorder
+// thread appends them to the file
+
+static event_queue_t record_queue;
+static _Atomic bool recording = false;
+static FILE *record_file = NULL;
+static pthread_t record_thread;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void drain_record_queue(void) {
+  synth_event_t ev;
+  pthread_mutex_lock(&record_lock);
+  if (record_file) {
+    while (event_pop(&record_queue, &ev))
+      fwrite(&ev, sizeof(ev), 1, record_file);
+    fflush(record_file);
+  }
+  pthread_mutex_unlock(&record_lock);
+}
+
+static void *recorder(void *arg) {
+  (void)arg;
+  struct timespec wait = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+  while (atomic_load(&recording)) {
+    drain_record_queue();
+    nanosleep(&wait, NULL);
+  }
+  return NULL;
+}
+
+bool event_record_start(const char *path, int sample_rate, size_t buffer_size,
+                        int channels, uint32_t flags,
+                        const synth_params_t *params) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    log_message(ERROR, "could not open event log %s", path);
+    return false;
+  }
+
+  event_log_header_t header = {.magic = EVENT_LOG_MAGIC,
+                               .version = EVENT_LOG_VERSION,
+                               .sample_rate = sample_rate,
+                               .buffer_size = buffer_size,
+                               .channels = channels,
+                               .flags = flags,
+                               .params = *params};
+  if (fwrite(&header, sizeof(header), 1, f) != 1) {
+    log_message(ERROR, "could not write event log %s", path);
+    fclose(f);
+    return false;
+  }
+
+  record_file = f;
+  atomic_store(&recording, true);
+  pthread_create(&record_thread, NULL, recorder, NULL);
+  atexit(event_record_stop);
+  log_message(INFO, "recording events to %s", path);
+  return true;
+}
+
+// audio thread, never blocks: a full queue loses the event and says so
+void event_record(const synth_event_t *ev) {
+  if (!atomic_load_explicit(&recording, memory_order_relaxed))
+    return;
+  if (!event_push(&record_queue, ev))
+    log_message(WARNING, "event log queue full, the recording is incomplete");
+}
+
+void event_record_stop(void) {
+  if (!atomic_exchange(&recording, false))
+    return;
+  pthread_join(record_thread, NULL);
+  drain_record_queue();
+
+  pthread_mutex_lock(&record_lock);
+  fclose(record_file);
+  record_file = NULL;
+  pthread_mutex_unlock(&record_lock);
+}
+
+synth_event_t *event_log_read(const char *path, event_log_header_t *header,
+                              size_t *count) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    log_message(ERROR, "could not open event log %s", path);
+    return NULL;
+  }
+
+  if (fread(header, sizeof(*header), 1, f) != 1 ||
+      header->magic != EVENT_LOG_MAGIC ||
+      header->version != EVENT_LOG_VERSION) {
+    log_message(ERROR, "%s is not an event log of this version", path);
+    fclose(f);
+    return NULL;
+  }
+
+  fseek(f, 0, SEEK_END);
+  long bytes = ftell(f) - (long)sizeof(*header);
+  fseek(f, sizeof(*header), SEEK_SET);
+
+  *count = bytes / sizeof(synth_event_t);
+  synth_event_t *events = malloc((*count ? *count : 1) * sizeof(synth_event_t));
+  if (!events || fread(events, sizeof(synth_event_t), *count, f) != *count) {
+    log_message(ERROR, "could not read events from %s", path);
+    free(events);
+    fclose(f);
+    return NULL;
+  }
+
+  fclose(f);
+  return events;
+}
@@ -1,72 +1,134 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <math.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <sys/select.h>
 
+#include "analyzer.h"
+#include "backend.h"
 #include "commands.h"
+#include "metrics.h"
+#include "params.h"
+#include "profiler.h"
+#include "recorder.h"
+#include "replay.h"
+#include "rt.h"
+#include "sequencer.h"
+#include "snapshot.h"
 #include "synth.h"
+#include "tclsynth.h"
 #include "utils.h"
 #include "yaml.h"
 
-#include "portaudio.h"
-
 #include "tcl.h"
 #include "tk.h"
 
-ADSR defaultEnvelope = {.attack_time = ENVELOPE_DEFAULT_ATTACK_TIME,
-                        .decay_time = ENVELOPE_DEFAULT_DECAY_TIME,
-                        .sustain_level = ENVELOPE_DEFAULT_SUSTAIN_LEVEL,
-                        .release_time = ENVELOPE_DEFAULT_RELEASE_TIME,
-                        .sustain_time = ENVELOPE_DEFAULT_SUSTAIN_TIME,
-                        .current_level = 0.0f,
-                        .state = OFF};
+#define CONFIG_PATH "conf/conf.yaml"
+
+static synth_params_t initial_params;
+static analyzer_cfg_t analyzer_cfg;
+static rt_cfg_t rt_cfg;
 
-static hash_t *config = NULL;
+static int sample_rate = DEFAULT_SAMPLE_RATE;
+static size_t buffer_size = DEFAULT_STREAM_BUFFER_SIZE;
+static int channels = DEFAULT_CHANNELS;
 
-// takes a hash_t and if the value is proper sets it to the reference
-static void hash_get_and_set_float(hash_t *h, char *cs, float *f) {
-  char *str = hash_get(h, cs);
-  char *eptr;
+static void set_sample_rate(const char *str) {
+  int rate = atoi(str);
+  if (isValidSampleRate(rate)) {
+    sample_rate = rate;
+  } else {
+    log_message(ERROR, "sample rate %s is not 44100, 48000 or 96000, ignoring",
+                str);
+  }
+}
 
-  float num = strtof(str, &eptr);
+static void set_buffer_size(const char *str) {
+  long frames = atol(str);
+  if (frames > 0 && isValidBufferSize(frames)) {
+    buffer_size = frames;
+  } else {
+    log_message(ERROR, "buffer size %s is not within %d..%d frames, ignoring",
+                str, MIN_STREAM_BUFFER_SIZE, MAX_STREAM_BUFFER_SIZE);
+  }
+}
 
-  if (*eptr == '\0') {
-    *f = num;
+static void set_channels(const char *str) {
+  int n = atoi(str);
+  if (isValidChannelCount(n)) {
+    channels = n;
   } else {
-    log_message(ERROR, "%s could not be converted to float, ignoring", cs);
+    log_message(ERROR, "channels %s is not within 1..%d, ignoring", str,
+                MAX_CHANNELS);
   }
 }
 
+static int metrics_port = METRICS_DEFAULT_PORT;
+static char bank_path[256] = "patches/default.bank";
+static char backend_spec[256] = "portaudio";
+static char record_path[256] = "";
+static char scl_path[256] = "";
+static char kbm_path[256] = "";
+static char audio_record_path[256] = "";
+static bool audio_record_direct = false;
+static char trace_path[256] = "";
+static char restore_path[256] = "";
+static char exit_snapshot_path[256] = "";
+static replay_opts_t replay = {.tolerance = 0.0f, .workers = 1};
+static const char *script_path = NULL;
+
+// startup settings are read here, the sound parameters go into the first
+// snapshot and are reloaded from the same file while running
 void load_config() {
-  config = yaml_read("conf/conf.yaml");
+  params_defaults(&initial_params);
+  analyzer_defaults(&analyzer_cfg);
+  rt_defaults(&rt_cfg);
+
+  yaml_doc_t *config = yaml_read(CONFIG_PATH);
   if (!config) {
-    log_message(ERROR, "conf/conf.yaml failed to load, using default values!");
+    log_message(ERROR, CONFIG_PATH " failed to load, using default values!");
     return;
   }
-  hash_each(config, { log_message(INFO, "%s: %s", key, (char *)val); });
-
-  hash_get_and_set_float(config, "envelope.attack_time",
-                         &defaultEnvelope.attack_time);
-  hash_get_and_set_float(config, "envelope.decay_time",
-                         &defaultEnvelope.decay_time);
-  hash_get_and_set_float(config, "envelope.sustain_level",
-                         &defaultEnvelope.sustain_level);
-  hash_get_and_set_float(config, "envelope.sustain_time",
-                         &defaultEnvelope.sustain_time);
-  hash_get_and_set_float(config, "envelope.release_time",
-                         &defaultEnvelope.release_time);
-
-  hash_free(config);
-  config = NULL;
+  hash_each(config->hash, { log_message(INFO, "%s: %s", key, (char *)val); });
+
+  params_apply_config(&initial_params, config->hash);
+  analyzer_apply_config(&analyzer_cfg, config->hash);
+  rt_apply_config(&rt_cfg, config->hash);
+
+  char *str;
+  if ((str = hash_get(config->hash, "patches.bank")))
+    snprintf(bank_path, sizeof(bank_path), "%s", str);
+  if ((str = hash_get(config->hash, "tuning.scl")))
+    snprintf(scl_path, sizeof(scl_path), "%s", str);
+  if ((str = hash_get(config->hash, "tuning.kbm")))
+    snprintf(kbm_path, sizeof(kbm_path), "%s", str);
+  if ((str = hash_get(config->hash, "recorder.direct")))
+    audio_record_direct = !strcmp(str, "true");
+  if ((str = hash_get(config->hash, "snapshot.on_exit")))
+    snprintf(exit_snapshot_path, sizeof(exit_snapshot_path), "%s", str);
+  if ((str = hash_get(config->hash, "audio.backend")))
+    snprintf(backend_spec, sizeof(backend_spec), "%s", str);
+  if ((str = hash_get(config->hash, "metrics.port")))
+    metrics_port = atoi(str);
+  if ((str = hash_get(config->hash, "audio.sample_rate")))
+    set_sample_rate(str);
+  if ((str = hash_get(config->hash, "audio.buffer_size")))
+    set_buffer_size(str);
+  if ((str = hash_get(config->hash, "audio.channels")))
+    set_channels(str);
+
+  yaml_free(config);
 }
 
 void tcl_thread(void) {
   Tcl_Interp *interp = Tcl_CreateInterp();
 
-  if (Tcl_Init(interp) == TCL_ERROR || Tk_Init(interp) == TCL_ERROR) {
+  if (Tcl_Init(interp) == TCL_ERROR || Tk_Init(interp) == TCL_ERROR ||
+      Synth_Init(interp) == TCL_ERROR) {
     log_message(ERROR, "tcl/tk initialization failed: %s",
                 Tcl_GetStringResult(interp));
     exit(1);
@@ -91,62 +153,241 @@ Synth *g_synth = NULL;
 
 void networking_thread(void);
 
-int main() {
-  load_config();
+// command line values win over conf/conf.yaml
+static void parse_args(int argc, char **argv) {
+  static struct option long_options[] = {
+      {"sample-rate", required_argument, NULL, 'r'},
+      {"buffer-size", required_argument, NULL, 'b'},
+      {"compile-bank", required_argument, NULL, 'c'},
+      {"record", required_argument, NULL, 'R'},
+      {"replay", required_argument, NULL, 'P'},
+      {"render", required_argument, NULL, 'o'},
+      {"expect-hash", required_argument, NULL, 'H'},
+      {"compare", required_argument, NULL, 'C'},
+      {"tolerance", required_argument, NULL, 't'},
+      {"script", required_argument, NULL, 's'},
+      {"rt", no_argument, NULL, 'T'},
+      {"backend", required_argument, NULL, 'B'},
+      {"record-audio", required_argument, NULL, 'W'},
+      {"trace", required_argument, NULL, 'J'},
+      {"restore", required_argument, NULL, 'L'},
+      {"snapshots", required_argument, NULL, 'S'},
+      {"jobs", required_argument, NULL, 'j'},
+      {"channels", required_argument, NULL, 'n'},
+      {NULL, 0, NULL, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "r:b:n:c:R:P:o:H:C:t:s:TB:W:J:L:S:j:",
+                            long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'r':
+      set_sample_rate(optarg);
+      break;
+    case 'b':
+      set_buffer_size(optarg);
+      break;
+    case 'n':
+      set_channels(optarg);
+      break;
+    case 'R':
+      snprintf(record_path, sizeof(record_path), "%s", optarg);
+      break;
+    case 'P':
+      replay.log_path = optarg;
+      break;
+    case 'o':
+      replay.render_path = optarg;
+      break;
+    case 'H':
+      replay.expect_hash = optarg;
+      break;
+    case 'C':
+      replay.compare_path = optarg;
+      break;
+    case 't':
+      replay.tolerance = strtof(optarg, NULL);
+      break;
+    case 's':
+      script_path = optarg;
+      break;
+    case 'T':
+      rt_cfg.enabled = true;
+      break;
+    case 'B':
+      snprintf(backend_spec, sizeof(backend_spec), "%s", optarg);
+      break;
+    case 'W':
+      snprintf(audio_record_path, sizeof(audio_record_path), "%s", optarg);
+      break;
+    case 'J':
+      snprintf(trace_path, sizeof(trace_path), "%s", optarg);
+      break;
+    case 'L':
+      snprintf(restore_path, sizeof(restore_path), "%s", optarg);
+      replay.restore_path = restore_path;
+      break;
+    case 'S':
+      replay.snapshot_dir = optarg;
+      break;
+    case 'j':
+      replay.workers = atoi(optarg);
+      break;
+    case 'c':
+      // tinysynth -c out.bank patch.yaml..., compiles and exits
+      exit(patch_compile_bank(optarg, argv + optind, argc - optind) ? 1 : 0);
+    default:
+      fprintf(stderr,
+              "usage: %s [-r sample_rate] [-b buffer_size] [-n channels] "
+              "[-R events.log] [-s script.tcl] [--rt]\n"
+              "       %*s [-B portaudio|null[:paced]|wav:out.wav|shm:name] "
+              "[-W take.wav] [-J trace.json] [-L state.snap]\n"
+              "       %s -c out.bank patch.yaml...\n"
+              "       %s -P events.log [-o out.f32] [-H hash] "
+              "[-C ref.f32 [-t tolerance]] [-J trace.json]\n"
+              "       %*s [-S snapshot_dir] [-L state.snap] [-j workers]\n",
+              argv[0], (int)strlen(argv[0]), "", argv[0], argv[0],
+              (int)strlen(argv[0]), "");
+      exit(1);
+    }
+  }
+}
 
-  PaStream *stream;
-  PaError err;
+// -J, the trace of the last blocks when the process ends, a replay included
+static void write_trace(void) { profiler_dump(trace_path); }
+
+// snapshot.on_exit, for a warm restart with -L. runs on the thread that
+// called exit() while the audio thread keeps going
+static void write_exit_snapshot(void) { snapshot_save(exit_snapshot_path); }
+
+int main(int argc, char **argv) {
+  // no thread takes SIGINT and SIGTERM, every thread started from here
+  // inherits the mask. the networking thread reads them from a signalfd and
+  // ends the process from its loop. the audio thread keeps rendering while
+  // the exit handlers run, so they can still ask it for a snapshot
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+  log_start();
+  log_thread_init(); // this thread renders audio, register before it logs
+  profiler_thread_init("audio");
+  load_config();
+  parse_args(argc, argv);
+  if (trace_path[0])
+    atexit(write_trace);
+
+  if (replay.log_path) {
+    replay.bank_path = bank_path;
+    replay.scl_path = scl_path;
+    replay.kbm_path = kbm_path;
+    pthread_sigmask(SIG_UNBLOCK, &stop_signals, NULL);
+    return replay_main(&replay);
+  }
+  log_message(INFO, "%d Hz, %zu frames per buffer, %d channel%s",
+              sample_rate, buffer_size, channels, channels == 1 ? "" : "s");
 
-  err = Pa_Initialize();
-  if (err != paNoError)
+  audio_backend_t *output = backend_open(backend_spec, sample_rate,
+                                         buffer_size, channels);
+  if (!output)
     return -1;
 
-  err = Pa_OpenDefaultStream(&stream, 0, 1, paFloat32, SAMPLE_RATE,
-                             STREAM_BUFFER_SIZE, NULL, NULL);
-  if (err != paNoError)
+  Oscillator keyOscillators[NUM_OSCILLATORS] = {0};
+  Synth synth = {.keyOscillators = {.osc = keyOscillators, .count = 0}};
+  if (!initSynth(&synth, sample_rate, buffer_size, channels)) {
+    log_message(ERROR, "could not allocate audio buffers");
     return -1;
-
-  err = Pa_StartStream(stream);
-  if (err != paNoError)
+  }
+  g_synth = &synth;
+  tuning_init(tuning_load_or_equal(scl_path, kbm_path, sample_rate));
+  synth.tuning = tuning_acquire();
+  metrics_init(sample_rate, buffer_size);
+  metrics_start_http(metrics_port);
+  analyzer_start(&analyzer_cfg, sample_rate);
+
+  initVoices(&synth, &initial_params.envelope);
+  synth.bank = patch_bank_load(bank_path);
+  if (synth.bank)
+    log_message(INFO, "%s: %u programs", bank_path, synth.bank->count);
+  else
+    log_message(INFO, "no patch bank at %s, using the default patch",
+                bank_path);
+  initParts(&synth, &initial_params);
+  params_init(&initial_params);
+  params_start_watcher(CONFIG_PATH);
+  if (restore_path[0] && !snapshot_load(&synth, restore_path))
     return -1;
+  if (exit_snapshot_path[0])
+    atexit(write_exit_snapshot);
 
-  Oscillator keyOscillators[NUM_KEYS] = {0};
-  float signal[STREAM_BUFFER_SIZE] = {0};
-  Synth synth = {.keyOscillators = {.osc = keyOscillators, .count = 0},
-                 .signal = &signal,
-                 .signal_length = STREAM_BUFFER_SIZE,
-                 .audio_frame_duration = 0.0f};
-  g_synth = &synth;
+  if (record_path[0] &&
+      !event_record_start(record_path, sample_rate, buffer_size, channels,
+                          rt_cfg.enabled ? EVENT_LOG_FTZ : 0,
+                          &initial_params))
+    return -1;
 
-  for (size_t i = 0; i < NUM_KEYS; i++) {
-    Oscillator *o = makeOscillator(&synth.keyOscillators);
-    o->envelope = defaultEnvelope;
-  }
+  if (audio_record_path[0] &&
+      !recorder_start(audio_record_path, sample_rate, channels,
+                      audio_record_direct))
+    return -1;
 
   pthread_t netw;
   pthread_create(&netw, NULL, networking_thread, NULL);
+  if (script_path)
+    tclsynth_run_script(script_path);
 
-  struct timespec last_frame_time;
-  clock_gettime(CLOCK_MONOTONIC, &last_frame_time);
+  // last, so the buffers, pools and other threads already exist
+  rt_enter(&rt_cfg, &synth);
 
   while (1) {
-    zeroSignal(g_synth->signal);
-    updateOscArray(&sineShape, g_synth, g_synth->keyOscillators);
-    handle_keys(g_synth);
-    Pa_WriteStream(stream, g_synth->signal, STREAM_BUFFER_SIZE);
-
-    struct timespec current_time;
-    clock_gettime(CLOCK_MONOTONIC, &current_time);
-
-    float delta_time =
-        (current_time.tv_sec - last_frame_time.tv_sec) * 1000.0f +
-        (float)(current_time.tv_nsec - last_frame_time.tv_nsec) / 1e6;
-    last_frame_time = current_time;
-
-    synth.delta_time_last_frame = delta_time;
+    struct timespec render_start, render_end;
+    clock_gettime(CLOCK_MONOTONIC, &render_start);
+
+    snapshotPoll(g_synth);
+    PROFILE_BEGIN(PROF_BLOCK);
+
+    PROFILE_BEGIN(PROF_PARAMS);
+    const synth_params_t *params = params_acquire();
+    if (params->version != g_synth->params_version)
+      applySynthParams(g_synth, params);
+    g_synth->tuning = tuning_acquire();
+    PROFILE_END(PROF_PARAMS);
+
+    PROFILE_BEGIN(PROF_DRAIN);
+    drainEvents(g_synth);
+    PROFILE_END(PROF_DRAIN);
+    PROFILE_BEGIN(PROF_SEQUENCER);
+    sequencerRun(g_synth);
+    PROFILE_END(PROF_SEQUENCER);
+    renderBlock(g_synth);
+    // the analyzer looks at the first channel
+    PROFILE_BEGIN(PROF_ANALYZER);
+    analyzer_publish(g_synth->signal, g_synth->signal_length);
+    PROFILE_END(PROF_ANALYZER);
+    PROFILE_BEGIN(PROF_RECORDER);
+    recorder_push(g_synth->output, g_synth->signal_length);
+    PROFILE_END(PROF_RECORDER);
+
+    PROFILE_END(PROF_BLOCK);
+    clock_gettime(CLOCK_MONOTONIC, &render_end);
+    metrics_record_block(
+        (render_end.tv_sec - render_start.tv_sec) * 1000000000ull +
+            (render_end.tv_nsec - render_start.tv_nsec),
+        countActiveVoices(g_synth));
+
+    PROFILE_BEGIN(PROF_OUTPUT);
+    BackendStatus status =
+        output->write(output, g_synth->output, g_synth->signal_length);
+    PROFILE_END(PROF_OUTPUT);
+    if (status == BACKEND_XRUN)
+      metrics_record_xrun();
+    else if (status == BACKEND_ERROR)
+      break;
   }
 
-  pthread_join(netw, NULL);
+  backend_close(output);
+  freeSynth(&synth);
 
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,172 @@
+#include "master.h"
+#include "simd.h"
+#include <math.h>
+#include <string.h>
+
+void masterDefaults(master_params_t *p) {
+  *p = (master_params_t){.limiter = true,
+                         .ceiling = -0.3f,
+                         .lookahead_ms = 1.5f,
+                         .release_ms = 60.0f,
+                         .clipper = false,
+                         .drive = 0.0f};
+}
+
+static void masterReset(MasterBus *m) {
+  for (int c = 0; c < m->channels; c++)
+    memset(m->history + c * m->history_stride, 0,
+           MASTER_MAX_LOOKAHEAD * sizeof(float));
+  m->min_head = m->min_count = 0;
+  m->index = 0;
+  m->follower = 1.0f;
+  for (int i = 0; i < m->lookahead; i++)
+    m->box[i] = 1.0f;
+  m->box_sum = m->lookahead;
+  m->box_pos = 0;
+  memset(m->up, 0, sizeof(m->up));
+  memset(m->down, 0, sizeof(m->down));
+}
+
+bool masterConfigure(MasterBus *m, const master_params_t *p, int sample_rate) {
+  int lookahead = 0;
+  if (p->limiter) {
+    lookahead = (int)(p->lookahead_ms * 0.001f * sample_rate + 0.5f);
+    if (lookahead < 1)
+      lookahead = 1;
+    if (lookahead > MASTER_MAX_LOOKAHEAD)
+      lookahead = MASTER_MAX_LOOKAHEAD;
+  }
+  int latency = lookahead + (p->clipper ? MASTER_CLIPPER_LATENCY : 0);
+
+  m->params = *p;
+  m->ceiling = powf(10.0f, p->ceiling / 20.0f);
+  m->drive = powf(10.0f, p->drive / 20.0f);
+  m->release = p->release_ms > 0.0f
+                   ? 1.0f - expf(-1000.0f / (p->release_ms * sample_rate))
+                   : 1.0f;
+
+  bool changed = latency != m->latency || lookahead != m->lookahead;
+  m->lookahead = lookahead;
+  m->latency = latency;
+  if (changed)
+    masterReset(m);
+  return changed;
+}
+
+// cubic soft clip, linear around zero and flat at +-1 from |x| = 1
+static inline v4f softClipV4(v4f x) {
+  x = v4f_min(v4f_max(x, v4f_set1(-1.0f)), v4f_set1(1.0f));
+  return x * (v4f_set1(1.5f) - v4f_set1(0.5f) * x * x);
+}
+
+// upsampled by the half-band interpolator, clipped four samples at a time
+// and brought back down through the same filter, so the harmonics the
+// clipper adds above nyquist do not fold back
+static void clipBlock(MasterBus *m, HalfbandDecimator *up,
+                      HalfbandDecimator *down, float *signal, float *scratch,
+                      size_t n) {
+  for (size_t t = 0; t < n; t++)
+    interpolateHalfband(up, signal[t], &scratch[2 * t]);
+
+  v4f drive = v4f_set1(m->drive);
+  size_t i = 0;
+  for (; i + SIMD_WIDTH <= 2 * n; i += SIMD_WIDTH)
+    v4f_store(&scratch[i], softClipV4(v4f_load(&scratch[i]) * drive));
+  for (; i < 2 * n; i++) {
+    float x = fminf(fmaxf(scratch[i] * m->drive, -1.0f), 1.0f);
+    scratch[i] = x * (1.5f - 0.5f * x * x);
+  }
+
+  for (size_t t = 0; t < n; t++)
+    signal[t] = decimateHalfband(down, scratch[2 * t], scratch[2 * t + 1]);
+}
+
+// gain the sample at the front of the deque needs, pushed at index
+static inline void pushMinimum(MasterBus *m, float need) {
+  int cap = MASTER_MAX_LOOKAHEAD + 1;
+  // larger values behind the new one can never be the minimum again
+  while (m->min_count > 0) {
+    int back = (m->min_head + m->min_count - 1) % cap;
+    if (m->min_value[back] < need)
+      break;
+    m->min_count--;
+  }
+  int slot = (m->min_head + m->min_count) % cap;
+  m->min_value[slot] = need;
+  m->min_index[slot] = m->index;
+  m->min_count++;
+  // the window is the last lookahead + 1 samples
+  if (m->min_index[m->min_head] + m->lookahead < m->index) {
+    m->min_head = (m->min_head + 1) % cap;
+    m->min_count--;
+  }
+}
+
+// the needed gain is computed four samples at a time from the peak over
+// the channels, the sliding minimum, release and moving average are one
+// short recurrence per sample, the delayed channels are then scaled by the
+// gains a vector at a time
+static void limitBlock(MasterBus *m, float *signal, size_t stride,
+                       float *gain, size_t n) {
+  int L = m->lookahead;
+  v4f ceiling = v4f_set1(m->ceiling);
+  size_t i = 0;
+  for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+    v4f peak = v4f_abs(v4f_load(&signal[i]));
+    for (int c = 1; c < m->channels; c++)
+      peak = v4f_max(peak, v4f_abs(v4f_load(&signal[c * stride + i])));
+    v4f_store(&gain[i], ceiling / v4f_max(peak, ceiling));
+  }
+  for (; i < n; i++) {
+    float peak = fabsf(signal[i]);
+    for (int c = 1; c < m->channels; c++)
+      peak = fmaxf(peak, fabsf(signal[c * stride + i]));
+    gain[i] = m->ceiling / fmaxf(peak, m->ceiling);
+  }
+
+  float scale = 1.0f / L;
+  for (size_t t = 0; t < n; t++) {
+    pushMinimum(m, gain[t]);
+    m->index++;
+    float target = m->min_value[m->min_head];
+
+    // falls at once, recovers at the release rate, never above the minimum
+    if (target < m->follower)
+      m->follower = target;
+    else
+      m->follower += (target - m->follower) * m->release;
+
+    m->box_sum += m->follower - m->box[m->box_pos];
+    m->box[m->box_pos] = m->follower;
+    if (++m->box_pos == L) {
+      // the running sum drifts, recount it once per lap
+      m->box_pos = 0;
+      m->box_sum = 0.0f;
+      for (int k = 0; k < L; k++)
+        m->box_sum += m->box[k];
+    }
+    gain[t] = m->box_sum * scale;
+  }
+
+  // delay by L: history holds the previous L samples and the block follows
+  for (int c = 0; c < m->channels; c++) {
+    float *h = m->history + c * m->history_stride;
+    float *x = signal + c * stride;
+    memcpy(h + L, x, n * sizeof(float));
+    i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+      v4f_store(&x[i], v4f_load(&h[i]) * v4f_load(&gain[i]));
+    for (; i < n; i++)
+      x[i] = h[i] * gain[i];
+    memmove(h, h + n, L * sizeof(float));
+  }
+}
+
+void masterProcess(MasterBus *m, float *signal, size_t stride, float *scratch,
+                   size_t n) {
+  if (m->params.clipper)
+    for (int c = 0; c < m->channels; c++)
+      clipBlock(m, &m->up[c], &m->down[c], signal + c * stride, scratch, n);
+  if (m->lookahead > 0)
+    limitBlock(m, signal, stride, scratch, n);
+}
@@ -0,0 +1,254 @@
+#include "metrics.h"
+#include "events.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+engine_metrics_t g_metrics;
+
+static const char *queue_names[QUEUE_COUNT] = {"log", "events", "script",
+                                                "pending"};
+
+void metrics_init(int sample_rate, size_t buffer_size) {
+  g_metrics.sample_rate = sample_rate;
+  g_metrics.buffer_size = buffer_size;
+}
+
+static void atomic_max_float(_Atomic float *a, float v) {
+  float cur = atomic_load_explicit(a, memory_order_relaxed);
+  while (v > cur && !atomic_compare_exchange_weak_explicit(
+                        a, &cur, v, memory_order_relaxed, memory_order_relaxed))
+    ;
+}
+
+static void atomic_max_size(_Atomic size_t *a, size_t v) {
+  size_t cur = atomic_load_explicit(a, memory_order_relaxed);
+  while (v > cur && !atomic_compare_exchange_weak_explicit(
+                        a, &cur, v, memory_order_relaxed, memory_order_relaxed))
+    ;
+}
+
+// called by the audio thread once per block with the time spent rendering,
+// the block deadline is buffer_size / sample_rate
+void metrics_record_block(uint64_t render_ns, uint32_t active_voices) {
+  float deadline_ns = 1e9f * g_metrics.buffer_size / g_metrics.sample_rate;
+  float load = 100.0f * render_ns / deadline_ns;
+
+  float avg = atomic_load_explicit(&g_metrics.dsp_load_avg,
+                                   memory_order_relaxed);
+  avg += (load - avg) * METRICS_EMA_WEIGHT;
+
+  atomic_store_explicit(&g_metrics.dsp_load, load, memory_order_relaxed);
+  atomic_store_explicit(&g_metrics.dsp_load_avg, avg, memory_order_relaxed);
+  atomic_max_float(&g_metrics.dsp_load_peak, load);
+
+  atomic_store_explicit(&g_metrics.active_voices, active_voices,
+                        memory_order_relaxed);
+  if (active_voices > atomic_load_explicit(&g_metrics.active_voices_peak,
+                                           memory_order_relaxed))
+    atomic_store_explicit(&g_metrics.active_voices_peak, active_voices,
+                          memory_order_relaxed);
+
+  atomic_fetch_add_explicit(&g_metrics.blocks, 1, memory_order_relaxed);
+}
+
+void metrics_record_xrun(void) {
+  atomic_fetch_add_explicit(&g_metrics.xruns, 1, memory_order_relaxed);
+}
+
+void metrics_queue_depth(MetricsQueue q, size_t depth) {
+  atomic_store_explicit(&g_metrics.queues[q].depth, depth,
+                        memory_order_relaxed);
+  atomic_max_size(&g_metrics.queues[q].high_water, depth);
+}
+
+void metrics_net_in(size_t bytes) {
+  atomic_fetch_add_explicit(&g_metrics.net_bytes_in, bytes,
+                            memory_order_relaxed);
+}
+
+void metrics_net_out(size_t bytes) {
+  atomic_fetch_add_explicit(&g_metrics.net_bytes_out, bytes,
+                            memory_order_relaxed);
+}
+
+#define LOAD(field) atomic_load_explicit(&g_metrics.field, memory_order_relaxed)
+
+#define APPEND(...)                                                            \
+  do {                                                                         \
+    if (o < size)                                                              \
+      o += snprintf(buf + o, size - o, __VA_ARGS__);                           \
+  } while (0)
+
+// one "name value" pair per line, answer to the stats command
+size_t metrics_format_text(char *buf, size_t size) {
+  size_t o = 0;
+
+  APPEND("sample_rate %d\n", g_metrics.sample_rate);
+  APPEND("buffer_size %zu\n", g_metrics.buffer_size);
+  APPEND("blocks %llu\n", (unsigned long long)LOAD(blocks));
+  APPEND("dsp_load %.2f\n", LOAD(dsp_load));
+  APPEND("dsp_load_avg %.2f\n", LOAD(dsp_load_avg));
+  APPEND("dsp_load_peak %.2f\n", LOAD(dsp_load_peak));
+  APPEND("xruns %llu\n", (unsigned long long)LOAD(xruns));
+  APPEND("active_voices %u\n", LOAD(active_voices));
+  APPEND("active_voices_peak %u\n", LOAD(active_voices_peak));
+  for (int q = 0; q < QUEUE_COUNT; q++) {
+    APPEND("queue_%s_depth %zu\n", queue_names[q], LOAD(queues[q].depth));
+    APPEND("queue_%s_high_water %zu\n", queue_names[q],
+           LOAD(queues[q].high_water));
+  }
+  APPEND("log_dropped %lu\n", log_dropped_total());
+  APPEND("net_bytes_in %llu\n", (unsigned long long)LOAD(net_bytes_in));
+  APPEND("net_bytes_out %llu\n", (unsigned long long)LOAD(net_bytes_out));
+  APPEND("analyzer_frames %llu\n", (unsigned long long)LOAD(analyzer_frames));
+  APPEND("analyzer_frames_skipped %llu\n",
+         (unsigned long long)LOAD(analyzer_frames_skipped));
+  APPEND("analyzer_clients %u\n", LOAD(analyzer_clients));
+  APPEND("recorder_bytes %llu\n", (unsigned long long)LOAD(recorder_bytes));
+  APPEND("recorder_overruns %llu\n",
+         (unsigned long long)LOAD(recorder_overruns));
+  APPEND("output_latency %u\n",
+         atomic_load_explicit(&g_output_latency, memory_order_relaxed));
+
+  return o < size ? o : size - 1;
+}
+
+// prometheus text exposition format 0.0.4
+size_t metrics_format_prometheus(char *buf, size_t size) {
+  size_t o = 0;
+
+#define GAUGE(name, help, fmt, value)                                          \
+  APPEND("# HELP tinysynth_" name " " help "\n# TYPE tinysynth_" name          \
+         " gauge\ntinysynth_" name " " fmt "\n",                               \
+         value)
+#define COUNTER(name, help, value)                                             \
+  APPEND("# HELP tinysynth_" name " " help "\n# TYPE tinysynth_" name          \
+         " counter\ntinysynth_" name " %llu\n",                                \
+         (unsigned long long)(value))
+
+  GAUGE("sample_rate_hz", "output sample rate", "%d", g_metrics.sample_rate);
+  GAUGE("buffer_size_frames", "frames per block", "%zu",
+        g_metrics.buffer_size);
+  COUNTER("blocks_total", "blocks rendered", LOAD(blocks));
+  GAUGE("dsp_load_percent", "render time of the last block vs its deadline",
+        "%.3f", LOAD(dsp_load));
+  GAUGE("dsp_load_avg_percent", "smoothed render time vs deadline", "%.3f",
+        LOAD(dsp_load_avg));
+  GAUGE("dsp_load_peak_percent", "highest render time vs deadline", "%.3f",
+        LOAD(dsp_load_peak));
+  COUNTER("xruns_total", "output underflows", LOAD(xruns));
+  GAUGE("active_voices", "voices sounding in the last block", "%u",
+        LOAD(active_voices));
+  GAUGE("active_voices_peak", "most voices sounding in one block", "%u",
+        LOAD(active_voices_peak));
+
+  APPEND("# HELP tinysynth_queue_depth entries waiting in the queue\n"
+         "# TYPE tinysynth_queue_depth gauge\n");
+  for (int q = 0; q < QUEUE_COUNT; q++)
+    APPEND("tinysynth_queue_depth{queue=\"%s\"} %zu\n", queue_names[q],
+           LOAD(queues[q].depth));
+  APPEND("# HELP tinysynth_queue_high_water deepest the queue has been\n"
+         "# TYPE tinysynth_queue_high_water gauge\n");
+  for (int q = 0; q < QUEUE_COUNT; q++)
+    APPEND("tinysynth_queue_high_water{queue=\"%s\"} %zu\n", queue_names[q],
+           LOAD(queues[q].high_water));
+
+  COUNTER("log_dropped_total", "log messages dropped on full rings",
+          log_dropped_total());
+  COUNTER("network_received_bytes_total", "control socket bytes read",
+          LOAD(net_bytes_in));
+  COUNTER("network_sent_bytes_total", "control socket bytes written",
+          LOAD(net_bytes_out));
+  COUNTER("analyzer_frames_total", "spectrum frames computed",
+          LOAD(analyzer_frames));
+  COUNTER("analyzer_frames_skipped_total",
+          "spectrum frames skipped for a late analyzer or a full client",
+          LOAD(analyzer_frames_skipped));
+  GAUGE("analyzer_clients", "connected spectrum clients", "%u",
+        LOAD(analyzer_clients));
+  GAUGE("recorder_bytes", "sample data the disk recorder has written", "%llu",
+        (unsigned long long)LOAD(recorder_bytes));
+  COUNTER("recorder_overruns_total",
+          "frames the disk recorder dropped for a full ring",
+          LOAD(recorder_overruns));
+  GAUGE("output_latency_samples", "master bus delay from render to output",
+        "%u", atomic_load_explicit(&g_output_latency, memory_order_relaxed));
+
+#undef GAUGE
+#undef COUNTER
+
+  return o < size ? o : size - 1;
+}
+
+#define METRICS_IO_TIMEOUT_MS 1000 // per connection, a stalled client
+
+// one request per connection, whatever the path, the answer is the metrics
+static void *metrics_http_thread(void *arg) {
+  int port = (int)(intptr_t)arg;
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    log_message(ERROR, "metrics: creating socket failed");
+    return NULL;
+  }
+
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 4) < 0) {
+    log_message(ERROR, "metrics: could not listen on 127.0.0.1:%d", port);
+    close(fd);
+    return NULL;
+  }
+  log_message(INFO, "metrics endpoint on http://127.0.0.1:%d/metrics", port);
+
+  static char body[4096];
+  static char request[1024];
+  while (1) {
+    int client = accept(fd, NULL, NULL);
+    if (client < 0)
+      continue;
+
+    // one client at a time, one that connects and never sends or reads must
+    // not hold up the next scrape
+    struct timeval timeout = {.tv_sec = METRICS_IO_TIMEOUT_MS / 1000,
+                              .tv_usec = METRICS_IO_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // the request itself does not matter, read it so the client is not reset
+    ssize_t r = recv(client, request, sizeof(request), 0);
+    (void)r;
+
+    size_t len = metrics_format_prometheus(body, sizeof(body));
+    char header[160];
+    int hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\n\r\n",
+                        len);
+    // a client that already hung up must not take the synth down with
+    // SIGPIPE
+    if (send(client, header, hlen, MSG_NOSIGNAL) == hlen)
+      r = send(client, body, len, MSG_NOSIGNAL);
+    close(client);
+  }
+  return NULL;
+}
+
+void metrics_start_http(int port) {
+  if (port <= 0)
+    return;
+
+  pthread_t t;
+  pthread_create(&t, NULL, metrics_http_thread, (void *)(intptr_t)port);
+  pthread_detach(t);
+}
@@ -0,0 +1,68 @@
+#include "nco.h"
+#include "simd.h"
+#include <math.h>
+
+// one extra entry so interpolation at the last index never wraps
+static float sine_table[NCO_TABLE_SIZE + 1];
+
+void initNCOTables(void) {
+  for (int i = 0; i <= NCO_TABLE_SIZE; i++)
+    sine_table[i] = sinf(2.f * M_PI * i / NCO_TABLE_SIZE);
+}
+
+// freq / sample_rate as a fraction of 2^32, negative frequencies wrap around
+// to the equivalent backwards step
+uint32_t ncoPhaseIncrement(float freq, int sample_rate) {
+  double step = (double)freq / sample_rate * 4294967296.0;
+  return (uint32_t)(int64_t)llround(step);
+}
+
+// writes the phase of the next n samples and advances the accumulator,
+// four lanes start one increment apart and all step by 4 * inc
+void ncoPhaseBlock(uint32_t *phases, uint32_t *acc, uint32_t inc, size_t n) {
+  uint32_t a = *acc;
+  size_t t = 0;
+
+  v4u lane = v4u_set1(a) + (v4u){1, 2, 3, 4} * inc;
+  v4u step = v4u_set1(inc * SIMD_WIDTH);
+  for (; t + SIMD_WIDTH <= n; t += SIMD_WIDTH) {
+    v4u_store(&phases[t], lane);
+    lane += step;
+  }
+  a += (uint32_t)t * inc;
+
+  for (; t < n; t++) {
+    a += inc;
+    phases[t] = a;
+  }
+  *acc = a;
+}
+
+// top NCO_TABLE_BITS of the phase pick the table entry, the rest of the
+// bits are the interpolation fraction
+float ncoSine(uint32_t phase) {
+  uint32_t index = phase >> NCO_FRAC_BITS;
+  float frac = (phase & ((1u << NCO_FRAC_BITS) - 1)) *
+               (1.0f / (1u << NCO_FRAC_BITS));
+  float a = sine_table[index];
+  float b = sine_table[index + 1];
+  return a + (b - a) * frac;
+}
+
+void ncoSineBlock(float *out, const uint32_t *phases, size_t n) {
+  for (size_t t = 0; t < n; t++)
+    out[t] = ncoSine(phases[t]);
+}
+
+// four phases at once, the table reads are scalar but index and
+// interpolation are not
+v4f ncoSineV4(v4u phase) {
+  v4u index = phase >> NCO_FRAC_BITS;
+  v4f frac = v4f_from_u32(phase & ((1u << NCO_FRAC_BITS) - 1)) *
+             (1.0f / (1u << NCO_FRAC_BITS));
+  v4f a = {sine_table[index[0]], sine_table[index[1]], sine_table[index[2]],
+           sine_table[index[3]]};
+  v4f b = {sine_table[index[0] + 1], sine_table[index[1] + 1],
+           sine_table[index[2] + 1], sine_table[index[3] + 1]};
+  return a + (b - a) * frac;
+}
@@ -1,46 +1,50 @@
+#include <pthread.h>
 #include <signal.h>
+#include <sys/signalfd.h>
 #include <unistd.h>
 
 #include "commands.h"
 #include "hash.h"
+#include "metrics.h"
 #include "networking.h"
+#include "profiler.h"
 #include "utils.h"
 
 static network_cfg_t *global_network_cfg;
 extern struct lfq_ctx *g_lfq_ctx;
 
-static void signal_handler(int signum) {
-  if (signum == SIGINT || signum == SIGTERM) {
-    log_message(INFO, "received termination signal, shutting down...");
-    if (global_network_cfg && global_network_cfg->server_fd > 0) {
-      close(global_network_cfg->server_fd);
-    }
-    if (global_network_cfg && global_network_cfg->client_fd > 0) {
-      close(global_network_cfg->client_fd);
-    }
-    exit(0);
-  }
-}
-
+// main blocks SIGINT and SIGTERM in every thread, they queue on a signalfd
+// instead. the networking loop reads it and calls exit() from normal
+// context, so the exit handlers (snapshot, recorder, trace) can take locks
+// and wait on other threads
 static void setup_signal_handling(network_cfg_t *n) {
   global_network_cfg = n;
 
-  struct sigaction sa;
-  sa.sa_handler = signal_handler;
-  sa.sa_flags = 0;
-  sigemptyset(&sa.sa_mask);
-
-  if (sigaction(SIGINT, &sa, NULL) < 0) {
-    log_message(ERROR, "sigaction for SIGINT failed");
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  n->signal_fd = signalfd(-1, &stop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (n->signal_fd < 0) {
+    log_message(ERROR, "signalfd failed");
     exit(1);
   }
 
-  if (sigaction(SIGTERM, &sa, NULL) < 0) {
-    log_message(ERROR, "sigaction for SIGTERM failed");
-    exit(1);
-  }
+  log_message(INFO, "signal handling set up successfully");
+}
+
+static void handle_signals(network_cfg_t *n) {
+  struct signalfd_siginfo info;
+  if (!FD_ISSET(n->signal_fd, &n->readfds) ||
+      read(n->signal_fd, &info, sizeof(info)) != sizeof(info))
+    return;
 
-  log_message(INFO, "signal handlers set up successfully");
+  log_message(INFO, "received termination signal, shutting down...");
+  if (n->server_fd > 0)
+    close(n->server_fd);
+  if (n->client_fd > 0)
+    close(n->client_fd);
+  exit(0);
 }
 
 static void set_nonblocking(int sockfd) {
@@ -95,6 +99,9 @@ static void accept_data(network_cfg_t *n) {
   // add the server socket to the set
   FD_SET(n->server_fd, &n->readfds);
   n->max_sd = n->server_fd;
+  FD_SET(n->signal_fd, &n->readfds);
+  if (n->signal_fd > n->max_sd)
+    n->max_sd = n->signal_fd;
 
   // add any existing client socket to the set
   if (n->client_fd > 0) {
@@ -120,11 +127,15 @@ static void accept_data(network_cfg_t *n) {
   // incoming connection
   if (FD_ISSET(n->server_fd, &n->readfds)) {
     n->client_len = sizeof(n->client_addr);
-    if ((n->client_fd = accept(n->server_fd, (struct sockaddr *)&n->client_addr,
-                               &n->client_len)) < 0) {
+    PROFILE_BEGIN(PROF_NET_ACCEPT);
+    n->client_fd = accept(n->server_fd, (struct sockaddr *)&n->client_addr,
+                          &n->client_len);
+    PROFILE_END(PROF_NET_ACCEPT);
+    if (n->client_fd < 0) {
       log_message(ERROR, "accept failed");
     } else {
       log_message(INFO, "client connected!");
+      n->out_pending = 0;
       set_nonblocking(
           n->client_fd); // make the client socket non-blocking as well
     }
@@ -135,9 +146,13 @@ static void handle_data(network_cfg_t *n) {
   // check if the client has sent data
   if (n->client_fd > 0 && FD_ISSET(n->client_fd, &n->readfds)) {
     memset(n->buffer, 0, MSG_BUFFER_SIZE);
+    PROFILE_BEGIN(PROF_NET_READ);
     int valread = read(n->client_fd, n->buffer, MSG_BUFFER_SIZE);
+    PROFILE_END(PROF_NET_READ);
 
     if (valread > 0) {
+      PROFILE_BEGIN(PROF_NET_PARSE);
+      metrics_net_in(valread);
       size_t len = strlen(n->buffer);
       if (len > 0 &&
           (n->buffer[len - 1] == '\n' || n->buffer[len - 1] == '\r')) {
@@ -145,24 +160,31 @@ static void handle_data(network_cfg_t *n) {
       }
       // log_message(DEBUG, "message from tcl: ->%s<-", buffer);
 
+      // "head tail [channel]", the channel picks the part, 0 if missing
       char head[50], tail[50] = {NULL};
-      if (sscanf(n->buffer, "%s %s", head, tail) != 2) {
+      int channel = 0;
+      if (sscanf(n->buffer, "%49s %49s %d", head, tail, &channel) < 1) {
         log_message(ERROR, "invalid command format: ->%s<-", n->buffer);
         // continue;
       }
+      if (channel < 0 || channel > UINT8_MAX) {
+        log_message(ERROR, "invalid channel %d, using 0", channel);
+        channel = 0;
+      }
 
       command_fn f = find_function_by_command(head);
       if (f != NULL) {
         if (!strcmp(tail, "semicolon")) {
-          f(";");
+          f(";", channel);
         } else if (!strcmp(tail, "apostrophe")) {
-          f("'");
+          f("'", channel);
         } else {
-          f(tail);
+          f(tail, channel);
         }
       } else {
         log_message(ERROR, "invalid command: ->%s<-", head);
       }
+      PROFILE_END(PROF_NET_PARSE);
 
     } else if (valread == 0) {
       // client has disconnected
@@ -175,42 +197,103 @@ static void handle_data(network_cfg_t *n) {
 
 extern Synth *g_synth;
 
+static void drop_client(network_cfg_t *n) {
+  close(n->client_fd);
+  n->client_fd = -1;
+  n->out_pending = 0;
+}
+
+// sends what is left of the current frame, true once all of it is out. a
+// client that hung up is dropped, MSG_NOSIGNAL keeps SIGPIPE off the process
+static bool flush_frame(network_cfg_t *n) {
+  while (n->out_pending) {
+    ssize_t sent = send(n->client_fd, n->out + n->out_sent, n->out_pending,
+                        MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return false;
+    if (sent <= 0) {
+      log_message(ERROR, "error sending");
+      drop_client(n);
+      return false;
+    }
+    metrics_net_out(sent);
+    log_message(DEBUG, "sent %ld bytes", sent);
+    n->out_sent += sent;
+    n->out_pending -= sent;
+  }
+  return true;
+}
+
+// false if the frame was dropped: no client, or it has not read the last one
+static bool send_frame(network_cfg_t *n, uint8_t type, const void *data,
+                       size_t len) {
+  if (n->client_fd <= 0 || len > NET_FRAME_MAX || !flush_frame(n))
+    return false;
+
+  uint32_t length = htonl((uint32_t)len);
+  n->out[0] = type;
+  memcpy(n->out + 1, &length, sizeof(length));
+  memcpy(n->out + NET_FRAME_HEADER, data, len);
+  n->out_sent = 0;
+  n->out_pending = NET_FRAME_HEADER + len;
+  flush_frame(n);
+  return true;
+}
+
+// lets commands answer the client that sent them, called from handle_data
+void net_reply(const char *data, size_t len) {
+  network_cfg_t *n = global_network_cfg;
+  if (n && n->client_fd > 0 &&
+      !send_frame(n, NET_FRAME_TEXT, data, len))
+    log_message(WARNING, "reply of %zu bytes dropped, the client is behind",
+                len);
+}
+
 static void send_data(network_cfg_t *n) {
   if (n->client_fd > 0) {
+    PROFILE_BEGIN(PROF_NET_SEND);
 
-    static int8_t out_buffer[DOWNSAMPLE_SIZE];
-    static size_t downsampled_size_in_bytes = DOWNSAMPLE_SIZE * sizeof(int8_t);
+    int8_t *out_buffer = n->scope_buffer;
+    size_t downsampled_size_in_bytes = n->scope_length * sizeof(int8_t);
 
-    for (size_t i = 0, j = 0; i < DOWNSAMPLE_SIZE; ++i, j += DOWNSAMPLE_FACTOR) {
-      float sample = g_synth->signal[j];
+    for (size_t i = 0, j = 0; i < n->scope_length;
+         ++i, j += DOWNSAMPLE_FACTOR) {
+      // the master bus keeps the signal within the ceiling, but without
+      // the limiter a sum of voices can go past 1 and would wrap
+      float sample = fminf(fmaxf(g_synth->signal[j], -1.0f), 1.0f);
 
       int8_t resampled_value = (int8_t)(sample * 127);
       out_buffer[i] = resampled_value;
     }
 
-    ssize_t bytes_sent =
-        send(n->client_fd, (void *)out_buffer, downsampled_size_in_bytes, 0);
-
-    if (bytes_sent < 0) {
-      log_message(ERROR, "error sending");
-      close(n->client_fd);
-      n->client_fd = -1;
-    } else {
-      log_message(DEBUG, "sent %ld bytes", bytes_sent);
-    }
+    // a client that is behind misses scope frames, they are not queued
+    send_frame(n, NET_FRAME_SCOPE, out_buffer, downsampled_size_in_bytes);
+    PROFILE_END(PROF_NET_SEND);
   }
 }
 
 void networking_thread(void) {
   network_cfg_t n = {NULL};
+  profiler_thread_init("network");
   setup_signal_handling(&n);
   init_networking(&n);
 
+  n.scope_length = g_synth->signal_length / DOWNSAMPLE_FACTOR;
+  n.scope_buffer = malloc(n.scope_length * sizeof(int8_t));
+  if (!n.scope_buffer) {
+    log_message(ERROR, "could not allocate scope buffer");
+    exit(1);
+  }
+
   while (1) {
     accept_data(&n);
+    handle_signals(&n);
     handle_data(&n);
     send_data(&n);
   }
 
   close(n.server_fd);
+  free(n.scope_buffer);
 }
\ No newline at end of file
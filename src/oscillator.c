@@ -1,5 +1,6 @@
 #include "oscillator.h"
 #include <math.h>
+#include <string.h>
 
 Oscillator *makeOscillator(OscillatorArray *oscArray) {
   // add a new osc to the array
@@ -11,9 +12,10 @@ void clearOscillatorArray(OscillatorArray *oscArray) {
   oscArray->count = 0;
 }
 
-void updateOsc(Oscillator *osc, float freq_modulation) {
+// sample_duration is 1 / sample rate, or a fraction of it when oversampling
+void updateOsc(Oscillator *osc, float freq_modulation, float sample_duration) {
   // calc the phase increment for each sample based on the osc freq
-  osc->phase_dt = ((osc->freq + freq_modulation) * SAMPLE_DURATION);
+  osc->phase_dt = ((osc->freq + freq_modulation) * sample_duration);
   // increment the phase
   osc->phase += osc->phase_dt;
   // wrap if it goes over
@@ -110,6 +112,36 @@ float roundedSquareShape(const Oscillator osc) {
   return sample;
 }
 
+static const struct {
+  const char *name;
+  WaveShapeFn fn;
+} shapes[SHAPE_COUNT] = {
+    [SHAPE_SINE] = {"sine", sineShape},
+    [SHAPE_SAWTOOTH] = {"sawtooth", sawtoothShape},
+    [SHAPE_SQUARE] = {"square", squareShape},
+    [SHAPE_TRIANGLE] = {"triangle", triangleShape},
+    [SHAPE_ROUNDED_SQUARE] = {"rounded_square", roundedSquareShape},
+};
+
+// unknown ids fall back to sine so a corrupt patch still makes sound
+WaveShapeFn shapeFromId(ShapeId id) {
+  return (unsigned)id < SHAPE_COUNT ? shapes[id].fn : sineShape;
+}
+
+// returns -1 for an unknown name
+int shapeIdFromName(const char *name) {
+  for (int i = 0; i < SHAPE_COUNT; i++)
+    if (!strcmp(shapes[i].name, name))
+      return i;
+  return -1;
+}
+
+// shapes without band limiting alias at high notes and benefit from the
+// oversampled render path, the blep based ones are already clean enough
+bool shapeNeedsOversampling(WaveShapeFn fn) {
+  return fn == roundedSquareShape || fn == triangleShape;
+}
+
 // this function advances the state machine of the envelope
 // the envelope is only used by the kb oscillators, pre initialized in main
 // they gain amplitude and state when pressed, and release state is set if released
@@ -136,7 +168,10 @@ void updateADSR(ADSR *envelope, float delta_time) {
     }
     break;
   case SUSTAIN:
-    envelope->current_level = envelope->sustain_level;
+    // glide rather than jump, the level only differs after a reload
+    envelope->current_level +=
+        (envelope->sustain_level - envelope->current_level) *
+        ENVELOPE_SUSTAIN_GLIDE;
     envelope->sustain_time_elapsed += delta_time;
     if (envelope->sustain_time_elapsed >= envelope->sustain_time) {
         envelope->state = RELEASE;
@@ -0,0 +1,89 @@
+#include "oversample.h"
+#include <math.h>
+#include <string.h>
+
+// kaiser windowed (beta 7) half-band, normalized to unity dc gain
+// passband flat to 0.18 fs, stopband below -69 dB from 0.32 fs
+// coefficients for offsets 1, 3, 5 ... 15 from the centre tap
+static const float halfband_coeffs[HALFBAND_PAIRS] = {
+    0.314333444f,  -0.094603225f, 0.0460590503f,  -0.0237425495f,
+    0.011624843f,  -0.0050374648f, 0.00176029972f, -0.000394397396f};
+
+#define HALFBAND_CENTRE (HALFBAND_TAPS / 2)
+
+void resetOversampler(Oversampler *os, int factor) {
+  memset(os, 0, sizeof(*os));
+  os->factor = factor;
+}
+
+static inline void pushSample(HalfbandDecimator *d, float x) {
+  d->pos = (d->pos + 1) % HALFBAND_TAPS;
+  d->history[d->pos] = x;
+  d->history[d->pos + HALFBAND_TAPS] = x;
+}
+
+// takes two input samples and returns one output sample at half the rate
+// polyphase form: the even branch is a pure delay through the centre tap,
+// the odd branch is a symmetric fir, so every pair shares one multiply
+float decimateHalfband(HalfbandDecimator *d, float x0, float x1) {
+  pushSample(d, x0);
+  pushSample(d, x1);
+
+  // w[0] is the oldest sample, w[HALFBAND_TAPS - 1] the newest
+  const float *w = d->history + d->pos + 1;
+
+  float acc = 0.5f * w[HALFBAND_CENTRE];
+  for (int k = 0; k < HALFBAND_PAIRS; k++) {
+    int offset = 2 * k + 1;
+    acc += halfband_coeffs[k] *
+           (w[HALFBAND_CENTRE - offset] + w[HALFBAND_CENTRE + offset]);
+  }
+  return acc;
+}
+
+// the other direction: one input sample in, two out at twice the rate. of
+// the zero stuffed input only every other tap sees a sample, so the first
+// output is the symmetric fir over the last 16 inputs and the second is the
+// input through the centre tap, 7.5 input samples of delay either way
+void interpolateHalfband(HalfbandDecimator *d, float x, float out[2]) {
+  pushSample(d, x);
+  const float *w = d->history + d->pos + 1;
+
+  // w[HALFBAND_TAPS - 1] is x, w[HALFBAND_TAPS - 1 - k] is k samples older
+  int mid = HALFBAND_TAPS - 1 - HALFBAND_PAIRS + 1;
+  float acc = 0.0f;
+  for (int k = 0; k < HALFBAND_PAIRS; k++)
+    acc += halfband_coeffs[k] * (w[mid + k] + w[mid - 1 - k]);
+  // zero stuffing halves the level, the factor 2 restores it
+  out[0] = 2.0f * acc;
+  out[1] = w[mid];
+}
+
+// reduces os->factor input samples to one output sample by cascading 2x stages
+float decimateOversampled(Oversampler *os, const float *in) {
+  float buf[OVERSAMPLE_MAX_FACTOR];
+  int n = os->factor;
+
+  if (n <= 1)
+    return in[0];
+
+  for (int i = 0; i < n; i++)
+    buf[i] = in[i];
+
+  for (int s = 0; n > 1; s++) {
+    for (int i = 0; i < n / 2; i++)
+      buf[i] = decimateHalfband(&os->stage[s], buf[2 * i], buf[2 * i + 1]);
+    n /= 2;
+  }
+  return buf[0];
+}
+
+// picks the smallest factor that keeps OVERSAMPLE_HARMONICS harmonics of freq
+// below the oversampled nyquist, so low notes render at 1x
+int chooseOversampleFactor(float freq, float sample_rate) {
+  float highest = fabsf(freq) * OVERSAMPLE_HARMONICS;
+  int factor = 1;
+  while (factor < OVERSAMPLE_MAX_FACTOR && highest > factor * sample_rate / 2)
+    factor *= 2;
+  return factor;
+}
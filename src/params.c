@@ -0,0 +1,264 @@
+#include "params.h"
+#include "utils.h"
+#include "yaml.h"
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+
+// the snapshot new blocks should use, and the one the audio thread used last
+static _Atomic(synth_params_t *) current_params = NULL;
+static _Atomic(synth_params_t *) params_in_use = NULL;
+
+void params_defaults(synth_params_t *p) {
+  *p = (synth_params_t){
+      .envelope = {.attack_time = ENVELOPE_DEFAULT_ATTACK_TIME,
+                   .decay_time = ENVELOPE_DEFAULT_DECAY_TIME,
+                   .sustain_level = ENVELOPE_DEFAULT_SUSTAIN_LEVEL,
+                   .release_time = ENVELOPE_DEFAULT_RELEASE_TIME,
+                   .sustain_time = ENVELOPE_DEFAULT_SUSTAIN_TIME,
+                   .current_level = 0.0f,
+                   .state = OFF},
+      .oversample_mode = OVERSAMPLE_VOICE,
+      .oversample_factor = 4,
+      .nco = false};
+
+  // one part per channel over the whole keyboard, channel 0 alone sounds
+  // like the single timbre synth this used to be
+  for (int i = 0; i < NUM_PARTS; i++)
+    p->parts[i] = (part_params_t){.channel = i,
+                                  .key_low = 0,
+                                  .key_high = NUM_KEYS - 1,
+                                  .voices = NUM_KEYS,
+                                  .program = -1};
+  masterDefaults(&p->master);
+}
+
+// takes a hash_t and if the value is proper sets it to the reference
+static void hash_get_and_set_float(hash_t *h, char *cs, float *f) {
+  char *str = hash_get(h, cs);
+  if (!str)
+    return;
+
+  char *eptr;
+  float num = strtof(str, &eptr);
+
+  if (*eptr == '\0') {
+    *f = num;
+  } else {
+    log_message(ERROR, "%s could not be converted to float, ignoring", cs);
+  }
+}
+
+static void hash_get_and_set_bool(hash_t *h, char *cs, bool *b) {
+  char *str = hash_get(h, cs);
+  if (!str)
+    return;
+
+  if (!strcmp(str, "true") || !strcmp(str, "1")) {
+    *b = true;
+  } else if (!strcmp(str, "false") || !strcmp(str, "0")) {
+    *b = false;
+  } else {
+    log_message(ERROR, "%s must be true or false, ignoring", cs);
+  }
+}
+
+// oversample.mode is one of off, voice or bus, bus also takes oversample.factor
+static void hash_get_and_set_oversample(hash_t *h, synth_params_t *p) {
+  char *mode = hash_get(h, "oversample.mode");
+  if (mode) {
+    if (!strcmp(mode, "off")) {
+      p->oversample_mode = OVERSAMPLE_OFF;
+    } else if (!strcmp(mode, "voice")) {
+      p->oversample_mode = OVERSAMPLE_VOICE;
+    } else if (!strcmp(mode, "bus")) {
+      p->oversample_mode = OVERSAMPLE_BUS;
+    } else {
+      log_message(ERROR, "unknown oversample.mode %s, ignoring", mode);
+    }
+  }
+
+  char *factor = hash_get(h, "oversample.factor");
+  if (factor) {
+    int f = atoi(factor);
+    if (f == 1 || f == 2 || f == 4 || f == 8) {
+      p->oversample_factor = f;
+    } else {
+      log_message(ERROR, "oversample.factor must be 1, 2, 4 or 8, ignoring");
+    }
+  }
+}
+
+// parts.N.channel, .low, .high, .voices and .program
+static void hash_get_and_set_parts(hash_t *h, synth_params_t *p) {
+  static const char *fields[] = {"channel", "low", "high", "voices",
+                                 "program"};
+
+  for (int i = 0; i < NUM_PARTS; i++) {
+    part_params_t *part = &p->parts[i];
+    int *values[] = {&part->channel, &part->key_low, &part->key_high,
+                     &part->voices, &part->program};
+
+    for (size_t f = 0; f < sizeof(fields) / sizeof(*fields); f++) {
+      char key[32];
+      snprintf(key, sizeof(key), "parts.%d.%s", i, fields[f]);
+      char *str = hash_get(h, key);
+      if (str)
+        *values[f] = atoi(str);
+    }
+
+    if (part->key_low < 0)
+      part->key_low = 0;
+    if (part->key_high >= NUM_KEYS)
+      part->key_high = NUM_KEYS - 1;
+    if (part->voices < 0 || part->voices > NUM_OSCILLATORS) {
+      log_message(ERROR, "parts.%d.voices must be within 0..%d, clamping", i,
+                  NUM_OSCILLATORS);
+      part->voices = part->voices < 0 ? 0 : NUM_OSCILLATORS;
+    }
+  }
+}
+
+void params_apply_config(synth_params_t *p, hash_t *config) {
+  hash_get_and_set_float(config, "envelope.attack_time",
+                         &p->envelope.attack_time);
+  hash_get_and_set_float(config, "envelope.decay_time",
+                         &p->envelope.decay_time);
+  hash_get_and_set_float(config, "envelope.sustain_level",
+                         &p->envelope.sustain_level);
+  hash_get_and_set_float(config, "envelope.sustain_time",
+                         &p->envelope.sustain_time);
+  hash_get_and_set_float(config, "envelope.release_time",
+                         &p->envelope.release_time);
+  hash_get_and_set_oversample(config, p);
+  hash_get_and_set_parts(config, p);
+
+  hash_get_and_set_bool(config, "master.limiter", &p->master.limiter);
+  hash_get_and_set_float(config, "master.ceiling", &p->master.ceiling);
+  hash_get_and_set_float(config, "master.lookahead", &p->master.lookahead_ms);
+  hash_get_and_set_float(config, "master.release", &p->master.release_ms);
+  hash_get_and_set_bool(config, "master.clipper", &p->master.clipper);
+  hash_get_and_set_float(config, "master.drive", &p->master.drive);
+
+  char *phase = hash_get(config, "oscillator.phase");
+  if (phase) {
+    if (!strcmp(phase, "nco")) {
+      p->nco = true;
+    } else if (!strcmp(phase, "float")) {
+      p->nco = false;
+    } else {
+      log_message(ERROR, "oscillator.phase must be nco or float, ignoring");
+    }
+  }
+}
+
+void params_init(const synth_params_t *initial) {
+  synth_params_t *p = malloc(sizeof(synth_params_t));
+  *p = *initial;
+  p->version = 1;
+  atomic_store(&params_in_use, p);
+  atomic_store(&current_params, p);
+}
+
+// audio thread, once per block: one load and one store, never blocks
+const synth_params_t *params_acquire(void) {
+  synth_params_t *p = atomic_load_explicit(&current_params,
+                                           memory_order_acquire);
+  atomic_store_explicit(&params_in_use, p, memory_order_release);
+  return p;
+}
+
+// copies p into a fresh snapshot and swaps it in. the old snapshot is freed
+// once the audio thread has picked up the new one, or leaked if it never
+// does within a second (no audio thread running)
+void params_publish(const synth_params_t *p) {
+  synth_params_t *next = malloc(sizeof(synth_params_t));
+  if (!next) {
+    log_message(ERROR, "params: out of memory, keeping old values");
+    return;
+  }
+
+  synth_params_t *old = atomic_load(&current_params);
+  *next = *p;
+  next->version = old ? old->version + 1 : 1;
+  atomic_store_explicit(&current_params, next, memory_order_release);
+
+  if (!old)
+    return;
+
+  struct timespec wait = {.tv_sec = 0, .tv_nsec = 1000 * 1000};
+  for (int i = 0; i < 1000; i++) {
+    if (atomic_load_explicit(&params_in_use, memory_order_acquire) != old) {
+      free(old);
+      return;
+    }
+    nanosleep(&wait, NULL);
+  }
+  log_message(WARNING, "params: audio thread did not pick up snapshot %lu",
+              next->version);
+}
+
+// from the defaults and the whole file, as at startup: a key taken out of
+// the file goes back to its default and not to whatever was live
+static void reload(const char *path) {
+  yaml_doc_t *doc = yaml_read(path);
+  if (!doc) {
+    log_message(ERROR, "%s failed to reload, keeping old values", path);
+    return;
+  }
+
+  synth_params_t p;
+  params_defaults(&p);
+  params_apply_config(&p, doc->hash);
+  yaml_free(doc);
+
+  params_publish(&p);
+  log_message(INFO, "%s reloaded, parameter snapshot %lu", path,
+              atomic_load(&current_params)->version);
+}
+
+// watches the directory rather than the file, editors usually save by
+// writing a temporary file and renaming it over the original
+static void *watcher_thread(void *arg) {
+  const char *path = arg;
+  char dir_buf[256], base_buf[256];
+  snprintf(dir_buf, sizeof(dir_buf), "%s", path);
+  snprintf(base_buf, sizeof(base_buf), "%s", path);
+  const char *dir = dirname(dir_buf);
+  const char *base = basename(base_buf);
+
+  int fd = inotify_init();
+  if (fd < 0 ||
+      inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    log_message(ERROR, "inotify on %s failed, hot reload disabled", dir);
+    return NULL;
+  }
+  log_message(INFO, "watching %s for changes", path);
+
+  char events[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (1) {
+    ssize_t len = read(fd, events, sizeof(events));
+    if (len <= 0)
+      continue;
+
+    bool changed = false;
+    for (char *e = events; e < events + len;) {
+      struct inotify_event *ev = (struct inotify_event *)e;
+      if (ev->len && !strcmp(ev->name, base))
+        changed = true;
+      e += sizeof(struct inotify_event) + ev->len;
+    }
+    if (changed)
+      reload(path);
+  }
+  return NULL;
+}
+
+void params_start_watcher(const char *path) {
+  pthread_t t;
+  pthread_create(&t, NULL, watcher_thread, (void *)path);
+  pthread_detach(t);
+}
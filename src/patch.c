@@ -0,0 +1,344 @@
+#include "patch.h"
+#include "additive.h"
+#include "unison.h"
+#include "utils.h"
+#include "yaml.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void patch_defaults(patch_t *p) {
+  memset(p, 0, sizeof(*p));
+  snprintf(p->name, sizeof(p->name), "default");
+  p->shape = SHAPE_SINE;
+  p->amplitude = 0.5f;
+  p->shape_parameter_0 = 1.0f;
+  p->attack_time = ENVELOPE_DEFAULT_ATTACK_TIME;
+  p->decay_time = ENVELOPE_DEFAULT_DECAY_TIME;
+  p->sustain_level = ENVELOPE_DEFAULT_SUSTAIN_LEVEL;
+  p->sustain_time = ENVELOPE_DEFAULT_SUSTAIN_TIME;
+  p->release_time = ENVELOPE_DEFAULT_RELEASE_TIME;
+  p->waveguide_brightness = 0.5f;
+}
+
+static const char *param_names[PARAM_COUNT] = {
+    [PARAM_SHAPE] = "shape",
+    [PARAM_AMPLITUDE] = "amplitude",
+    [PARAM_SHAPE_PARAMETER_0] = "shape_parameter_0",
+    [PARAM_ATTACK_TIME] = "attack_time",
+    [PARAM_DECAY_TIME] = "decay_time",
+    [PARAM_SUSTAIN_LEVEL] = "sustain_level",
+    [PARAM_SUSTAIN_TIME] = "sustain_time",
+    [PARAM_RELEASE_TIME] = "release_time",
+    [PARAM_FILTER_CUTOFF] = "filter_cutoff",
+    [PARAM_UNISON_VOICES] = "unison_voices",
+    [PARAM_UNISON_DETUNE] = "unison_detune",
+    [PARAM_UNISON_SPREAD] = "unison_spread",
+    [PARAM_ADDITIVE_PARTIALS] = "additive_partials",
+    [PARAM_ADDITIVE_TILT] = "additive_tilt",
+    [PARAM_ADDITIVE_STRETCH] = "additive_stretch",
+    [PARAM_WAVEGUIDE_DECAY] = "waveguide_decay",
+    [PARAM_WAVEGUIDE_BRIGHTNESS] = "waveguide_brightness",
+    [PARAM_WAVEGUIDE_POSITION] = "waveguide_position",
+    [PARAM_PAN] = "pan",
+};
+
+// returns -1 for an unknown name
+int patchParamFromName(const char *name) {
+  for (int i = 0; i < PARAM_COUNT; i++)
+    if (!strcmp(param_names[i], name))
+      return i;
+  return -1;
+}
+
+void patchSetParam(patch_t *p, PatchParam param, float value) {
+  switch (param) {
+  case PARAM_SHAPE:
+    if (value >= 0 && value < SHAPE_COUNT)
+      p->shape = (uint32_t)value;
+    break;
+  case PARAM_AMPLITUDE:
+    p->amplitude = value;
+    break;
+  case PARAM_SHAPE_PARAMETER_0:
+    p->shape_parameter_0 = value;
+    break;
+  case PARAM_ATTACK_TIME:
+    p->attack_time = value;
+    break;
+  case PARAM_DECAY_TIME:
+    p->decay_time = value;
+    break;
+  case PARAM_SUSTAIN_LEVEL:
+    p->sustain_level = value;
+    break;
+  case PARAM_SUSTAIN_TIME:
+    p->sustain_time = value;
+    break;
+  case PARAM_RELEASE_TIME:
+    p->release_time = value;
+    break;
+  case PARAM_FILTER_CUTOFF:
+    p->filter_cutoff = value;
+    break;
+  case PARAM_UNISON_VOICES:
+    if (value >= 0 && value <= UNISON_MAX_VOICES)
+      p->unison_voices = (uint32_t)value;
+    break;
+  case PARAM_UNISON_DETUNE:
+    p->unison_detune = value;
+    break;
+  case PARAM_UNISON_SPREAD:
+    p->unison_spread = value;
+    break;
+  case PARAM_ADDITIVE_PARTIALS:
+    if (value >= 0 && value <= ADDITIVE_MAX_PARTIALS)
+      p->additive_partials = (uint32_t)value;
+    break;
+  case PARAM_ADDITIVE_TILT:
+    p->additive_tilt = value;
+    break;
+  case PARAM_ADDITIVE_STRETCH:
+    p->additive_stretch = value;
+    break;
+  case PARAM_WAVEGUIDE_DECAY:
+    p->waveguide_decay = value;
+    break;
+  case PARAM_WAVEGUIDE_BRIGHTNESS:
+    p->waveguide_brightness = value;
+    break;
+  case PARAM_WAVEGUIDE_POSITION:
+    p->waveguide_position = value;
+    break;
+  case PARAM_PAN:
+    p->pan = fmaxf(-1.0f, fminf(1.0f, value));
+    break;
+  case PARAM_COUNT:
+    break;
+  }
+}
+
+float patchGetParam(const patch_t *p, PatchParam param) {
+  switch (param) {
+  case PARAM_SHAPE:
+    return p->shape;
+  case PARAM_AMPLITUDE:
+    return p->amplitude;
+  case PARAM_SHAPE_PARAMETER_0:
+    return p->shape_parameter_0;
+  case PARAM_ATTACK_TIME:
+    return p->attack_time;
+  case PARAM_DECAY_TIME:
+    return p->decay_time;
+  case PARAM_SUSTAIN_LEVEL:
+    return p->sustain_level;
+  case PARAM_SUSTAIN_TIME:
+    return p->sustain_time;
+  case PARAM_RELEASE_TIME:
+    return p->release_time;
+  case PARAM_FILTER_CUTOFF:
+    return p->filter_cutoff;
+  case PARAM_UNISON_VOICES:
+    return p->unison_voices;
+  case PARAM_UNISON_DETUNE:
+    return p->unison_detune;
+  case PARAM_UNISON_SPREAD:
+    return p->unison_spread;
+  case PARAM_ADDITIVE_PARTIALS:
+    return p->additive_partials;
+  case PARAM_ADDITIVE_TILT:
+    return p->additive_tilt;
+  case PARAM_ADDITIVE_STRETCH:
+    return p->additive_stretch;
+  case PARAM_WAVEGUIDE_DECAY:
+    return p->waveguide_decay;
+  case PARAM_WAVEGUIDE_BRIGHTNESS:
+    return p->waveguide_brightness;
+  case PARAM_WAVEGUIDE_POSITION:
+    return p->waveguide_position;
+  case PARAM_PAN:
+    return p->pan;
+  case PARAM_COUNT:
+    break;
+  }
+  return 0.0f;
+}
+
+static int get_float(hash_t *h, const char *file, char *key, float *f) {
+  char *str = hash_get(h, key);
+  if (!str)
+    return 0;
+
+  char *eptr;
+  float num = strtof(str, &eptr);
+  if (*eptr != '\0') {
+    log_message(ERROR, "%s: %s is not a number", file, key);
+    return -1;
+  }
+  *f = num;
+  return 0;
+}
+
+static int patch_from_yaml(patch_t *p, const char *file) {
+  yaml_doc_t *doc = yaml_read(file);
+  if (!doc)
+    return -1;
+
+  patch_defaults(p);
+  int err = 0;
+
+  char *name = hash_get(doc->hash, "name");
+  snprintf(p->name, sizeof(p->name), "%s", name ? name : file);
+
+  char *shape = hash_get(doc->hash, "shape");
+  if (shape) {
+    int id = shapeIdFromName(shape);
+    if (id < 0) {
+      log_message(ERROR, "%s: unknown shape %s", file, shape);
+      err = -1;
+    } else {
+      p->shape = id;
+    }
+  }
+
+  err |= get_float(doc->hash, file, "amplitude", &p->amplitude);
+  err |= get_float(doc->hash, file, "shape_parameter_0", &p->shape_parameter_0);
+  err |= get_float(doc->hash, file, "envelope.attack_time", &p->attack_time);
+  err |= get_float(doc->hash, file, "envelope.decay_time", &p->decay_time);
+  err |= get_float(doc->hash, file, "envelope.sustain_level",
+                   &p->sustain_level);
+  err |= get_float(doc->hash, file, "envelope.sustain_time", &p->sustain_time);
+  err |= get_float(doc->hash, file, "envelope.release_time", &p->release_time);
+  err |= get_float(doc->hash, file, "filter_cutoff", &p->filter_cutoff);
+
+  float voices = p->unison_voices;
+  err |= get_float(doc->hash, file, "unison.voices", &voices);
+  if (voices < 0 || voices > UNISON_MAX_VOICES) {
+    log_message(ERROR, "%s: unison.voices must be 0 to %d", file,
+                UNISON_MAX_VOICES);
+    err = -1;
+  } else {
+    p->unison_voices = (uint32_t)voices;
+  }
+  err |= get_float(doc->hash, file, "unison.detune", &p->unison_detune);
+  err |= get_float(doc->hash, file, "unison.spread", &p->unison_spread);
+
+  float partials = p->additive_partials;
+  err |= get_float(doc->hash, file, "additive.partials", &partials);
+  if (partials < 0 || partials > ADDITIVE_MAX_PARTIALS) {
+    log_message(ERROR, "%s: additive.partials must be 0 to %d", file,
+                ADDITIVE_MAX_PARTIALS);
+    err = -1;
+  } else {
+    p->additive_partials = (uint32_t)partials;
+  }
+  err |= get_float(doc->hash, file, "additive.tilt", &p->additive_tilt);
+  err |= get_float(doc->hash, file, "additive.stretch", &p->additive_stretch);
+  err |= get_float(doc->hash, file, "waveguide.decay", &p->waveguide_decay);
+  err |= get_float(doc->hash, file, "waveguide.brightness",
+                   &p->waveguide_brightness);
+  err |= get_float(doc->hash, file, "waveguide.position",
+                   &p->waveguide_position);
+  err |= get_float(doc->hash, file, "pan", &p->pan);
+  if (p->pan < -1.0f || p->pan > 1.0f) {
+    log_message(ERROR, "%s: pan must be -1 to 1", file);
+    err = -1;
+  }
+
+  yaml_free(doc);
+  return err;
+}
+
+// compiles the yaml patches into one bank, program numbers follow the order
+// of the sources. returns 0 on success
+int patch_compile_bank(const char *out, char **sources, int count) {
+  if (count <= 0 || count > PATCH_MAX_PROGRAMS) {
+    log_message(ERROR, "a bank holds 1 to %d patches", PATCH_MAX_PROGRAMS);
+    return -1;
+  }
+
+  patch_t *patches = calloc(count, sizeof(patch_t));
+  if (!patches)
+    return -1;
+
+  for (int i = 0; i < count; i++) {
+    if (patch_from_yaml(&patches[i], sources[i]) != 0) {
+      free(patches);
+      return -1;
+    }
+    log_message(INFO, "program %d: %s", i, patches[i].name);
+  }
+
+  patch_bank_header_t header = {.magic = PATCH_MAGIC,
+                                .version = PATCH_VERSION,
+                                .count = count,
+                                .record_size = sizeof(patch_t)};
+
+  FILE *f = fopen(out, "wb");
+  if (!f) {
+    perror(out);
+    free(patches);
+    return -1;
+  }
+  int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+           fwrite(patches, sizeof(patch_t), count, f) == (size_t)count;
+  ok &= fclose(f) == 0;
+  free(patches);
+
+  if (!ok) {
+    log_message(ERROR, "writing %s failed", out);
+    return -1;
+  }
+  log_message(INFO, "wrote %d patches to %s", count, out);
+  return 0;
+}
+
+patch_bank_t *patch_bank_load(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(patch_bank_header_t)) {
+    log_message(ERROR, "%s is not a patch bank", path);
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    log_message(ERROR, "mmap of %s failed", path);
+    return NULL;
+  }
+
+  const patch_bank_header_t *h = map;
+  size_t needed = sizeof(*h) + (size_t)h->count * sizeof(patch_t);
+  if (h->magic != PATCH_MAGIC || h->version != PATCH_VERSION ||
+      h->record_size != sizeof(patch_t) || h->count == 0 ||
+      h->count > PATCH_MAX_PROGRAMS || (size_t)st.st_size < needed) {
+    log_message(ERROR, "%s: bad header or version, recompile the bank", path);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  patch_bank_t *bank = malloc(sizeof(patch_bank_t));
+  if (!bank) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  bank->map = map;
+  bank->map_size = st.st_size;
+  bank->patches = (const patch_t *)((const char *)map + sizeof(*h));
+  bank->count = h->count;
+  return bank;
+}
+
+void patch_bank_free(patch_bank_t *bank) {
+  if (!bank)
+    return;
+  munmap(bank->map, bank->map_size);
+  free(bank);
+}
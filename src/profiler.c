@@ -0,0 +1,181 @@
+#include "profiler.h"
+#include "utils.h"
+
+#ifdef PROFILER
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct profile_span {
+  uint64_t start, end;
+  uint32_t stage;
+} profile_span_t;
+
+// one writer, the thread that owns it. count only grows, a span is at
+// count % PROFILER_RING_SPANS
+typedef struct profile_ring {
+  _Atomic uint64_t count;
+  int tid;
+  char name[16];
+  struct profile_ring *next;
+  profile_span_t spans[PROFILER_RING_SPANS];
+} profile_ring_t;
+
+static _Atomic(profile_ring_t *) profile_rings = NULL;
+static _Atomic int next_tid = 1;
+static _Thread_local profile_ring_t *thread_profile = NULL;
+
+static const char *stage_names[PROF_STAGE_COUNT] = {
+    [PROF_BLOCK] = "block",
+    [PROF_PARAMS] = "params",
+    [PROF_DRAIN] = "drain events",
+    [PROF_SEQUENCER] = "sequencer",
+    [PROF_RENDER] = "render",
+    [PROF_EVENTS] = "due events",
+    [PROF_KEYS] = "handle_keys",
+    [PROF_VOICES] = "voices",
+    [PROF_MASTER] = "master",
+    [PROF_ANALYZER] = "analyzer",
+    [PROF_RECORDER] = "recorder",
+    [PROF_OUTPUT] = "output write",
+    [PROF_NET_ACCEPT] = "accept",
+    [PROF_NET_READ] = "read",
+    [PROF_NET_PARSE] = "parse",
+    [PROF_NET_SEND] = "send",
+};
+
+// timestamp of the calibration and ticks per microsecond
+static uint64_t origin;
+static double ticks_per_us = 1000.0;
+static pthread_once_t calibrated = PTHREAD_ONCE_INIT;
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void calibrate(void) {
+  uint64_t ns = monotonic_ns();
+  origin = profileNow();
+#if defined(__x86_64__) || defined(__i386__)
+  struct timespec wait = {.tv_sec = 0, .tv_nsec = 20 * 1000 * 1000};
+  nanosleep(&wait, NULL);
+  uint64_t ticks = profileNow() - origin;
+  ns = monotonic_ns() - ns;
+  ticks_per_us = ticks * 1000.0 / ns;
+  log_message(INFO, "profiler: tsc at %.1f MHz", ticks_per_us);
+#else
+  (void)ns;
+#endif
+}
+
+void profiler_thread_init(const char *name) {
+  pthread_once(&calibrated, calibrate);
+  if (thread_profile)
+    return;
+
+  profile_ring_t *r = calloc(1, sizeof(profile_ring_t));
+  if (!r) {
+    log_message(ERROR, "profiler: no ring for %s", name);
+    return;
+  }
+  r->tid = atomic_fetch_add(&next_tid, 1);
+  snprintf(r->name, sizeof(r->name), "%s", name);
+
+  profile_ring_t *head = atomic_load(&profile_rings);
+  do {
+    r->next = head;
+  } while (!atomic_compare_exchange_weak(&profile_rings, &head, r));
+  thread_profile = r;
+}
+
+void profileSpan(ProfileStage stage, uint64_t start) {
+  uint64_t end = profileNow();
+  profile_ring_t *r = thread_profile;
+  if (!r)
+    return;
+  uint64_t n = atomic_load_explicit(&r->count, memory_order_relaxed);
+  r->spans[n & (PROFILER_RING_SPANS - 1)] =
+      (profile_span_t){.start = start, .end = end, .stage = stage};
+  atomic_store_explicit(&r->count, n + 1, memory_order_release);
+}
+
+// copies the ring while its thread keeps writing. spans the writer may
+// have overwritten during the copy are left out, returns how many are kept
+static size_t copy_ring(profile_ring_t *r, profile_span_t *out) {
+  uint64_t count = atomic_load_explicit(&r->count, memory_order_acquire);
+  uint64_t first = count > PROFILER_RING_SPANS ? count - PROFILER_RING_SPANS
+                                               : 0;
+  for (uint64_t i = first; i < count; i++)
+    out[i - first] = r->spans[i & (PROFILER_RING_SPANS - 1)];
+
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t after = atomic_load_explicit(&r->count, memory_order_relaxed);
+  uint64_t valid = after > PROFILER_RING_SPANS ? after - PROFILER_RING_SPANS
+                                               : 0;
+  size_t skip = valid > first ? valid - first : 0;
+  if (skip >= count - first)
+    return 0;
+  memmove(out, out + skip, (count - first - skip) * sizeof(*out));
+  return count - first - skip;
+}
+
+static double to_us(uint64_t ticks) {
+  return ((double)ticks - (double)origin) / ticks_per_us;
+}
+
+bool profiler_dump(const char *path) {
+  profile_span_t *spans = malloc(PROFILER_RING_SPANS * sizeof(*spans));
+  FILE *f = spans ? fopen(path, "w") : NULL;
+  if (!f) {
+    log_message(ERROR, "profiler: could not write %s", path);
+    free(spans);
+    return false;
+  }
+
+  int pid = getpid();
+  size_t total = 0;
+  const char *sep = "";
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for (profile_ring_t *r = atomic_load(&profile_rings); r; r = r->next) {
+    fprintf(f,
+            "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s\"}}",
+            sep, pid, r->tid, r->name);
+    sep = ",\n";
+    size_t n = copy_ring(r, spans);
+    for (size_t i = 0; i < n; i++)
+      fprintf(f,
+              ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+              "\"pid\":%d,\"tid\":%d}",
+              stage_names[spans[i].stage], to_us(spans[i].start),
+              (spans[i].end - spans[i].start) / ticks_per_us, pid, r->tid);
+    total += n;
+  }
+  fprintf(f, "\n]}\n");
+  bool ok = !ferror(f);
+  ok &= fclose(f) == 0;
+  free(spans);
+
+  if (ok)
+    log_message(INFO, "profiler: %zu spans in %s", total, path);
+  else
+    log_message(ERROR, "profiler: could not write %s", path);
+  return ok;
+}
+
+#else
+
+void profiler_thread_init(const char *name) { (void)name; }
+
+bool profiler_dump(const char *path) {
+  log_message(ERROR, "profiler: not compiled in, build with -DPROFILER=ON to "
+                     "write %s",
+              path);
+  return false;
+}
+
+#endif
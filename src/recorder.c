@@ -0,0 +1,312 @@
+#define _GNU_SOURCE // O_DIRECT
+#include "recorder.h"
+#include "metrics.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct recorder {
+  char path[256];
+  int fd;
+  bool direct;
+  int sample_rate;
+  int channels;
+
+  float *ring;
+  uint64_t capacity; // samples, power of two
+  _Atomic uint64_t write_pos; // audio thread
+  _Atomic uint64_t read_pos;  // writer thread
+  _Atomic bool stopping;
+
+  char *chunk; // RECORDER_CHUNK bytes and the header block, aligned
+  uint64_t data_bytes; // written after the header
+  uint64_t reported_overruns;
+  pthread_t writer;
+} recorder_t;
+
+// the recorder the audio thread pushes into. push_count is odd while the
+// audio thread is inside recorder_push, stop waits for it to come out
+static _Atomic(recorder_t *) active = NULL;
+static _Atomic uint64_t push_count = 0;
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool stop_registered = false;
+
+void recorder_push(const float *signal, size_t frames) {
+  atomic_fetch_add(&push_count, 1);
+  recorder_t *r = atomic_load(&active);
+  if (!r) {
+    atomic_fetch_add(&push_count, 1);
+    return;
+  }
+
+  size_t n = frames * r->channels;
+  uint64_t w = atomic_load_explicit(&r->write_pos, memory_order_relaxed);
+  uint64_t rd = atomic_load_explicit(&r->read_pos, memory_order_acquire);
+  if (r->capacity - (w - rd) < n) {
+    atomic_fetch_add_explicit(&g_metrics.recorder_overruns, frames,
+                              memory_order_relaxed);
+  } else {
+    size_t start = w & (r->capacity - 1);
+    size_t first = n < r->capacity - start ? n : r->capacity - start;
+    memcpy(r->ring + start, signal, first * sizeof(float));
+    memcpy(r->ring, signal + first, (n - first) * sizeof(float));
+    atomic_store_explicit(&r->write_pos, w + n, memory_order_release);
+  }
+  atomic_fetch_add(&push_count, 1);
+}
+
+// riff header, a ds64 placeholder, fmt, a JUNK pad and the data chunk
+// header, RECORDER_ALIGN bytes in all
+typedef struct __attribute__((packed)) wav_header {
+  char riff[4];
+  uint32_t riff_size;
+  char wave[4];
+  char ds64[4]; // JUNK until the file needs rf64
+  uint32_t ds64_size;
+  uint64_t riff_size64;
+  uint64_t data_size64;
+  uint64_t sample_count64;
+  uint32_t table_length;
+  char fmt[4];
+  uint32_t fmt_size;
+  uint16_t format; // 3, ieee float
+  uint16_t channels;
+  uint32_t sample_rate;
+  uint32_t byte_rate;
+  uint16_t block_align;
+  uint16_t bits;
+  char pad[4];
+  uint32_t pad_size;
+  char padding[RECORDER_ALIGN - 88];
+  char data[4];
+  uint32_t data_size;
+} wav_header_t;
+_Static_assert(sizeof(wav_header_t) == RECORDER_ALIGN,
+               "the samples start on an aligned offset");
+
+// the header for data_bytes of samples so far, rf64 once riff sizes no
+// longer fit in 32 bits
+static bool write_header(recorder_t *r) {
+  uint64_t riff_size = sizeof(wav_header_t) - 8 + r->data_bytes;
+  bool rf64 = riff_size > UINT32_MAX;
+  wav_header_t *h = (wav_header_t *)(r->chunk + RECORDER_CHUNK);
+  memset(h, 0, sizeof(*h));
+  memcpy(h->riff, rf64 ? "RF64" : "RIFF", 4);
+  h->riff_size = rf64 ? UINT32_MAX : (uint32_t)riff_size;
+  memcpy(h->wave, "WAVE", 4);
+  memcpy(h->ds64, rf64 ? "ds64" : "JUNK", 4);
+  h->ds64_size = 28;
+  if (rf64) {
+    h->riff_size64 = riff_size;
+    h->data_size64 = r->data_bytes;
+    h->sample_count64 = r->data_bytes / (sizeof(float) * r->channels);
+  }
+  memcpy(h->fmt, "fmt ", 4);
+  h->fmt_size = 16;
+  h->format = 3;
+  h->channels = r->channels;
+  h->sample_rate = r->sample_rate;
+  h->byte_rate = r->sample_rate * r->channels * sizeof(float);
+  h->block_align = r->channels * sizeof(float);
+  h->bits = 32;
+  memcpy(h->pad, "JUNK", 4);
+  h->pad_size = sizeof(h->padding);
+  memcpy(h->data, "data", 4);
+  h->data_size = rf64 ? UINT32_MAX : (uint32_t)r->data_bytes;
+  return pwrite(r->fd, h, sizeof(*h), 0) == (ssize_t)sizeof(*h);
+}
+
+static bool write_chunk(recorder_t *r, size_t bytes) {
+  // O_DIRECT writes whole blocks, the tail is cut off again by ftruncate
+  size_t size = r->direct ? (bytes + RECORDER_ALIGN - 1) &
+                                ~(size_t)(RECORDER_ALIGN - 1)
+                          : bytes;
+  memset(r->chunk + bytes, 0, size - bytes);
+  off_t offset = sizeof(wav_header_t) + r->data_bytes;
+  ssize_t done = pwrite(r->fd, r->chunk, size, offset);
+  if (done != (ssize_t)size) {
+    log_message(ERROR, "recorder: write to %s failed: %s", r->path,
+                done < 0 ? strerror(errno) : "short write");
+    return false;
+  }
+  r->data_bytes += bytes;
+  return true;
+}
+
+static void report_overruns(recorder_t *r) {
+  uint64_t overruns = atomic_load_explicit(&g_metrics.recorder_overruns,
+                                           memory_order_relaxed);
+  if (overruns != r->reported_overruns) {
+    log_message(WARNING, "recorder: %llu frames dropped, the disk is not "
+                         "keeping up",
+                (unsigned long long)(overruns - r->reported_overruns));
+    r->reported_overruns = overruns;
+  }
+}
+
+// fills the chunk from the ring and writes it whenever it is full, the
+// header follows every write so a crash leaves a readable file
+static void *writer_thread(void *arg) {
+  recorder_t *r = arg;
+  log_thread_init();
+  struct timespec poll = {.tv_sec = 0,
+                          .tv_nsec = RECORDER_POLL_MS * 1000 * 1000};
+  size_t fill = 0; // bytes in the chunk
+  bool ok = true;
+
+  while (ok) {
+    uint64_t rd = atomic_load_explicit(&r->read_pos, memory_order_relaxed);
+    uint64_t w = atomic_load_explicit(&r->write_pos, memory_order_acquire);
+    if (w == rd) {
+      // stopping is set after the audio thread let go of the ring
+      if (atomic_load_explicit(&r->stopping, memory_order_acquire) &&
+          w == atomic_load_explicit(&r->write_pos, memory_order_acquire))
+        break;
+      report_overruns(r);
+      nanosleep(&poll, NULL);
+      continue;
+    }
+
+    size_t room = (RECORDER_CHUNK - fill) / sizeof(float);
+    size_t n = w - rd < room ? w - rd : room;
+    size_t start = rd & (r->capacity - 1);
+    size_t first = n < r->capacity - start ? n : r->capacity - start;
+    memcpy(r->chunk + fill, r->ring + start, first * sizeof(float));
+    memcpy(r->chunk + fill + first * sizeof(float), r->ring,
+           (n - first) * sizeof(float));
+    atomic_store_explicit(&r->read_pos, rd + n, memory_order_release);
+    fill += n * sizeof(float);
+
+    if (fill == RECORDER_CHUNK) {
+      ok = write_chunk(r, fill) && write_header(r);
+      fill = 0;
+      atomic_store_explicit(&g_metrics.recorder_bytes, r->data_bytes,
+                            memory_order_relaxed);
+    }
+  }
+
+  if (ok && fill)
+    ok = write_chunk(r, fill);
+  if (ok && r->direct &&
+      ftruncate(r->fd, sizeof(wav_header_t) + r->data_bytes) < 0)
+    ok = false;
+  if (ok)
+    ok = write_header(r);
+  report_overruns(r);
+  close(r->fd);
+  atomic_store_explicit(&g_metrics.recorder_bytes, r->data_bytes,
+                        memory_order_relaxed);
+  log_message(ok ? INFO : ERROR, "recorder: %s %s, %.1f s", r->path,
+              ok ? "finished" : "is incomplete",
+              (double)r->data_bytes /
+                  (sizeof(float) * r->channels * r->sample_rate));
+  return NULL;
+}
+
+static void free_recorder(recorder_t *r) {
+  free(r->ring);
+  free(r->chunk);
+  free(r);
+}
+
+// the process ends with exit() from the networking loop once the signalfd
+// reports SIGINT or SIGTERM, the file still gets its final header
+static void stop_at_exit(void) { recorder_stop(); }
+
+bool recorder_start(const char *path, int sample_rate, int channels,
+                    bool direct) {
+  pthread_mutex_lock(&control_lock);
+  if (atomic_load(&active)) {
+    pthread_mutex_unlock(&control_lock);
+    log_message(ERROR, "recorder: already recording");
+    return false;
+  }
+
+  recorder_t *r = calloc(1, sizeof(recorder_t));
+  if (!r)
+    goto fail;
+  snprintf(r->path, sizeof(r->path), "%s", path);
+  r->sample_rate = sample_rate;
+  r->channels = channels;
+  r->capacity = 1;
+  while (r->capacity < (uint64_t)sample_rate * channels * RECORDER_RING_SECONDS)
+    r->capacity <<= 1;
+  r->ring = calloc(r->capacity, sizeof(float));
+  if (!r->ring || posix_memalign((void **)&r->chunk, RECORDER_ALIGN,
+                                 RECORDER_CHUNK + RECORDER_ALIGN)) {
+    log_message(ERROR, "recorder: out of memory");
+    goto fail;
+  }
+
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  r->direct = direct;
+  r->fd = open(path, flags | (direct ? O_DIRECT : 0), 0644);
+  if (r->fd < 0 && direct && errno == EINVAL) {
+    log_message(WARNING, "recorder: %s does not support O_DIRECT, using "
+                         "buffered writes", path);
+    r->direct = false;
+    r->fd = open(path, flags, 0644);
+  }
+  if (r->fd < 0) {
+    log_message(ERROR, "recorder: could not create %s: %s", path,
+                strerror(errno));
+    goto fail;
+  }
+  if (!write_header(r) ||
+      pthread_create(&r->writer, NULL, writer_thread, r)) {
+    log_message(ERROR, "recorder: could not start %s", path);
+    close(r->fd);
+    goto fail;
+  }
+
+  r->reported_overruns = atomic_load(&g_metrics.recorder_overruns);
+  atomic_store_explicit(&g_metrics.recorder_bytes, 0, memory_order_relaxed);
+  atomic_store_explicit(&active, r, memory_order_release);
+  if (!stop_registered) {
+    atexit(stop_at_exit);
+    stop_registered = true;
+  }
+  pthread_mutex_unlock(&control_lock);
+  log_message(INFO, "recorder: %s, %d Hz, %d channel%s%s", path, sample_rate,
+              channels, channels == 1 ? "" : "s",
+              r->direct ? ", O_DIRECT" : "");
+  return true;
+
+fail:
+  if (r)
+    free_recorder(r);
+  pthread_mutex_unlock(&control_lock);
+  return false;
+}
+
+void recorder_stop(void) {
+  pthread_mutex_lock(&control_lock);
+  recorder_t *r = atomic_exchange(&active, NULL);
+  if (!r) {
+    pthread_mutex_unlock(&control_lock);
+    return;
+  }
+
+  // a push that started before the exchange may still be copying
+  uint64_t count = atomic_load(&push_count);
+  struct timespec wait = {.tv_sec = 0, .tv_nsec = 100 * 1000};
+  while ((count & 1) && atomic_load(&push_count) == count)
+    nanosleep(&wait, NULL);
+
+  atomic_store_explicit(&r->stopping, true, memory_order_release);
+  if (pthread_equal(pthread_self(), r->writer))
+    log_message(ERROR, "recorder: stopped from its own writer");
+  else
+    pthread_join(r->writer, NULL);
+  free_recorder(r);
+  pthread_mutex_unlock(&control_lock);
+}
+
+bool recorder_running(void) { return atomic_load(&active) != NULL; }
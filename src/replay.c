@@ -0,0 +1,216 @@
+#include "replay.h"
+#include "commands.h"
+#include "events.h"
+#include "rt.h"
+#include "snapshot.h"
+#include "synth.h"
+#include "utils.h"
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+
+#define FNV_PRIME 0x100000001b3ull
+
+// fnv-1a over the raw sample bytes, any bit difference changes it
+uint64_t hashSamples(uint64_t hash, const float *samples, size_t count) {
+  const unsigned char *p = (const unsigned char *)samples;
+  for (size_t i = 0; i < count * sizeof(float); i++) {
+    hash ^= p[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+static bool voicesSilent(const Synth *synth) {
+  return countActiveVoices(synth) == 0;
+}
+
+// a capture grows the buffer to what it needed and tries again
+static void save_snapshot_to(const Synth *synth, snap_buf_t *b,
+                             const char *dir) {
+  while (!snapshotCapture(synth, b)) {
+    uint8_t *data = realloc(b->data, b->size);
+    if (!data) {
+      log_message(ERROR, "snapshot: out of memory");
+      return;
+    }
+    b->data = data;
+    b->capacity = b->size;
+  }
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%012" PRIu64 ".snap", dir,
+           synth->sample_clock);
+  snapshot_write_file(path, b->data, b->size);
+}
+
+bool replay_open(const replay_opts_t *opts, replay_log_t *log) {
+  log->events = event_log_read(opts->log_path, &log->header, &log->count);
+  if (!log->events)
+    return false;
+  if (!isValidSampleRate(log->header.sample_rate) ||
+      !isValidBufferSize(log->header.buffer_size) ||
+      !isValidChannelCount(log->header.channels)) {
+    log_message(ERROR, "%s: unusable sample rate, buffer size or channels",
+                opts->log_path);
+    free(log->events);
+    return false;
+  }
+  // denormals round the way they did live, --rt flushes them. set before
+  // the workers fork so they inherit it
+  if ((log->header.flags & EVENT_LOG_FTZ) && !rt_set_ftz_daz())
+    log_message(WARNING, "%s was recorded with FTZ/DAZ, this cpu has none",
+                opts->log_path);
+  uint64_t last = log->count ? log->events[log->count - 1].time : 0;
+  log->last = last;
+  log->end = last + (uint64_t)REPLAY_TAIL_SECONDS * log->header.sample_rate;
+  return true;
+}
+
+bool replay_synth_init(Synth *synth, const replay_log_t *log,
+                       const replay_opts_t *opts) {
+  if (!initSynth(synth, log->header.sample_rate, log->header.buffer_size,
+                 log->header.channels)) {
+    log_message(ERROR, "could not allocate audio buffers");
+    return false;
+  }
+  synth_params_t params = log->header.params;
+  initVoices(synth, &params.envelope);
+  params.version = 1;
+  applySynthParams(synth, &params);
+  synth->bank = patch_bank_load(opts->bank_path);
+  // retunes while recording are not in the log, the configured tuning plays
+  tuning_init(tuning_load_or_equal(opts->scl_path, opts->kbm_path,
+                                   log->header.sample_rate));
+  synth->tuning = tuning_acquire();
+  initParts(synth, &params);
+  resetKeys();
+  return true;
+}
+
+void replay_synth_free(Synth *synth) {
+  patch_bank_free((patch_bank_t *)synth->bank);
+  free((tuning_t *)synth->tuning);
+  freeSynth(synth);
+}
+
+bool replayBlock(Synth *synth, const replay_log_t *log, size_t *next) {
+  uint64_t block_end = synth->sample_clock + synth->signal_length;
+  while (*next < log->count && log->events[*next].time < block_end &&
+         scheduleEvent(&log->events[*next]))
+    (*next)++;
+
+  renderBlock(synth);
+  return !(*next == log->count && synth->sample_clock > log->last &&
+           voicesSilent(synth));
+}
+
+void replay_compare(FILE *ref, const float *samples, size_t n,
+                    float *expected, float *max_diff, bool *ref_short) {
+  size_t got = fread(expected, sizeof(float), n, ref);
+  *ref_short |= got != n;
+  for (size_t t = 0; t < got; t++)
+    *max_diff = fmaxf(*max_diff, fabsf(expected[t] - samples[t]));
+}
+
+int replay_report(const replay_opts_t *opts, size_t count, uint64_t samples,
+                  uint64_t hash, FILE *ref, float max_diff, bool ref_short) {
+  printf("replayed %zu events, %" PRIu64 " samples, hash %016" PRIx64 "\n",
+         count, samples, hash);
+
+  int result = 0;
+  if (opts->expect_hash) {
+    uint64_t want = strtoull(opts->expect_hash, NULL, 16);
+    if (want != hash) {
+      printf("hash mismatch, expected %016" PRIx64 "\n", want);
+      result = 2;
+    }
+  }
+  if (ref) {
+    // the reference must also end where this render ended
+    float extra;
+    ref_short |= fread(&extra, sizeof(float), 1, ref) != 0;
+    printf("max sample difference %g (tolerance %g)%s\n", max_diff,
+           opts->tolerance, ref_short ? ", lengths differ" : "");
+    if (max_diff > opts->tolerance || ref_short)
+      result = 2;
+  }
+  return result;
+}
+
+// returns 0 when the render matches (or nothing was asked to match), 2 on a
+// mismatch and 1 on errors
+int replay_main(const replay_opts_t *opts) {
+  if (opts->workers != 1)
+    return replay_parallel(opts);
+
+  replay_log_t log;
+  if (!replay_open(opts, &log))
+    return 1;
+
+  Oscillator keyOscillators[NUM_OSCILLATORS] = {0};
+  Synth synth = {.keyOscillators = {.osc = keyOscillators, .count = 0}};
+  if (!replay_synth_init(&synth, &log, opts)) {
+    free(log.events);
+    return 1;
+  }
+  if (opts->restore_path) {
+    if (!snapshot_load(&synth, opts->restore_path)) {
+      free(log.events);
+      replay_synth_free(&synth);
+      return 1;
+    }
+    // the log has every event from the snapshot on, also the ones it had
+    // already scheduled
+    clearSchedule();
+  }
+
+  FILE *out = NULL, *ref = NULL;
+  if (opts->render_path && !(out = fopen(opts->render_path, "wb")))
+    log_message(ERROR, "could not open %s", opts->render_path);
+  if (opts->compare_path && !(ref = fopen(opts->compare_path, "rb")))
+    log_message(ERROR, "could not open %s", opts->compare_path);
+
+  // interleaved frames, the same as the live output
+  size_t block = synth.signal_length * synth.channels;
+  uint64_t hash = FNV_OFFSET;
+  float *expected = malloc(block * sizeof(float));
+  float max_diff = 0.0f;
+  bool ref_short = false;
+  size_t next = 0;
+  while (next < log.count && log.events[next].time < synth.sample_clock)
+    next++;
+  uint64_t snapshot_every = (uint64_t)REPLAY_SNAPSHOT_SECONDS *
+                            log.header.sample_rate;
+  uint64_t next_snapshot =
+      (synth.sample_clock / snapshot_every + 1) * snapshot_every;
+  snap_buf_t snapshot = {0};
+
+  while (synth.sample_clock <= log.end) {
+    if (opts->snapshot_dir && synth.sample_clock >= next_snapshot) {
+      save_snapshot_to(&synth, &snapshot, opts->snapshot_dir);
+      next_snapshot += snapshot_every;
+    }
+    bool more = replayBlock(&synth, &log, &next);
+    hash = hashSamples(hash, synth.output, block);
+
+    if (out)
+      fwrite(synth.output, sizeof(float), block, out);
+    if (ref && expected)
+      replay_compare(ref, synth.output, block, expected, &max_diff,
+                     &ref_short);
+    if (!more)
+      break;
+  }
+
+  int result = replay_report(opts, log.count, synth.sample_clock, hash, ref,
+                             max_diff, ref_short);
+  if (out)
+    fclose(out);
+  if (ref)
+    fclose(ref);
+  free(expected);
+  free(snapshot.data);
+  free(log.events);
+  replay_synth_free(&synth);
+  return result;
+}
@@ -0,0 +1,493 @@
+#include "commands.h"
+#include "replay.h"
+#include "snapshot.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// the log is cut into segments at block boundaries and worker processes
+// render them side by side, each from a synth of its own. processes and not
+// threads because the schedule, the keys and the sequencer are per process.
+// a worker gets a segment number over a pipe and streams its blocks back
+// over another, the coordinator writes them at their sample offset.
+// segments without a snapshot start after a pre-roll, note starts are
+// seeded per note so that comes out as the serial render up to rounding
+
+typedef struct segment {
+  uint64_t start, end; // frames [start, end) go to the output
+  char snapshot[512];  // restores from here, otherwise a pre-roll
+} segment_t;
+
+enum {
+  SEGMENT_DATA,   // count interleaved samples from frame clock on follow
+  SEGMENT_DONE,   // reached its end
+  SEGMENT_SILENT, // the log is over and the voices quiet at clock
+  SEGMENT_FAILED,
+};
+
+typedef struct segment_msg {
+  uint32_t type;
+  uint32_t segment;
+  uint64_t clock;
+  uint64_t count;
+} segment_msg_t;
+
+typedef struct worker {
+  pid_t pid;
+  int cmd;  // segment numbers to the worker
+  int data; // segment_msg_t from it
+} worker_t;
+
+static bool read_full(int fd, void *p, size_t n) {
+  while (n) {
+    ssize_t got = read(fd, p, n);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return false;
+    p = (char *)p + got;
+    n -= got;
+  }
+  return true;
+}
+
+static bool write_full(int fd, const struct iovec *iov, int count) {
+  struct iovec v[2];
+  memcpy(v, iov, count * sizeof(*iov));
+  while (count) {
+    ssize_t done = writev(fd, v, count);
+    if (done < 0 && errno == EINTR)
+      continue;
+    if (done <= 0)
+      return false;
+    while (count && (size_t)done >= v[0].iov_len) {
+      done -= v[0].iov_len;
+      v[0] = v[1];
+      count--;
+    }
+    if (count) {
+      v[0].iov_base = (char *)v[0].iov_base + done;
+      v[0].iov_len -= done;
+    }
+  }
+  return true;
+}
+
+static bool pwrite_full(int fd, const void *p, size_t n, off_t offset) {
+  while (n) {
+    ssize_t done = pwrite(fd, p, n, offset);
+    if (done < 0 && errno == EINTR)
+      continue;
+    if (done <= 0)
+      return false;
+    p = (const char *)p + done;
+    n -= done;
+    offset += done;
+  }
+  return true;
+}
+
+static int compare_clocks(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// the sample clocks of the <clock>.snap files in dir that fall inside the
+// render, sorted. 0 when there are none
+static size_t find_snapshots(const char *dir, const replay_log_t *log,
+                             uint64_t **clocks) {
+  *clocks = NULL;
+  DIR *d = opendir(dir);
+  if (!d) {
+    log_message(WARNING, "replay: could not open %s", dir);
+    return 0;
+  }
+  size_t count = 0, capacity = 0;
+  struct dirent *e;
+  while ((e = readdir(d))) {
+    char *rest;
+    uint64_t clock = strtoull(e->d_name, &rest, 10);
+    if (rest == e->d_name || strcmp(rest, ".snap") || clock == 0 ||
+        clock > log->end || clock % log->header.buffer_size)
+      continue;
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      uint64_t *grown = realloc(*clocks, capacity * sizeof(uint64_t));
+      if (!grown)
+        break;
+      *clocks = grown;
+    }
+    (*clocks)[count++] = clock;
+  }
+  closedir(d);
+  if (count)
+    qsort(*clocks, count, sizeof(uint64_t), compare_clocks);
+  return count;
+}
+
+// from the snapshots in opts->snapshot_dir when there are any, otherwise
+// into about REPLAY_SEGMENTS_PER_WORKER even pieces per worker
+static segment_t *plan_segments(const replay_opts_t *opts,
+                                const replay_log_t *log, int workers,
+                                size_t *count) {
+  uint64_t block = log->header.buffer_size;
+  uint64_t *clocks = NULL;
+  size_t snapshots =
+      opts->snapshot_dir ? find_snapshots(opts->snapshot_dir, log, &clocks)
+                         : 0;
+  if (opts->snapshot_dir && !snapshots)
+    log_message(WARNING, "replay: no snapshots in %s, segments start after "
+                         "a pre-roll and match a serial render up to rounding",
+                opts->snapshot_dir);
+
+  uint64_t length = (uint64_t)REPLAY_SEGMENT_SECONDS * log->header.sample_rate;
+  uint64_t even = log->last / ((uint64_t)workers * REPLAY_SEGMENTS_PER_WORKER);
+  if (even > length)
+    length = even;
+  length = (length + block - 1) / block * block;
+
+  *count = snapshots ? snapshots + 1 : log->last / length + 1;
+  segment_t *segments = calloc(*count, sizeof(segment_t));
+  if (!segments) {
+    free(clocks);
+    return NULL;
+  }
+  for (size_t i = 0; i < *count; i++) {
+    segment_t *s = &segments[i];
+    s->start = snapshots ? (i ? clocks[i - 1] : 0) : i * length;
+    s->end = i + 1 < *count ? (snapshots ? clocks[i] : (i + 1) * length)
+                            : log->end + 1;
+    if (snapshots && i)
+      snprintf(s->snapshot, sizeof(s->snapshot), "%s/%012" PRIu64 ".snap",
+               opts->snapshot_dir, s->start);
+  }
+  free(clocks);
+  return segments;
+}
+
+// brings a fresh synth to sample time without rendering: keys, programs and
+// parameter changes before it are applied, what they would have sounded
+// like is not
+static void fast_forward(Synth *synth, const replay_log_t *log, uint64_t time,
+                         size_t *next) {
+  for (; *next < log->count && log->events[*next].time < time; (*next)++)
+    applyEvent(synth, &log->events[*next]);
+  synth->sample_clock = time;
+}
+
+static bool send_msg(int fd, segment_msg_t msg, const float *samples) {
+  struct iovec v[2] = {{&msg, sizeof(msg)},
+                       {(void *)samples, msg.count * sizeof(float)}};
+  return write_full(fd, v, samples ? 2 : 1);
+}
+
+static bool render_segment(const replay_opts_t *opts, const replay_log_t *log,
+                           const segment_t *s, uint32_t index, int fd) {
+  Oscillator keyOscillators[NUM_OSCILLATORS] = {0};
+  Synth synth = {.keyOscillators = {.osc = keyOscillators, .count = 0}};
+  if (!replay_synth_init(&synth, log, opts))
+    return false;
+
+  size_t next = 0;
+  if (s->snapshot[0]) {
+    if (!snapshot_load(&synth, s->snapshot)) {
+      replay_synth_free(&synth);
+      return false;
+    }
+    clearSchedule();
+    while (next < log->count && log->events[next].time < synth.sample_clock)
+      next++;
+  } else if (s->start) {
+    uint64_t preroll = (uint64_t)REPLAY_PREROLL_SECONDS *
+                       log->header.sample_rate;
+    uint64_t from = s->start > preroll ? s->start - preroll : 0;
+    fast_forward(&synth, log, from - from % synth.signal_length, &next);
+  }
+
+  segment_msg_t msg = {.type = SEGMENT_DONE, .segment = index};
+  bool ok = true;
+  while (ok && synth.sample_clock < s->end) {
+    uint64_t clock = synth.sample_clock;
+    bool more = replayBlock(&synth, log, &next);
+    if (clock >= s->start)
+      ok = send_msg(fd,
+                    (segment_msg_t){.type = SEGMENT_DATA,
+                                    .segment = index,
+                                    .clock = clock,
+                                    .count = synth.signal_length *
+                                             synth.channels},
+                    synth.output);
+    if (!more) {
+      msg.type = SEGMENT_SILENT;
+      break;
+    }
+  }
+  msg.clock = synth.sample_clock;
+  replay_synth_free(&synth);
+  return ok && send_msg(fd, msg, NULL);
+}
+
+// renders every segment it is given until the coordinator closes cmd. the
+// log thread was not forked along, so failures are reported to the
+// coordinator instead of logged
+static void worker_main(const replay_opts_t *opts, const replay_log_t *log,
+                        const segment_t *segments, int cmd, int data) {
+  uint32_t index;
+  while (read_full(cmd, &index, sizeof(index))) {
+    if (!render_segment(opts, log, &segments[index], index, data) &&
+        !send_msg(data,
+                  (segment_msg_t){.type = SEGMENT_FAILED, .segment = index},
+                  NULL))
+      break;
+  }
+  // no atexit handlers, they belong to the coordinator
+  _exit(0);
+}
+
+static bool start_worker(worker_t *workers, int i, const replay_opts_t *opts,
+                         const replay_log_t *log, const segment_t *segments) {
+  int cmd[2], data[2];
+  if (pipe(cmd))
+    return false;
+  if (pipe(data)) {
+    close(cmd[0]);
+    close(cmd[1]);
+    return false;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(cmd[0]);
+    close(cmd[1]);
+    close(data[0]);
+    close(data[1]);
+    return false;
+  }
+  if (pid == 0) {
+    // the other workers see the end of their pipes only when the
+    // coordinator closes them, not when this one exits
+    for (int j = 0; j < i; j++) {
+      close(workers[j].cmd);
+      close(workers[j].data);
+    }
+    close(cmd[1]);
+    close(data[0]);
+    worker_main(opts, log, segments, cmd[0], data[1]);
+  }
+  close(cmd[0]);
+  close(data[1]);
+  workers[i] = (worker_t){.pid = pid, .cmd = cmd[1], .data = data[0]};
+  return true;
+}
+
+static void stop_workers(worker_t *workers, int count, bool kill_them) {
+  for (int i = 0; i < count; i++) {
+    close(workers[i].cmd);
+    close(workers[i].data);
+    if (kill_them)
+      kill(workers[i].pid, SIGTERM);
+  }
+  for (int i = 0; i < count; i++)
+    waitpid(workers[i].pid, NULL, 0);
+}
+
+// the final segment first, it runs on into the release tail and tends to
+// be the longest
+static uint32_t dispatch_order(size_t n, size_t segments) {
+  return n == 0 ? segments - 1 : n - 1;
+}
+
+// hands out segments and writes what comes back into out. returns the
+// frames of the whole render, 0 on failure
+static uint64_t run_workers(worker_t *workers, int count,
+                            const segment_t *segments, size_t segment_count,
+                            int channels, int out) {
+  struct pollfd *fds = calloc(count, sizeof(struct pollfd));
+  float *samples = NULL;
+  size_t capacity = 0;
+  size_t dispatched = 0, finished = 0;
+  uint64_t silent = UINT64_MAX, last = 0;
+  bool ok = fds != NULL;
+
+  for (int i = 0; ok && i < count; i++) {
+    fds[i] = (struct pollfd){.fd = workers[i].data, .events = POLLIN};
+    uint32_t index = dispatch_order(dispatched++, segment_count);
+    ok = write(workers[i].cmd, &index, sizeof(index)) == sizeof(index);
+  }
+
+  while (ok && finished < segment_count) {
+    if (poll(fds, count, -1) < 0) {
+      ok = errno == EINTR;
+      continue;
+    }
+    for (int i = 0; ok && i < count; i++) {
+      if (!fds[i].revents)
+        continue;
+      segment_msg_t msg;
+      if (!read_full(workers[i].data, &msg, sizeof(msg)) ||
+          msg.segment >= segment_count) {
+        log_message(ERROR, "replay: worker %d exited", (int)workers[i].pid);
+        ok = false;
+        break;
+      }
+      const segment_t *s = &segments[msg.segment];
+      switch (msg.type) {
+      case SEGMENT_DATA:
+        if (msg.count > capacity) {
+          float *grown = realloc(samples, msg.count * sizeof(float));
+          if (!grown) {
+            ok = false;
+            break;
+          }
+          samples = grown;
+          capacity = msg.count;
+        }
+        if (!read_full(workers[i].data, samples, msg.count * sizeof(float)))
+          ok = false;
+        else
+          ok = pwrite_full(out, samples, msg.count * sizeof(float),
+                           (off_t)msg.clock * channels * sizeof(float));
+        if (!ok)
+          log_message(ERROR, "replay: could not write the output");
+        break;
+      case SEGMENT_FAILED:
+        log_message(ERROR, "replay: segment at sample %" PRIu64 " failed%s",
+                    s->start, s->snapshot[0] ? ", check its snapshot" : "");
+        ok = false;
+        break;
+      default:
+        if (msg.segment == segment_count - 1)
+          last = msg.clock;
+        else if (msg.type == SEGMENT_SILENT && msg.clock < silent)
+          silent = msg.clock;
+        finished++;
+        if (dispatched < segment_count) {
+          uint32_t index = dispatch_order(dispatched++, segment_count);
+          ok = write(workers[i].cmd, &index, sizeof(index)) == sizeof(index);
+        }
+      }
+    }
+  }
+  free(fds);
+  free(samples);
+  // the render ends where the final segment stopped, or earlier where
+  // another one already ran out of sound
+  return ok ? (silent < last ? silent : last) : 0;
+}
+
+int replay_parallel(const replay_opts_t *opts) {
+  if (opts->restore_path) {
+    log_message(ERROR, "replay: -j does not combine with -L");
+    return 1;
+  }
+  replay_log_t log;
+  if (!replay_open(opts, &log))
+    return 1;
+
+  int count = opts->workers > 0 ? opts->workers
+                                : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (count < 1)
+    count = 1;
+  size_t segment_count;
+  segment_t *segments = plan_segments(opts, &log, count, &segment_count);
+  if (!segments) {
+    free(log.events);
+    return 1;
+  }
+  if ((size_t)count > segment_count)
+    count = segment_count;
+
+  // without -o the render still has to be put together for the hash
+  FILE *tmp = NULL;
+  int out = opts->render_path
+                ? open(opts->render_path, O_RDWR | O_CREAT | O_TRUNC, 0644)
+                : ((tmp = tmpfile()) ? fileno(tmp) : -1);
+  worker_t *workers = calloc(count, sizeof(worker_t));
+  if (out < 0 || !workers) {
+    log_message(ERROR, "replay: could not open %s",
+                opts->render_path ? opts->render_path : "a temporary file");
+    if (out >= 0 && !tmp)
+      close(out);
+    if (tmp)
+      fclose(tmp);
+    free(workers);
+    free(segments);
+    free(log.events);
+    return 1;
+  }
+  log_message(INFO, "replay: %zu segments on %d workers%s", segment_count,
+              count, segments[segment_count - 1].snapshot[0]
+                         ? ", from snapshots"
+                         : "");
+  // what is buffered now must not be written again by every worker
+  fflush(stdout);
+  fflush(stderr);
+  // a worker that died shows up as a failed write on its cmd pipe and not
+  // as a signal that takes the coordinator down with it
+  signal(SIGPIPE, SIG_IGN);
+
+  int started = 0;
+  while (started < count &&
+         start_worker(workers, started, opts, &log, segments))
+    started++;
+  int channels = log.header.channels;
+  uint64_t total = 0;
+  if (started)
+    total = run_workers(workers, started, segments, segment_count, channels,
+                        out);
+  else
+    log_message(ERROR, "replay: could not start workers");
+  stop_workers(workers, started, total == 0);
+
+  int result = 1;
+  uint64_t length = total * channels;
+  if (total && ftruncate(out, (off_t)length * sizeof(float)) == 0) {
+    FILE *ref = NULL;
+    if (opts->compare_path && !(ref = fopen(opts->compare_path, "rb")))
+      log_message(ERROR, "could not open %s", opts->compare_path);
+
+    // the output read back in order, as the serial render would hash it
+    size_t chunk = 65536;
+    float *samples = malloc(chunk * sizeof(float));
+    float *expected = malloc(chunk * sizeof(float));
+    uint64_t hash = FNV_OFFSET;
+    float max_diff = 0.0f;
+    bool ref_short = false;
+    uint64_t at = 0;
+    for (; samples && at < length; at += chunk) {
+      size_t n = length - at < chunk ? length - at : chunk;
+      if (pread(out, samples, n * sizeof(float), (off_t)at * sizeof(float)) !=
+          (ssize_t)(n * sizeof(float)))
+        break;
+      hash = hashSamples(hash, samples, n);
+      if (ref && expected)
+        replay_compare(ref, samples, n, expected, &max_diff, &ref_short);
+    }
+    if (at >= length)
+      result = replay_report(opts, log.count, total, hash, ref, max_diff,
+                             ref_short);
+    else
+      log_message(ERROR, "replay: could not read back the output");
+    if (ref)
+      fclose(ref);
+    free(samples);
+    free(expected);
+  }
+
+  if (tmp)
+    fclose(tmp);
+  else
+    close(out);
+  free(workers);
+  free(segments);
+  free(log.events);
+  return result;
+}
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include "rt.h"
+#include "utils.h"
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+void rt_defaults(rt_cfg_t *cfg) {
+  *cfg = (rt_cfg_t){
+      .enabled = false, .priority = RT_DEFAULT_PRIORITY, .cpu = -1};
+}
+
+void rt_apply_config(rt_cfg_t *cfg, hash_t *config) {
+  char *str;
+
+  if ((str = hash_get(config, "rt.enabled")))
+    cfg->enabled = !strcmp(str, "true") || !strcmp(str, "1");
+  if ((str = hash_get(config, "rt.priority"))) {
+    int priority = atoi(str);
+    if (priority >= 1 && priority <= 99)
+      cfg->priority = priority;
+    else
+      log_message(ERROR, "rt.priority must be within 1..99, ignoring");
+  }
+  if ((str = hash_get(config, "rt.cpu")))
+    cfg->cpu = atoi(str);
+}
+
+static void report(const char *step, bool ok, const char *detail) {
+  if (ok)
+    log_message(INFO, "rt: %-16s ok %s", step, detail);
+  else
+    log_message(ERROR, "rt: %-16s FAILED %s", step, detail);
+}
+
+// writes every page once so the first block does not take the faults
+static void prefault(void *p, size_t len) {
+  long page = sysconf(_SC_PAGESIZE);
+  volatile char *c = p;
+  for (size_t i = 0; i < len; i += page)
+    c[i] = c[i];
+  if (len)
+    c[len - 1] = c[len - 1];
+}
+
+// a frame deeper than the audio thread will ever need, touched once
+static __attribute__((noinline)) void prefault_stack(void) {
+  volatile char stack[RT_STACK_PREFAULT];
+  for (size_t i = 0; i < sizeof(stack); i += 4096)
+    stack[i] = 0;
+}
+
+static size_t locked_kb(void) {
+  FILE *f = fopen("/proc/self/status", "r");
+  char line[128];
+  size_t kb = 0;
+  if (!f)
+    return 0;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "VmLck: %zu kB", &kb) == 1)
+      break;
+  fclose(f);
+  return kb;
+}
+
+bool rt_set_ftz_daz(void) {
+#if defined(__SSE__)
+  _mm_setcsr(_mm_getcsr() | 0x8040); // FTZ bit 15, DAZ bit 6
+  return (_mm_getcsr() & 0x8040) == 0x8040;
+#elif defined(__aarch64__)
+  uint64_t fpcr;
+  __asm__ volatile("mrs %0, fpcr" : "=r"(fpcr));
+  fpcr |= 1ull << 24; // FZ, covers inputs and outputs
+  __asm__ volatile("msr fpcr, %0" : : "r"(fpcr));
+  return true;
+#else
+  return false;
+#endif
+}
+
+int rt_enter(const rt_cfg_t *cfg, const Synth *synth) {
+  char detail[96];
+  int failed = 0;
+  bool ok;
+
+  if (!cfg->enabled) {
+    log_message(INFO, "rt: disabled, set rt.enabled or pass --rt");
+    return 0;
+  }
+
+  // freed memory stays in the process, a later malloc never faults
+  ok = mallopt(M_TRIM_THRESHOLD, -1) && mallopt(M_MMAP_MAX, 0);
+  report("malloc no trim", ok, "");
+  failed += !ok;
+
+  ok = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+  snprintf(detail, sizeof(detail), "%s", ok ? "" : strerror(errno));
+  report("mlockall", ok, detail);
+  failed += !ok;
+
+  // locked pages are already resident, this covers the mlockall failure
+  // case and the stack below the current frame
+  prefault_stack();
+  size_t bytes = synth->signal_length * sizeof(float);
+  size_t channels = synth->channels;
+  prefault(synth->signal, bytes * channels);
+  prefault(synth->output, bytes * channels);
+  prefault(synth->bus_scratch, bytes * OVERSAMPLE_MAX_FACTOR * channels);
+  prefault(synth->voice_signal, bytes * OVERSAMPLE_MAX_FACTOR);
+  prefault(synth->voice_gain, bytes);
+  prefault(synth->lane_signal, bytes * channels);
+  prefault(synth->master.history,
+           synth->master.history_stride * channels * sizeof(float));
+  prefault(synth->nco_phases, bytes);
+  prefault(synth->nco_samples, bytes);
+  prefault(synth->additive_scratch, bytes * SIMD_WIDTH);
+  prefault(synth->additive_pool, (size_t)NUM_OSCILLATORS *
+                                     ADDITIVE_VOICE_FLOATS * sizeof(float));
+  prefault(synth->waveguide_pool, (size_t)NUM_OSCILLATORS *
+                                      WAVEGUIDE_SLOT_FLOATS * sizeof(float));
+  prefault(synth->keyOscillators.osc,
+           synth->keyOscillators.count * sizeof(Oscillator));
+  snprintf(detail, sizeof(detail), "%zu kB locked", locked_kb());
+  report("prefault", true, detail);
+
+  if (cfg->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cfg->cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    snprintf(detail, sizeof(detail), "cpu %d %s", cfg->cpu,
+             err ? strerror(err) : "");
+    report("affinity", !err, detail);
+    failed += err != 0;
+  } else {
+    report("affinity", true, "not pinned, rt.cpu is -1");
+  }
+
+  struct sched_param param = {.sched_priority = cfg->priority};
+  int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  snprintf(detail, sizeof(detail), "priority %d %s", cfg->priority,
+           err ? strerror(err) : "");
+  report("SCHED_FIFO", !err, detail);
+  failed += err != 0;
+
+  ok = rt_set_ftz_daz();
+  report("FTZ/DAZ", ok, ok ? "" : "not supported on this cpu");
+  failed += !ok;
+
+  if (failed)
+    log_message(ERROR, "rt: %d step(s) failed, dropouts are still possible",
+                failed);
+  else
+    log_message(INFO, "rt: audio thread is real time");
+  return failed;
+}
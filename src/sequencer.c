@@ -0,0 +1,330 @@
+#include "sequencer.h"
+#include "commands.h"
+#include "utils.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// same handover as the parameter snapshots, see params.c. the lock keeps
+// editors from building on a pattern another one is about to replace, and
+// is held until the replaced one is freed: with two publishers the second
+// could otherwise free a pattern the audio thread has just picked up
+static pthread_mutex_t edit_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(sequence_t *) current_sequence = NULL;
+static _Atomic(sequence_t *) sequence_in_use = NULL;
+
+void sequence_defaults(sequence_t *s) {
+  memset(s, 0, sizeof(*s));
+  s->bpm = 120.0f;
+  s->steps_per_beat = 4;
+  s->gate = 0.5f;
+  s->length = 16;
+  for (int i = 0; i < SEQ_MAX_STEPS; i++)
+    s->steps[i] = (seq_step_t){.note = SEQ_REST, .ratchet = 1};
+}
+
+sequence_t *sequence_edit(void) {
+  pthread_mutex_lock(&edit_lock);
+  sequence_t *s = malloc(sizeof(sequence_t));
+  if (!s) {
+    pthread_mutex_unlock(&edit_lock);
+    return NULL;
+  }
+  sequence_t *latest = atomic_load(&current_sequence);
+  if (latest)
+    *s = *latest;
+  else
+    sequence_defaults(s);
+  return s;
+}
+
+void sequence_publish(sequence_t *s) {
+  sequence_t *old = atomic_exchange_explicit(&current_sequence, s,
+                                             memory_order_acq_rel);
+  if (!old) {
+    pthread_mutex_unlock(&edit_lock);
+    return;
+  }
+
+  struct timespec wait = {.tv_sec = 0, .tv_nsec = 1000 * 1000};
+  for (int i = 0; i < 1000; i++) {
+    if (atomic_load_explicit(&sequence_in_use, memory_order_acquire) != old) {
+      free(old);
+      pthread_mutex_unlock(&edit_lock);
+      return;
+    }
+    nanosleep(&wait, NULL);
+  }
+  pthread_mutex_unlock(&edit_lock);
+  log_message(WARNING, "sequencer: audio thread did not pick up the pattern");
+}
+
+void sequence_discard(sequence_t *s) {
+  free(s);
+  pthread_mutex_unlock(&edit_lock);
+}
+
+static const sequence_t *sequence_acquire(void) {
+  sequence_t *s = atomic_load_explicit(&current_sequence, memory_order_acquire);
+  atomic_store_explicit(&sequence_in_use, s, memory_order_release);
+  return s;
+}
+
+// audio thread state. what it needs from the previous pattern is copied in
+// here, a replaced pattern may already be freed
+typedef struct sequencer_state {
+  const sequence_t *pattern;
+  bool running;
+  uint8_t channel;
+  uint8_t mode;
+  uint64_t start_time;
+  double step_len;  // samples per step
+  uint64_t origin;  // time of step 0 at the current tempo
+  uint64_t count;   // steps scheduled since origin
+  uint64_t step;    // steps since the start, picks the pattern step and swing
+  // arpeggiator
+  uint16_t held; // bit per key
+  uint8_t played[NUM_KEYS];
+  int played_count;
+  uint64_t arp_pos;
+  uint32_t rng; // its own, the voices' draws stay the same as in a replay
+  // parameter locks in force and the values they replaced
+  bool locked[PARAM_COUNT];
+  float base[PARAM_COUNT];
+} sequencer_state_t;
+static sequencer_state_t seq = {.rng = 0x2545f491};
+
+// schedule slots the sequencer may still take. like scripts it leaves the
+// last EVENT_PENDING_RESERVED to the control socket, a dense pattern must
+// not hold up live keys
+static size_t room(void) {
+  size_t left = scheduleRoom();
+  return left > EVENT_PENDING_RESERVED ? left - EVENT_PENDING_RESERVED : 0;
+}
+
+// false when the schedule has no room left for the sequencer
+static bool push(uint64_t time, EventType type, uint8_t note, float value) {
+  if (!room())
+    return false;
+  synth_event_t ev = {.time = time,
+                      .type = type,
+                      .note = note,
+                      .channel = seq.channel,
+                      .flags = EVENT_FLAG_SEQUENCER,
+                      .value = value};
+  return scheduleEvent(&ev);
+}
+
+// locks go back to what the part had before the first of them. one that
+// finds the schedule full stays locked and is tried again next step
+static void releaseLocks(uint64_t time) {
+  for (int p = 0; p < PARAM_COUNT; p++) {
+    if (seq.locked[p] && push(time, EVENT_PARAM, p, seq.base[p]))
+      seq.locked[p] = false;
+  }
+}
+
+static const patch_t *channelPatch(Synth *synth) {
+  for (int i = 0; i < NUM_PARTS; i++)
+    if (synth->parts[i].config.channel == seq.channel)
+      return synth->parts[i].patch;
+  return &synth->default_patch;
+}
+
+// next held key in the pattern's order, -1 with nothing held
+static int arpNext(const sequence_t *s) {
+  uint8_t keys[NUM_KEYS];
+  int n = 0;
+  for (int k = 0; k < NUM_KEYS; k++)
+    if (seq.held & (1u << k))
+      keys[n++] = k;
+  if (n == 0)
+    return -1;
+
+  uint64_t pos = seq.arp_pos++;
+  switch (s->order) {
+  case ARP_DOWN:
+    return keys[n - 1 - pos % n];
+  case ARP_UPDOWN: {
+    if (n == 1)
+      return keys[0];
+    int i = pos % (2 * n - 2);
+    return keys[i < n ? i : 2 * n - 2 - i];
+  }
+  case ARP_PLAYED:
+    return seq.played[pos % seq.played_count];
+  case ARP_RANDOM:
+    return keys[xorshift32(&seq.rng) % n];
+  default:
+    return keys[pos % n];
+  }
+}
+
+static uint64_t stepTime(const sequence_t *s) {
+  double offset = seq.count * seq.step_len;
+  if (seq.step & 1)
+    offset += s->swing * seq.step_len;
+  return seq.origin + (uint64_t)llround(offset);
+}
+
+static void playStep(Synth *synth, const sequence_t *s, uint64_t time) {
+  const seq_step_t *st = &s->steps[seq.step % s->length];
+  releaseLocks(time);
+  if (st->note == SEQ_REST)
+    return;
+
+  int key = s->mode == SEQ_ARP ? arpNext(s) : st->note;
+  if (key < 0 || key >= NUM_KEYS)
+    return;
+
+  const patch_t *patch = channelPatch(synth);
+  for (int l = 0; l < st->lock_count; l++) {
+    const seq_lock_t *lock = &st->locks[l];
+    if (lock->param >= PARAM_COUNT)
+      continue;
+    if (!push(time, EVENT_PARAM, lock->param, lock->value))
+      continue;
+    if (!seq.locked[lock->param]) {
+      seq.base[lock->param] = patchGetParam(patch, lock->param);
+      seq.locked[lock->param] = true;
+    }
+  }
+
+  int ratchet = st->ratchet < 1 ? 1 : st->ratchet;
+  if (ratchet > SEQ_MAX_RATCHET)
+    ratchet = SEQ_MAX_RATCHET;
+  double hit = seq.step_len / ratchet;
+  float gate = fminf(1.0f, st->gate > 0.0f ? st->gate : s->gate);
+  uint64_t gate_len = (uint64_t)fmax(1.0, llround(gate * hit));
+
+  for (int r = 0; r < ratchet; r++) {
+    // a note on without room for its note off would hang
+    uint64_t on = time + (uint64_t)llround(r * hit);
+    if (room() < 2 || !push(on, EVENT_NOTE_ON, key, 0.0f) ||
+        !push(on + gate_len, EVENT_NOTE_OFF, key, 0.0f))
+      break;
+  }
+}
+
+static double stepLength(const Synth *synth, const sequence_t *s) {
+  float bpm = fmaxf(1.0f, s->bpm);
+  int per_beat = s->steps_per_beat < 1 ? 1 : s->steps_per_beat;
+  return 60.0 * synth->sample_rate / (bpm * per_beat);
+}
+
+static void stop(uint64_t now) {
+  releaseLocks(now);
+  seq.running = false;
+  seq.held = 0;
+  seq.played_count = 0;
+}
+
+// a new pattern takes over at the next step. a new start time or a start
+// after a stop begins again from step 0, a new tempo carries on from the
+// step that was due next
+static void adopt(Synth *synth, const sequence_t *s, uint64_t now) {
+  seq.pattern = s;
+  if (!s || !s->running || s->length < 1) {
+    if (seq.running)
+      stop(now);
+    return;
+  }
+
+  double step_len = stepLength(synth, s);
+  if (seq.running && s->channel != seq.channel)
+    releaseLocks(now);
+  seq.channel = s->channel;
+  seq.mode = s->mode;
+
+  if (!seq.running || s->start_time != seq.start_time) {
+    seq.running = true;
+    seq.start_time = s->start_time;
+    seq.origin = s->start_time > now ? s->start_time : now;
+    seq.count = 0;
+    seq.step = 0;
+    seq.arp_pos = 0;
+  } else if (step_len != seq.step_len) {
+    seq.origin += (uint64_t)llround(seq.count * seq.step_len);
+    seq.count = 0;
+  }
+  seq.step_len = step_len;
+}
+
+void sequencerRun(Synth *synth) {
+  uint64_t now = synth->sample_clock;
+  uint64_t end = now + synth->signal_length;
+
+  const sequence_t *s = sequence_acquire();
+  if (s != seq.pattern)
+    adopt(synth, s, now);
+  if (!seq.running)
+    return;
+
+  for (uint64_t t; (t = stepTime(s)) < end; seq.count++, seq.step++)
+    playStep(synth, s, t < now ? now : t);
+}
+
+bool sequencerTakes(const synth_event_t *ev) {
+  if (!seq.running || seq.mode != SEQ_ARP || ev->channel != seq.channel ||
+      (ev->flags & EVENT_FLAG_SEQUENCER) || ev->note >= NUM_KEYS ||
+      (ev->type != EVENT_NOTE_ON && ev->type != EVENT_NOTE_OFF))
+    return false;
+
+  uint16_t bit = 1u << ev->note;
+  if (ev->type == EVENT_NOTE_ON && !(seq.held & bit)) {
+    seq.held |= bit;
+    seq.played[seq.played_count++] = ev->note;
+  } else if (ev->type == EVENT_NOTE_OFF && (seq.held & bit)) {
+    seq.held &= ~bit;
+    int j = 0;
+    for (int i = 0; i < seq.played_count; i++)
+      if (seq.played[i] != ev->note)
+        seq.played[j++] = seq.played[i];
+    seq.played_count = j;
+  }
+  return true;
+}
+
+void sequencerSave(snap_buf_t *b) {
+  uint32_t size = sizeof(seq);
+  snapPut(b, &size, sizeof(size));
+  snapPut(b, &seq, sizeof(seq));
+  uint8_t has_pattern = seq.pattern != NULL;
+  snapPut(b, &has_pattern, sizeof(has_pattern));
+  if (has_pattern)
+    snapPut(b, seq.pattern, sizeof(sequence_t));
+}
+
+// the pattern becomes the published one, in use by the audio thread, so the
+// next block carries on with it instead of starting over
+bool sequencerLoad(snap_buf_t *b) {
+  sequencer_state_t state;
+  uint8_t has_pattern;
+  uint32_t size;
+  snapGet(b, &size, sizeof(size));
+  if (size != sizeof(state))
+    return false;
+  snapGet(b, &state, sizeof(state));
+  snapGet(b, &has_pattern, sizeof(has_pattern));
+  sequence_t *s = NULL;
+  if (has_pattern) {
+    if (!(s = malloc(sizeof(sequence_t))))
+      return false;
+    snapGet(b, s, sizeof(sequence_t));
+  }
+  if (b->failed) {
+    free(s);
+    return false;
+  }
+
+  pthread_mutex_lock(&edit_lock);
+  free(atomic_exchange(&current_sequence, s));
+  atomic_store(&sequence_in_use, s);
+  pthread_mutex_unlock(&edit_lock);
+  state.pattern = s;
+  seq = state;
+  return true;
+}
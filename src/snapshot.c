@@ -0,0 +1,347 @@
+#include "snapshot.h"
+#include "commands.h"
+#include "events.h"
+#include "sequencer.h"
+#include "utils.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+// a snapshot only restores into a build with the same structs
+static uint32_t layoutHash(void) {
+  const size_t sizes[] = {
+      NUM_OSCILLATORS,       NUM_PARTS,          NUM_KEYS,
+      sizeof(Oscillator),    sizeof(VoiceFilter), sizeof(Unison),
+      sizeof(Additive),      sizeof(Waveguide),  sizeof(Oversampler),
+      sizeof(MasterBus),     sizeof(patch_t),    sizeof(part_params_t),
+      sizeof(key_state_t),   sizeof(synth_event_t), sizeof(sequence_t),
+  };
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+    hash ^= (uint32_t)sizes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// what a part's patch pointer points at
+enum { PART_DEFAULT = 0, PART_BANK, PART_EDIT };
+
+// the phasors and spectrum of an additive voice up to its last lane
+static size_t additiveFloats(const Additive *a) {
+  size_t lanes = ADDITIVE_LANES;
+  return ((size_t)a->count + lanes - 1) & ~(lanes - 1);
+}
+
+static void additiveArrays(const Additive *a, float *arrays[6]) {
+  arrays[0] = a->re;
+  arrays[1] = a->im;
+  arrays[2] = a->rot_re;
+  arrays[3] = a->rot_im;
+  arrays[4] = a->level;
+  arrays[5] = a->ratio;
+}
+
+// the guard in front of a string's ring holds the mirrored taps
+#define WAVEGUIDE_SAVED_FLOATS (WAVEGUIDE_GUARD + WAVEGUIDE_RING)
+
+bool snapshotCapture(const Synth *synth, snap_buf_t *b) {
+  b->size = 0;
+  b->failed = false;
+  snapshot_header_t header = {.magic = SNAPSHOT_MAGIC,
+                              .version = SNAPSHOT_VERSION,
+                              .layout = layoutHash(),
+                              .sample_rate = synth->sample_rate,
+                              .buffer_size = synth->signal_length,
+                              .channels = synth->channels,
+                              .sample_clock = synth->sample_clock};
+  snapPut(b, &header, sizeof(header));
+
+  snapPut(b, &synth->rng, sizeof(synth->rng));
+  snapPut(b, &synth->voice_active, sizeof(synth->voice_active));
+  snapPut(b, synth->voice_part, sizeof(synth->voice_part));
+  snapPut(b, synth->voice_key, sizeof(synth->voice_key));
+  snapPut(b, synth->voice_amplitude, sizeof(synth->voice_amplitude));
+  snapPut(b, synth->voice_brightness, sizeof(synth->voice_brightness));
+  snapPut(b, synth->voice_filters, sizeof(synth->voice_filters));
+  snapPut(b, synth->voice_unison, sizeof(synth->voice_unison));
+  uint32_t count = synth->keyOscillators.count;
+  snapPut(b, &count, sizeof(count));
+  snapPut(b, synth->keyOscillators.osc, count * sizeof(Oscillator));
+
+  // the pointers in these are written too and ignored on restore. only
+  // sounding voices need their buffers, a note start fills them again
+  for (size_t v = 0; v < NUM_OSCILLATORS; v++) {
+    const Additive *a = &synth->voice_additive[v];
+    const Waveguide *w = &synth->voice_waveguide[v];
+    snapPut(b, a, sizeof(*a));
+    snapPut(b, w, sizeof(*w));
+    if (!(synth->voice_active & (1u << v)))
+      continue;
+    float *arrays[6];
+    additiveArrays(a, arrays);
+    for (int i = 0; i < 6; i++)
+      snapPut(b, arrays[i], additiveFloats(a) * sizeof(float));
+    if (w->active)
+      snapPut(b, w->ring - WAVEGUIDE_GUARD,
+              WAVEGUIDE_SAVED_FLOATS * sizeof(float));
+  }
+
+  for (int i = 0; i < NUM_PARTS; i++) {
+    const Part *part = &synth->parts[i];
+    int32_t program = part->program;
+    uint8_t kind = part->patch == &part->edit_patch      ? PART_EDIT
+                   : part->patch == &synth->default_patch ? PART_DEFAULT
+                                                          : PART_BANK;
+    snapPut(b, &program, sizeof(program));
+    snapPut(b, &kind, sizeof(kind));
+    snapPut(b, &part->edit_patch, sizeof(part->edit_patch));
+    snapPut(b, &part->config, sizeof(part->config));
+  }
+  snapPut(b, &synth->default_patch, sizeof(synth->default_patch));
+
+  snapPut(b, synth->voiceOversamplers, sizeof(synth->voiceOversamplers));
+  snapPut(b, synth->busOversamplers, sizeof(synth->busOversamplers));
+  uint64_t bus_idle = synth->bus_idle;
+  snapPut(b, &bus_idle, sizeof(bus_idle));
+  snapPut(b, &synth->master, sizeof(synth->master));
+  for (int c = 0; c < synth->channels; c++)
+    snapPut(b, synth->master.history + c * synth->master.history_stride,
+            MASTER_MAX_LOOKAHEAD * sizeof(float));
+
+  saveEventState(b);
+  sequencerSave(b);
+
+  if (b->failed)
+    return false;
+  uint64_t size = b->size;
+  memcpy(b->data + offsetof(snapshot_header_t, size), &size, sizeof(size));
+  return true;
+}
+
+bool snapshotRestore(Synth *synth, const void *data, size_t size) {
+  snap_buf_t b = {.data = (uint8_t *)data, .capacity = size};
+  snapshot_header_t header;
+  snapGet(&b, &header, sizeof(header));
+  if (b.failed || header.magic != SNAPSHOT_MAGIC ||
+      header.version != SNAPSHOT_VERSION || header.layout != layoutHash()) {
+    log_message(ERROR, "snapshot: not written by this build");
+    return false;
+  }
+  if (header.size != size) {
+    log_message(ERROR, "snapshot: %llu bytes, the header says %llu",
+                (unsigned long long)size, (unsigned long long)header.size);
+    return false;
+  }
+  if ((int)header.sample_rate != synth->sample_rate ||
+      header.buffer_size != synth->signal_length ||
+      (int)header.channels != synth->channels) {
+    log_message(ERROR, "snapshot: taken at %u Hz, %u frames and %u "
+                       "channels, this synth runs %d Hz, %zu frames and %d",
+                header.sample_rate, header.buffer_size, header.channels,
+                synth->sample_rate, synth->signal_length, synth->channels);
+    return false;
+  }
+
+  snapGet(&b, &synth->rng, sizeof(synth->rng));
+  snapGet(&b, &synth->voice_active, sizeof(synth->voice_active));
+  snapGet(&b, synth->voice_part, sizeof(synth->voice_part));
+  snapGet(&b, synth->voice_key, sizeof(synth->voice_key));
+  snapGet(&b, synth->voice_amplitude, sizeof(synth->voice_amplitude));
+  snapGet(&b, synth->voice_brightness, sizeof(synth->voice_brightness));
+  snapGet(&b, synth->voice_filters, sizeof(synth->voice_filters));
+  snapGet(&b, synth->voice_unison, sizeof(synth->voice_unison));
+  uint32_t count;
+  snapGet(&b, &count, sizeof(count));
+  if (count > NUM_OSCILLATORS)
+    return false;
+  snapGet(&b, synth->keyOscillators.osc, count * sizeof(Oscillator));
+  synth->keyOscillators.count = count;
+
+  for (size_t v = 0; v < NUM_OSCILLATORS; v++) {
+    Additive *a = &synth->voice_additive[v];
+    Waveguide *w = &synth->voice_waveguide[v];
+    Additive saved_a;
+    Waveguide saved_w;
+    snapGet(&b, &saved_a, sizeof(saved_a));
+    snapGet(&b, &saved_w, sizeof(saved_w));
+    if (saved_a.count < 0 || saved_a.count > ADDITIVE_MAX_PARTIALS)
+      return false;
+    float *arrays[6];
+    additiveArrays(a, arrays);
+    saved_w.ring = w->ring;
+    *w = saved_w;
+    a->count = saved_a.count;
+    a->active = saved_a.active;
+    a->freq = saved_a.freq;
+    if (!(synth->voice_active & (1u << v)))
+      continue;
+    for (int i = 0; i < 6; i++)
+      snapGet(&b, arrays[i], additiveFloats(a) * sizeof(float));
+    if (w->active)
+      snapGet(&b, w->ring - WAVEGUIDE_GUARD,
+              WAVEGUIDE_SAVED_FLOATS * sizeof(float));
+  }
+
+  for (int i = 0; i < NUM_PARTS; i++) {
+    Part *part = &synth->parts[i];
+    int32_t program;
+    uint8_t kind;
+    snapGet(&b, &program, sizeof(program));
+    snapGet(&b, &kind, sizeof(kind));
+    snapGet(&b, &part->edit_patch, sizeof(part->edit_patch));
+    snapGet(&b, &part->config, sizeof(part->config));
+    selectProgram(synth, part, program);
+    if (kind == PART_EDIT)
+      part->patch = &part->edit_patch;
+    else if (kind == PART_BANK && part->patch == &synth->default_patch)
+      log_message(WARNING, "snapshot: part %d plays program %d, which the "
+                           "bank does not have",
+                  i, program);
+  }
+  snapGet(&b, &synth->default_patch, sizeof(synth->default_patch));
+
+  snapGet(&b, synth->voiceOversamplers, sizeof(synth->voiceOversamplers));
+  snapGet(&b, synth->busOversamplers, sizeof(synth->busOversamplers));
+  uint64_t bus_idle;
+  snapGet(&b, &bus_idle, sizeof(bus_idle));
+  synth->bus_idle = bus_idle;
+  float *history = synth->master.history;
+  snapGet(&b, &synth->master, sizeof(synth->master));
+  synth->master.history = history;
+  for (int c = 0; c < synth->channels; c++)
+    snapGet(&b, history + c * synth->master.history_stride,
+            MASTER_MAX_LOOKAHEAD * sizeof(float));
+
+  if (b.failed || !loadEventState(&b) || !sequencerLoad(&b)) {
+    log_message(ERROR, "snapshot: truncated");
+    return false;
+  }
+
+  synth->sample_clock = header.sample_clock;
+  atomic_store(&g_sample_clock, synth->sample_clock);
+  atomic_store(&g_output_latency, synth->master.latency);
+  return true;
+}
+
+// two buffers, the audio thread captures into the one that was not
+// published last. it only writes while a request is open and the control
+// side only reads once its request is served, so neither ever waits on the
+// other. saves are serialized by save_lock
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static snap_buf_t buffers[2];
+static _Atomic int published = 1;
+static _Atomic uint64_t requested = 0;
+static _Atomic uint64_t served = 0;
+
+void snapshotPoll(const Synth *synth) {
+  uint64_t want = atomic_load_explicit(&requested, memory_order_acquire);
+  if (want == atomic_load_explicit(&served, memory_order_relaxed))
+    return;
+  int b = !atomic_load_explicit(&published, memory_order_relaxed);
+  snapshotCapture(synth, &buffers[b]);
+  atomic_store_explicit(&published, b, memory_order_relaxed);
+  atomic_store_explicit(&served, want, memory_order_release);
+}
+
+// only while no request is open
+static bool grow_buffers(size_t bytes) {
+  for (int i = 0; i < 2; i++) {
+    if (buffers[i].capacity >= bytes)
+      continue;
+    uint8_t *data = realloc(buffers[i].data, bytes);
+    if (!data)
+      return false;
+    buffers[i].data = data;
+    buffers[i].capacity = bytes;
+  }
+  return true;
+}
+
+static bool wait_served(uint64_t want) {
+  struct timespec wait = {.tv_sec = 0, .tv_nsec = 1000 * 1000};
+  for (int i = 0; i < 1000; i++) {
+    if (atomic_load_explicit(&served, memory_order_acquire) == want)
+      return true;
+    nanosleep(&wait, NULL);
+  }
+  return false;
+}
+
+bool snapshot_save(const char *path) {
+  pthread_mutex_lock(&save_lock);
+  bool ok = false;
+  size_t need = SNAPSHOT_INITIAL_BYTES;
+  // a second try when the state outgrew the buffers
+  for (int attempt = 0; attempt < 2; attempt++) {
+    uint64_t want = atomic_load(&requested);
+    if (atomic_load(&served) != want && !wait_served(want)) {
+      log_message(ERROR, "snapshot: the audio thread is not running");
+      break;
+    }
+    if (!grow_buffers(need)) {
+      log_message(ERROR, "snapshot: out of memory");
+      break;
+    }
+    atomic_store_explicit(&requested, want + 1, memory_order_release);
+    if (!wait_served(want + 1)) {
+      log_message(ERROR, "snapshot: the audio thread did not take it");
+      break;
+    }
+    snap_buf_t *b = &buffers[atomic_load_explicit(&published,
+                                                  memory_order_relaxed)];
+    if (!b->failed) {
+      ok = snapshot_write_file(path, b->data, b->size);
+      break;
+    }
+    need = b->size;
+  }
+  pthread_mutex_unlock(&save_lock);
+  return ok;
+}
+
+bool snapshot_write_file(const char *path, const void *data, size_t size) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    log_message(ERROR, "snapshot: could not create %s", path);
+    return false;
+  }
+  bool ok = fwrite(data, 1, size, f) == size;
+  ok &= fclose(f) == 0;
+  if (!ok) {
+    log_message(ERROR, "snapshot: could not write %s", path);
+    return false;
+  }
+  snapshot_header_t header;
+  memcpy(&header, data, sizeof(header));
+  log_message(INFO, "snapshot: %s at sample %" PRIu64 ", %zu bytes", path,
+              header.sample_clock, size);
+  return true;
+}
+
+bool snapshot_load(Synth *synth, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    log_message(ERROR, "snapshot: could not open %s", path);
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  void *data = size > 0 ? malloc(size) : NULL;
+  bool ok = data && fread(data, 1, size, f) == (size_t)size;
+  fclose(f);
+
+  ok = ok && snapshotRestore(synth, data, size);
+  free(data);
+  if (ok)
+    log_message(INFO, "snapshot: restored %s at sample %" PRIu64 ", %u "
+                      "voices sounding",
+                path, synth->sample_clock,
+                (unsigned)countActiveVoices(synth));
+  else
+    log_message(ERROR, "snapshot: could not restore %s", path);
+  return ok;
+}
@@ -1,30 +1,726 @@
 #include "synth.h"
+#include "commands.h"
 #include "oscillator.h"
+#include "profiler.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
 
-void zeroSignal(float *signal) {
-  for (size_t t = 0; t < STREAM_BUFFER_SIZE; t++) {
+bool isValidSampleRate(int sample_rate) {
+  return sample_rate == 44100 || sample_rate == 48000 || sample_rate == 96000;
+}
+
+bool isValidBufferSize(size_t buffer_size) {
+  return buffer_size >= MIN_STREAM_BUFFER_SIZE &&
+         buffer_size <= MAX_STREAM_BUFFER_SIZE;
+}
+
+bool isValidChannelCount(int channels) {
+  return channels >= 1 && channels <= MAX_CHANNELS;
+}
+
+static float *allocSignal(size_t length) {
+  // 64 byte aligned so the block loops can use full vector loads,
+  // aligned_alloc wants the size to be a multiple of the alignment
+  size_t bytes = (length * sizeof(float) + 63) & ~(size_t)63;
+  float *p = aligned_alloc(64, bytes);
+  if (p)
+    memset(p, 0, bytes);
+  return p;
+}
+
+// every buffer the render loop touches is allocated here, once, so nothing
+// on the audio path has to allocate or depends on a compile time block size
+bool initSynth(Synth *synth, int sample_rate, size_t buffer_size,
+               int channels) {
+  synth->sample_rate = sample_rate;
+  synth->sample_duration = 1.0f / sample_rate;
+  synth->signal_length = buffer_size;
+  synth->channel_stride = buffer_size;
+  synth->channels = channels;
+  synth->audio_frame_duration = buffer_size * synth->sample_duration;
+  // the envelopes advance by a fixed time per sample, not the block length
+  // or the wall clock, so neither -b nor timing changes how a patch sounds
+  synth->delta_time_last_frame =
+      ENVELOPE_FRAMES_PER_SAMPLE * synth->sample_duration * 1000.0f;
+  synth->sample_clock = 0;
+  synth->rng = 0x9e3779b9;
+
+  // the channels are whole multiples of 64 bytes apart only for block
+  // sizes that are, the vector loops load unaligned anyway
+  synth->signal = allocSignal(buffer_size * channels);
+  synth->output = channels > 1 ? allocSignal(buffer_size * channels)
+                               : synth->signal;
+  synth->bus_scratch =
+      allocSignal(buffer_size * OVERSAMPLE_MAX_FACTOR * channels);
+  synth->nco_phases = (uint32_t *)allocSignal(buffer_size);
+  synth->nco_samples = allocSignal(buffer_size);
+  synth->additive_scratch = allocSignal(buffer_size * SIMD_WIDTH);
+  synth->additive_pool =
+      allocSignal((size_t)NUM_OSCILLATORS * ADDITIVE_VOICE_FLOATS);
+  synth->waveguide_pool =
+      allocSignal((size_t)NUM_OSCILLATORS * WAVEGUIDE_SLOT_FLOATS);
+  synth->voice_signal = allocSignal(buffer_size * OVERSAMPLE_MAX_FACTOR);
+  synth->voice_gain = allocSignal(buffer_size);
+  synth->lane_signal = allocSignal(buffer_size * channels);
+  synth->master.channels = channels;
+  synth->master.history_stride = MASTER_MAX_LOOKAHEAD + buffer_size;
+  synth->master.history =
+      allocSignal(synth->master.history_stride * channels);
+  if (!synth->signal || !synth->output || !synth->bus_scratch ||
+      !synth->nco_phases || !synth->nco_samples ||
+      !synth->additive_scratch || !synth->additive_pool ||
+      !synth->waveguide_pool || !synth->voice_signal || !synth->voice_gain ||
+      !synth->lane_signal || !synth->master.history) {
+    freeSynth(synth);
+    return false;
+  }
+
+  initNCOTables();
+  for (int i = 0; i < NUM_OSCILLATORS; i++) {
+    additiveInit(&synth->voice_additive[i],
+                 synth->additive_pool + (size_t)i * ADDITIVE_VOICE_FLOATS);
+    waveguideInit(&synth->voice_waveguide[i],
+                  synth->waveguide_pool + (size_t)i * WAVEGUIDE_SLOT_FLOATS);
+  }
+  patch_defaults(&synth->default_patch);
+  for (int i = 0; i < NUM_PARTS; i++) {
+    synth->parts[i].patch = &synth->default_patch;
+    synth->parts[i].program = -1;
+  }
+  return true;
+}
+
+void freeSynth(Synth *synth) {
+  if (synth->output != synth->signal)
+    free(synth->output);
+  free(synth->signal);
+  free(synth->bus_scratch);
+  free(synth->nco_phases);
+  free(synth->nco_samples);
+  free(synth->additive_scratch);
+  free(synth->additive_pool);
+  free(synth->waveguide_pool);
+  free(synth->voice_signal);
+  free(synth->voice_gain);
+  free(synth->lane_signal);
+  free(synth->master.history);
+  synth->signal = NULL;
+  synth->output = NULL;
+  synth->bus_scratch = NULL;
+  synth->nco_phases = NULL;
+  synth->nco_samples = NULL;
+  synth->additive_scratch = NULL;
+  synth->additive_pool = NULL;
+  synth->waveguide_pool = NULL;
+  synth->voice_signal = NULL;
+  synth->voice_gain = NULL;
+  synth->lane_signal = NULL;
+  synth->master.history = NULL;
+}
+
+// the whole pool up front, voices are handed to parts by allocVoice
+void initVoices(Synth *synth, const ADSR *envelope) {
+  for (size_t i = 0; i < NUM_OSCILLATORS; i++) {
+    Oscillator *o = makeOscillator(&synth->keyOscillators);
+    o->envelope = *envelope;
+    synth->voice_filters[i] = (VoiceFilter){.coeff = 1.0f, .state = 0.0f};
+    synth->voice_brightness[i] = 1.0f;
+  }
+}
+
+void zeroSignal(float *signal, size_t length) {
+  for (size_t t = 0; t < length; t++) {
     signal[t] = 0.0f;
   }
 }
 
-void updateOscArray(WaveShapeFn base_osc_shape_fn, Synth *synth,
-                    OscillatorArray osc_array) {
-  for (size_t i = 0; i < osc_array.count; i++) {
-    // skip oscillators with frequencies outside the Nyquist limit
-    if (osc_array.osc[i].freq > (SAMPLE_RATE / 2) ||
-        osc_array.osc[i].freq < -(SAMPLE_RATE / 2))
+size_t countActiveVoices(const Synth *synth) {
+  return __builtin_popcount(synth->voice_active);
+}
+
+// voices of the parts playing p take its new envelope times
+static void retimeVoices(Synth *synth, const patch_t *p) {
+  for (uint32_t m = synth->voice_active; m;) {
+    size_t i = nextVoice(&m);
+    if (synth->parts[synth->voice_part[i]].patch != p)
       continue;
-    for (size_t t = 0; t < STREAM_BUFFER_SIZE; t++) {
-      if (osc_array.osc[i].envelope.state == OFF)
-        continue; // ignore if adsr is off
+    ADSR *env = &synth->keyOscillators.osc[i].envelope;
+    env->attack_time = p->attack_time;
+    env->decay_time = p->decay_time;
+    env->sustain_level = p->sustain_level;
+    env->sustain_time = p->sustain_time;
+    env->release_time = p->release_time;
+  }
+}
+
+// takes over a new parameter snapshot at a block boundary. sounding voices
+// keep their envelope state and level and only get the new times, so a
+// reload never restarts or cuts a note
+void applySynthParams(Synth *synth, const synth_params_t *params) {
+  synth->oversample_mode = params->oversample_mode;
+  synth->oversample_factor = params->oversample_factor;
+  synth->nco = params->nco;
+
+  patch_t *p = &synth->default_patch;
+  p->attack_time = params->envelope.attack_time;
+  p->decay_time = params->envelope.decay_time;
+  p->sustain_level = params->envelope.sustain_level;
+  p->sustain_time = params->envelope.sustain_time;
+  p->release_time = params->envelope.release_time;
+  retimeVoices(synth, p);
+
+  // a lower budget takes effect on the next note, sounding voices finish
+  for (int i = 0; i < NUM_PARTS; i++)
+    synth->parts[i].config = params->parts[i];
 
-      updateADSR(&osc_array.osc[i].envelope, synth->delta_time_last_frame);
+  if (masterConfigure(&synth->master, &params->master, synth->sample_rate)) {
+    atomic_store_explicit(&g_output_latency, synth->master.latency,
+                          memory_order_relaxed);
+    log_message(INFO, "master bus latency %d samples", synth->master.latency);
+  }
+
+  synth->params_version = params->version;
+}
+
+// startup programs from the config, once the bank is loaded
+void initParts(Synth *synth, const synth_params_t *params) {
+  for (int i = 0; i < NUM_PARTS; i++)
+    selectProgram(synth, &synth->parts[i], params->parts[i].program);
+}
+
+// a program change is one pointer store into the mmapped bank, sounding
+// voices finish with the values they started with
+void selectProgram(Synth *synth, Part *part, int program) {
+  part->program = program;
+  if (synth->bank && program >= 0 && (uint32_t)program < synth->bank->count)
+    part->patch = &synth->bank->patches[program];
+  else
+    part->patch = &synth->default_patch;
+}
+
+// lower is stolen first: released voices before held ones, then the quietest
+static inline float stealScore(const ADSR *env) {
+  return env->current_level + (env->state == RELEASE ? 0.0f : 1.0f);
+}
 
-      updateOsc(&osc_array.osc[i], 0.0f);
-      // generate the waveform sample and accumulate it into the signal buffer
-      synth->signal[t] += base_osc_shape_fn(osc_array.osc[i]) *
-                          osc_array.osc[i].amplitude *
-                          osc_array.osc[i].envelope.current_level;
+// takes a voice from the pool for part. a part at its budget steals one of
+// its own voices, otherwise a free voice is used, and with the pool
+// exhausted the best candidate of any part. NULL for a part without voices
+Oscillator *allocVoice(Synth *synth, int part, int key) {
+  OscillatorArray *pool = &synth->keyOscillators;
+  int budget = synth->parts[part].config.voices;
+  int used = 0, free_voice = -1, steal_own = -1, steal_any = -1;
+
+  if (budget <= 0)
+    return NULL;
+
+  for (size_t i = 0; i < pool->count; i++) {
+    const ADSR *env = &pool->osc[i].envelope;
+    if (env->state == OFF) {
+      if (free_voice < 0)
+        free_voice = i;
+      continue;
     }
+    if (steal_any < 0 ||
+        stealScore(env) < stealScore(&pool->osc[steal_any].envelope))
+      steal_any = i;
+    if (synth->voice_part[i] == part) {
+      used++;
+      if (steal_own < 0 ||
+          stealScore(env) < stealScore(&pool->osc[steal_own].envelope))
+        steal_own = i;
+    }
+  }
+
+  int v = used >= budget ? steal_own : free_voice >= 0 ? free_voice : steal_any;
+  if (v < 0)
+    return NULL;
+
+  synth->voice_part[v] = part;
+  synth->voice_key[v] = key;
+  synth->voice_filters[v].state = 0.0f;
+  memset(synth->voice_filters[v].channel_state, 0,
+         sizeof(synth->voice_filters[v].channel_state));
+
+  // a stolen voice starts over from silence, handle_keys marks it active
+  // again once its envelope is set up. phase and decimator start from zero
+  // too, nothing of the slot's last note carries into the new one
+  synth->voice_active &= ~(1u << v);
+  Oscillator *osc = &pool->osc[v];
+  osc->envelope.state = OFF;
+  osc->envelope.current_level = 0.0f;
+  osc->phase = 0.0f;
+  osc->phase_acc = 0;
+  resetOversampler(&synth->voiceOversamplers[v],
+                   synth->voiceOversamplers[v].factor);
+  return osc;
+}
+
+static inline bool aboveNyquist(const Synth *synth, float freq) {
+  return freq > (synth->sample_rate / 2) || freq < -(synth->sample_rate / 2);
+}
+
+// the render functions below take the block length as an argument and are
+// forced inline, so the dispatch in updateOscArray gets a copy of each loop
+// with a constant trip count for the common block sizes
+#define RENDER_INLINE static inline __attribute__((always_inline))
+
+// one pole lowpass coefficient for cutoff at rate, 1 when open
+static inline float filterCoeff(float cutoff, float rate) {
+  if (cutoff <= 0.0f || cutoff >= rate / 2)
+    return 1.0f;
+  return 1.0f - expf(-2.0f * (float)M_PI * cutoff / rate);
+}
+
+// the branch on coeff is per voice, the compiler unswitches the loops on it
+RENDER_INLINE float filterSample(VoiceFilter *f, float x) {
+  if (f->coeff >= 1.0f)
+    return x;
+  f->state += f->coeff * (x - f->state);
+  return f->state;
+}
+
+// constant power gains for a pan position, -1 is the first channel and 1
+// the last, between two neighbouring channels the pair shares the power.
+// mono is always 1
+static inline void panGains(float pan, int channels, float *gains) {
+  if (channels == 1) {
+    gains[0] = 1.0f;
+    return;
+  }
+  for (int c = 0; c < channels; c++)
+    gains[c] = 0.0f;
+  float x = (fminf(fmaxf(pan, -1.0f), 1.0f) + 1.0f) * 0.5f * (channels - 1);
+  int c = x < channels - 1 ? (int)x : channels - 2;
+  float f = (x - c) * (float)M_PI_2;
+  gains[c] = cosf(f);
+  gains[c + 1] = sinf(f);
+}
+
+// adds the first m samples of a rendered voice to each channel by its gain,
+// one vector multiply-add per channel and not another pass through the
+// oscillator. mono adds it as it is
+RENDER_INLINE void panVoice(float *dst, size_t stride, int channels,
+                            const float *gains, const float *voice,
+                            size_t m) {
+  if (channels == 1) {
+    for (size_t t = 0; t < m; t++)
+      dst[t] += voice[t];
+    return;
+  }
+  for (int c = 0; c < channels; c++) {
+    if (gains[c] == 0.0f)
+      continue;
+    float *d = dst + c * stride;
+    v4f g = v4f_set1(gains[c]);
+    size_t t = 0;
+    for (; t + SIMD_WIDTH <= m; t += SIMD_WIDTH)
+      v4f_store(&d[t], v4f_load(&d[t]) + v4f_load(&voice[t]) * g);
+    for (; t < m; t++)
+      d[t] += voice[t] * gains[c];
+  }
+}
+
+// the renderers below write one voice into out and return how many samples
+// they wrote, fewer than n when the envelope finished inside the block
+
+// renders one oscillator at factor times the output rate and decimates each
+// group of factor samples back down
+RENDER_INLINE size_t renderOversampledVoice(WaveShapeFn shape_fn,
+                                            Synth *synth, Oscillator *osc,
+                                            Oversampler *os,
+                                            VoiceFilter *filter, float *out,
+                                            size_t n) {
+  float sub[OVERSAMPLE_MAX_FACTOR];
+  float sub_duration = synth->sample_duration / os->factor;
+
+  size_t t = 0;
+  for (; t < n; t++) {
+    if (osc->envelope.state == OFF)
+      break;
+
+    updateADSR(&osc->envelope, synth->delta_time_last_frame);
+
+    for (int k = 0; k < os->factor; k++) {
+      updateOsc(osc, 0.0f, sub_duration);
+      sub[k] = shape_fn(*osc);
+    }
+
+    out[t] = filterSample(filter, decimateOversampled(os, sub)) *
+             osc->amplitude * osc->envelope.current_level;
+  }
+  return t;
+}
+
+// envelope, filter and gain for a voice whose raw samples were rendered
+// into a block buffer up front
+RENDER_INLINE size_t mixVoiceSamples(Synth *synth, Oscillator *osc,
+                                     VoiceFilter *filter,
+                                     const float *samples, float *out,
+                                     size_t n) {
+  size_t t = 0;
+  for (; t < n; t++) {
+    if (osc->envelope.state == OFF)
+      break;
+
+    updateADSR(&osc->envelope, synth->delta_time_last_frame);
+    out[t] = filterSample(filter, samples[t]) * osc->amplitude *
+             osc->envelope.current_level;
   }
-}
\ No newline at end of file
+  return t;
+}
+
+// nco mode: the whole block of phases is produced up front with vector
+// integer adds, the sine shape reads its table straight from the high phase
+// bits, other shapes get the phase converted back to [0,1)
+RENDER_INLINE size_t renderNCOVoice(WaveShapeFn shape_fn, Synth *synth,
+                                    Oscillator *osc, VoiceFilter *filter,
+                                    float *out, size_t n) {
+  uint32_t *phases = synth->nco_phases;
+  float *samples = synth->nco_samples;
+
+  // phase_inc comes from the tuning table, see modulateVoices
+  ncoPhaseBlock(phases, &osc->phase_acc, osc->phase_inc, n);
+
+  if (shape_fn == sineShape) {
+    ncoSineBlock(samples, phases, n);
+  } else {
+    Oscillator o = *osc;
+    o.phase_dt = osc->phase_inc * NCO_PHASE_SCALE;
+    for (size_t t = 0; t < n; t++) {
+      o.phase = phases[t] * NCO_PHASE_SCALE;
+      samples[t] = shape_fn(o);
+    }
+  }
+  osc->phase = osc->phase_acc * NCO_PHASE_SCALE;
+
+  return mixVoiceSamples(synth, osc, filter, samples, out, n);
+}
+
+// unison voices sum their lanes into nco_samples and then go through the
+// same envelope and filter as a single oscillator. they skip oversampling,
+// the sawtooth lanes are polyblep bandlimited like the scalar shape
+RENDER_INLINE size_t renderUnisonVoice(const patch_t *patch, Synth *synth,
+                                       Oscillator *osc, Unison *u,
+                                       VoiceFilter *filter, float *out,
+                                       size_t n) {
+  float *samples = synth->nco_samples;
+  for (size_t t = 0; t < n; t++)
+    samples[t] = 0.0f;
+  unisonRender(u, patch->shape, osc->freq, osc->shape_parameter_0,
+               synth->sample_rate, (const float(*)[UNISON_MAX_VOICES])u->gain,
+               1, samples, 0, n);
+  return mixVoiceSamples(synth, osc, filter, samples, out, n);
+}
+
+// unison over several channels: the lanes are rendered once, each into the
+// channels at its own pan, then every channel goes through the voice's
+// filter and the envelope, which is worked out once for all of them
+RENDER_INLINE void renderUnisonChannels(const patch_t *patch, Synth *synth,
+                                        Oscillator *osc, Unison *u,
+                                        VoiceFilter *filter, float *signal,
+                                        size_t n) {
+  int channels = synth->channels;
+  _Alignas(16) float gains[MAX_CHANNELS][UNISON_MAX_VOICES] = {{0}};
+  for (int k = 0; k < u->count; k++) {
+    float pan[MAX_CHANNELS];
+    panGains(patch->pan + u->pan[k], channels, pan);
+    for (int c = 0; c < channels; c++)
+      gains[c][k] = u->gain[k] * pan[c];
+  }
+
+  float *lanes = synth->lane_signal;
+  for (size_t i = 0; i < n * channels; i++)
+    lanes[i] = 0.0f;
+  unisonRender(u, patch->shape, osc->freq, osc->shape_parameter_0,
+               synth->sample_rate, (const float(*)[UNISON_MAX_VOICES])gains,
+               channels, lanes, n, n);
+
+  float *gain = synth->voice_gain;
+  size_t m = 0;
+  for (; m < n; m++) {
+    if (osc->envelope.state == OFF)
+      break;
+    updateADSR(&osc->envelope, synth->delta_time_last_frame);
+    gain[m] = osc->amplitude * osc->envelope.current_level;
+  }
+
+  for (int c = 0; c < channels; c++) {
+    VoiceFilter f = {.coeff = filter->coeff,
+                     .state = filter->channel_state[c]};
+    float *dst = signal + c * synth->channel_stride;
+    const float *x = lanes + c * n;
+    for (size_t t = 0; t < m; t++)
+      dst[t] += filterSample(&f, x[t]) * gain[t];
+    filter->channel_state[c] = f.state;
+  }
+}
+
+// additive voices ignore the shape, the partials are the waveform
+RENDER_INLINE size_t renderAdditiveVoice(Synth *synth, Oscillator *osc,
+                                         Additive *a, VoiceFilter *filter,
+                                         float *out, size_t n) {
+  float *samples = synth->nco_samples;
+  for (size_t t = 0; t < n; t++)
+    samples[t] = 0.0f;
+  additiveRender(a, osc->freq, synth->sample_rate, samples,
+                 synth->additive_scratch, n);
+  return mixVoiceSamples(synth, osc, filter, samples, out, n);
+}
+
+// plucked voices, the string is the waveform
+RENDER_INLINE size_t renderWaveguideVoice(Synth *synth, Oscillator *osc,
+                                          Waveguide *w, VoiceFilter *filter,
+                                          float *out, size_t n) {
+  float *samples = synth->nco_samples;
+  waveguideRender(w, osc->freq, synth->sample_rate, samples, n);
+  return mixVoiceSamples(synth, osc, filter, samples, out, n);
+}
+
+// bus mode: every voice is panned into oversampled bus channels, which are
+// decimated once after the voice pass, cheaper than per voice when many keys
+// are held. the filter runs at the oversampled rate. returns oversampled
+// samples
+RENDER_INLINE size_t renderBusVoice(WaveShapeFn shape_fn, Synth *synth,
+                                    Oscillator *osc, VoiceFilter *filter,
+                                    float *out, size_t n) {
+  int factor = synth->oversample_factor;
+  float sub_duration = synth->sample_duration / factor;
+
+  size_t t = 0;
+  for (; t < n; t++) {
+    if (osc->envelope.state == OFF)
+      break;
+
+    updateADSR(&osc->envelope, synth->delta_time_last_frame);
+    float gain = osc->amplitude * osc->envelope.current_level;
+
+    for (int k = 0; k < factor; k++) {
+      updateOsc(osc, 0.0f, sub_duration);
+      out[t * factor + k] = filterSample(filter, shape_fn(*osc)) * gain;
+    }
+  }
+  return t * factor;
+}
+
+RENDER_INLINE size_t renderVoice(WaveShapeFn shape_fn, Synth *synth,
+                                 Oscillator *osc, VoiceFilter *filter,
+                                 float *out, size_t n) {
+  size_t t = 0;
+  for (; t < n; t++) {
+    if (osc->envelope.state == OFF)
+      break; // the envelope finished inside the block
+
+    updateADSR(&osc->envelope, synth->delta_time_last_frame);
+
+    updateOsc(osc, 0.0f, synth->sample_duration);
+    // generate the waveform sample
+    out[t] = filterSample(filter, shape_fn(*osc)) * osc->amplitude *
+             osc->envelope.current_level;
+  }
+  return t;
+}
+
+// one pass over the whole voice pool, each voice renders with the shape and
+// filter of the part that owns it, so layered and split parts cost no more
+// than the same number of voices in a single part
+RENDER_INLINE void renderOscArray(Synth *synth, OscillatorArray osc_array,
+                                  float *signal, size_t n) {
+  bool bus = synth->oversample_mode == OVERSAMPLE_BUS &&
+             synth->oversample_factor > 1;
+  int factor = bus ? synth->oversample_factor : 1;
+  int channels = synth->channels;
+  size_t bus_stride = synth->channel_stride * OVERSAMPLE_MAX_FACTOR;
+  float *voice = synth->voice_signal;
+
+  // the bus decimator keeps ringing for a few samples after the last voice,
+  // once its history is all zeros it has nothing left to add
+  if (bus) {
+    if (synth->voice_active)
+      synth->bus_idle = 0;
+    else if (synth->bus_idle >= HALFBAND_TAPS)
+      bus = false;
+    else
+      synth->bus_idle += n;
+  }
+  if (!bus && !synth->voice_active)
+    return;
+
+  if (bus) {
+    for (int c = 0; c < channels; c++) {
+      if (synth->busOversamplers[c].factor != factor)
+        resetOversampler(&synth->busOversamplers[c], factor);
+      float *scratch = synth->bus_scratch + c * bus_stride;
+      for (size_t t = 0; t < n * (size_t)factor; t++)
+        scratch[t] = 0.0f;
+    }
+  }
+
+  for (uint32_t m = synth->voice_active; m;) {
+    size_t i = nextVoice(&m);
+    Oscillator *osc = &osc_array.osc[i];
+
+    // frequencies outside the Nyquist limit stay silent
+    if (aboveNyquist(synth, osc->freq))
+      continue;
+
+    const patch_t *patch = synth->parts[synth->voice_part[i]].patch;
+    WaveShapeFn shape_fn = shapeFromId(patch->shape);
+    VoiceFilter *filter = &synth->voice_filters[i];
+    Unison *unison = &synth->voice_unison[i];
+    Additive *additive = &synth->voice_additive[i];
+    Waveguide *waveguide = &synth->voice_waveguide[i];
+    float cutoff = patch->filter_cutoff * synth->voice_brightness[i];
+    float gains[MAX_CHANNELS];
+    panGains(patch->pan, channels, gains);
+    size_t rendered;
+
+    if (waveguide->active) {
+      filter->coeff = filterCoeff(cutoff, synth->sample_rate);
+      rendered = renderWaveguideVoice(synth, osc, waveguide, filter, voice, n);
+    } else if (additive->count > 0) {
+      filter->coeff = filterCoeff(cutoff, synth->sample_rate);
+      rendered = renderAdditiveVoice(synth, osc, additive, filter, voice, n);
+    } else if (unison->count > 1) {
+      filter->coeff = filterCoeff(cutoff, synth->sample_rate);
+      if (channels > 1) {
+        renderUnisonChannels(patch, synth, osc, unison, filter, signal, n);
+        continue;
+      }
+      rendered = renderUnisonVoice(patch, synth, osc, unison, filter, voice, n);
+    } else {
+      filter->coeff =
+          filterCoeff(cutoff, (float)synth->sample_rate * factor);
+      Oversampler *os = &synth->voiceOversamplers[i];
+
+      if (bus) {
+        rendered = renderBusVoice(shape_fn, synth, osc, filter, voice, n);
+        panVoice(synth->bus_scratch, bus_stride, channels, gains, voice,
+                 rendered);
+        continue;
+      }
+
+      if (synth->oversample_mode == OVERSAMPLE_VOICE &&
+          shapeNeedsOversampling(shape_fn)) {
+        int os_factor = chooseOversampleFactor(osc->freq, synth->sample_rate);
+        if (os->factor != os_factor)
+          resetOversampler(os, os_factor);
+      }
+
+      if (synth->oversample_mode == OVERSAMPLE_VOICE &&
+          shapeNeedsOversampling(shape_fn) && os->factor > 1)
+        rendered =
+            renderOversampledVoice(shape_fn, synth, osc, os, filter, voice, n);
+      else if (synth->nco)
+        rendered = renderNCOVoice(shape_fn, synth, osc, filter, voice, n);
+      else
+        rendered = renderVoice(shape_fn, synth, osc, filter, voice, n);
+    }
+    panVoice(signal, synth->channel_stride, channels, gains, voice,
+             rendered);
+  }
+
+  if (bus)
+    for (int c = 0; c < channels; c++) {
+      Oversampler *os = &synth->busOversamplers[c];
+      float *dst = signal + c * synth->channel_stride;
+      const float *scratch = synth->bus_scratch + c * bus_stride;
+      for (size_t t = 0; t < n; t++)
+        dst[t] += decimateOversampled(os, &scratch[t * factor]);
+    }
+
+  // voices whose envelope ended in this block leave the active set
+  for (uint32_t m = synth->voice_active; m;) {
+    size_t i = nextVoice(&m);
+    if (osc_array.osc[i].envelope.state == OFF)
+      synth->voice_active &= ~(1u << i);
+  }
+}
+
+void updateOscArray(Synth *synth, OscillatorArray osc_array, size_t offset,
+                    size_t n) {
+  float *signal = synth->signal + offset;
+  switch (n) {
+  case 64:
+    renderOscArray(synth, osc_array, signal, 64);
+    break;
+  case 128:
+    renderOscArray(synth, osc_array, signal, 128);
+    break;
+  case 256:
+    renderOscArray(synth, osc_array, signal, 256);
+    break;
+  case 512:
+    renderOscArray(synth, osc_array, signal, 512);
+    break;
+  case 1024:
+    renderOscArray(synth, osc_array, signal, 1024);
+    break;
+  default:
+    renderOscArray(synth, osc_array, signal, n);
+    break;
+  }
+}
+
+// planar channels into frames, once per block for the outputs. stereo
+// zips four frames at a time
+static void interleave(float *out, const float *in, size_t stride,
+                       int channels, size_t n) {
+  size_t t = 0;
+  if (channels == 2) {
+    const float *l = in, *r = in + stride;
+    for (; t + SIMD_WIDTH <= n; t += SIMD_WIDTH) {
+      v4f a = v4f_load(&l[t]), b = v4f_load(&r[t]);
+      v4f_store(&out[2 * t], v4f_zip_lo(a, b));
+      v4f_store(&out[2 * t + SIMD_WIDTH], v4f_zip_hi(a, b));
+    }
+  }
+  for (; t < n; t++)
+    for (int c = 0; c < channels; c++)
+      out[t * channels + c] = in[c * stride + t];
+}
+
+// one block of output into synth->signal and synth->output, shared by the
+// live loop and the offline renderers. the block is split at the sample time
+// of every scheduled event, so events land on their exact sample
+void renderBlock(Synth *synth) {
+  PROFILE_BEGIN(PROF_RENDER);
+  float *signal = synth->signal;
+  size_t n = synth->signal_length;
+  size_t offset = 0;
+
+  zeroSignal(signal, synth->channel_stride * (synth->channels - 1) + n);
+
+  while (offset < n) {
+    uint64_t now = synth->sample_clock + offset;
+    PROFILE_BEGIN(PROF_EVENTS);
+    uint64_t next = applyDueEvents(synth, now);
+    PROFILE_END(PROF_EVENTS);
+    PROFILE_BEGIN(PROF_KEYS);
+    handle_keys(synth, now);
+    PROFILE_END(PROF_KEYS);
+
+    size_t end = next - synth->sample_clock < n ? next - synth->sample_clock
+                                                : n;
+
+    // synth->signal stays on the whole block, the networking thread reads
+    // it while this runs
+    PROFILE_BEGIN(PROF_VOICES);
+    updateOscArray(synth, synth->keyOscillators, offset, end - offset);
+    PROFILE_END(PROF_VOICES);
+    offset = end;
+  }
+
+  PROFILE_BEGIN(PROF_MASTER);
+  masterProcess(&synth->master, signal, synth->channel_stride,
+                synth->bus_scratch, n);
+  if (synth->channels > 1)
+    interleave(synth->output, signal, synth->channel_stride, synth->channels,
+               n);
+  PROFILE_END(PROF_MASTER);
+  synth->sample_clock += n;
+  atomic_store_explicit(&g_sample_clock, synth->sample_clock,
+                        memory_order_relaxed);
+  PROFILE_END(PROF_RENDER);
+}
@@ -0,0 +1,578 @@
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "events.h"
+#include "patch.h"
+#include "profiler.h"
+#include "recorder.h"
+#include "sequencer.h"
+#include "snapshot.h"
+#include "synth.h"
+#include "tclsynth.h"
+#include "utils.h"
+
+// how long a bulk submit waits for the audio thread to make room
+#define PUSH_RETRY_NS 1000000
+#define PUSH_TIMEOUT_MS 5000
+
+// one producer per queue, all interpreters share the script queue
+static pthread_mutex_t push_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int push_event(Tcl_Interp *interp, const synth_event_t *ev) {
+  struct timespec retry = {0, PUSH_RETRY_NS};
+  int waited = 0;
+
+  pthread_mutex_lock(&push_lock);
+  while (!event_push(&g_script_events, ev)) {
+    if (waited++ == PUSH_TIMEOUT_MS) {
+      pthread_mutex_unlock(&push_lock);
+      Tcl_SetObjResult(interp,
+                       Tcl_NewStringObj("synth event queue is full", -1));
+      return TCL_ERROR;
+    }
+    nanosleep(&retry, NULL);
+  }
+  pthread_mutex_unlock(&push_lock);
+  return TCL_OK;
+}
+
+static int get_key(Tcl_Interp *interp, Tcl_Obj *obj, uint8_t *key) {
+  int value;
+  if (Tcl_GetIntFromObj(interp, obj, &value) != TCL_OK)
+    return TCL_ERROR;
+  if (value < 0 || value >= NUM_KEYS) {
+    Tcl_SetObjResult(interp,
+                     Tcl_ObjPrintf("key %d is not within 0..%d", value,
+                                   NUM_KEYS - 1));
+    return TCL_ERROR;
+  }
+  *key = value;
+  return TCL_OK;
+}
+
+static int get_channel(Tcl_Interp *interp, Tcl_Obj *obj, uint8_t *channel) {
+  int value;
+  if (Tcl_GetIntFromObj(interp, obj, &value) != TCL_OK)
+    return TCL_ERROR;
+  if (value < 0 || value > UINT8_MAX) {
+    Tcl_SetObjResult(interp,
+                     Tcl_ObjPrintf("channel %d is not within 0..255", value));
+    return TCL_ERROR;
+  }
+  *channel = value;
+  return TCL_OK;
+}
+
+// builds an event from an op and its arguments, the same words the
+// commands take. every op takes an optional trailing channel
+static int parse_event(Tcl_Interp *interp, const char *op, int objc,
+                       Tcl_Obj *const objv[], uint64_t time,
+                       synth_event_t *ev) {
+  memset(ev, 0, sizeof(*ev));
+  ev->time = time;
+
+  bool expression = !strcmp(op, "bend") || !strcmp(op, "pressure") ||
+                    !strcmp(op, "timbre");
+  int args = !strcmp(op, "set") || expression ? 2 : 1;
+  if (objc == args + 1) {
+    if (get_channel(interp, objv[args], &ev->channel) != TCL_OK)
+      return TCL_ERROR;
+    objc--;
+  }
+
+  if (!strcmp(op, "note_on") || !strcmp(op, "note_off")) {
+    if (objc != 1)
+      goto usage;
+    ev->type = op[6] == 'n' ? EVENT_NOTE_ON : EVENT_NOTE_OFF;
+    return get_key(interp, objv[0], &ev->note);
+  }
+
+  if (!strcmp(op, "program")) {
+    int program;
+    if (objc != 1 || Tcl_GetIntFromObj(interp, objv[0], &program) != TCL_OK)
+      goto usage;
+    if (program < 0 || program >= PATCH_MAX_PROGRAMS) {
+      Tcl_SetObjResult(interp,
+                       Tcl_ObjPrintf("program %d is not within 0..%d", program,
+                                     PATCH_MAX_PROGRAMS - 1));
+      return TCL_ERROR;
+    }
+    ev->type = EVENT_PROGRAM;
+    ev->value = program;
+    return TCL_OK;
+  }
+
+  if (!strcmp(op, "set")) {
+    if (objc != 2)
+      goto usage;
+    const char *name = Tcl_GetString(objv[0]);
+    int param = patchParamFromName(name);
+    if (param < 0) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown parameter %s", name));
+      return TCL_ERROR;
+    }
+
+    // shapes by name as well as by number
+    double value;
+    int shape = param == PARAM_SHAPE ? shapeIdFromName(Tcl_GetString(objv[1]))
+                                     : -1;
+    if (shape >= 0)
+      value = shape;
+    else if (Tcl_GetDoubleFromObj(interp, objv[1], &value) != TCL_OK)
+      return TCL_ERROR;
+
+    ev->type = EVENT_PARAM;
+    ev->note = param;
+    ev->value = value;
+    return TCL_OK;
+  }
+
+  // per note expression, clamped by the audio thread
+  if (expression) {
+    double value;
+    if (objc != 2 || get_key(interp, objv[0], &ev->note) != TCL_OK ||
+        Tcl_GetDoubleFromObj(interp, objv[1], &value) != TCL_OK)
+      goto usage;
+    ev->type = op[0] == 'b'   ? EVENT_BEND
+               : op[0] == 'p' ? EVENT_PRESSURE
+                              : EVENT_TIMBRE;
+    ev->value = value;
+    return TCL_OK;
+  }
+
+usage:
+  Tcl_SetObjResult(interp,
+                   Tcl_NewStringObj("expected note_on key, note_off key, "
+                                    "program n, set param value, bend key "
+                                    "semitones, pressure key amount or "
+                                    "timbre key amount, each with an "
+                                    "optional channel",
+                                    -1));
+  return TCL_ERROR;
+}
+
+static int get_time(Tcl_Interp *interp, Tcl_Obj *obj, uint64_t *time) {
+  Tcl_WideInt value;
+  if (Tcl_GetWideIntFromObj(interp, obj, &value) != TCL_OK)
+    return TCL_ERROR;
+  *time = value < 0 ? 0 : (uint64_t)value;
+  return TCL_OK;
+}
+
+// synth::note_on key, synth::note_off key, synth::program n and
+// synth::set param value, all applied at the start of the next block.
+// data is the op name
+static int immediate_cmd(ClientData data, Tcl_Interp *interp, int objc,
+                         Tcl_Obj *const objv[]) {
+  synth_event_t ev;
+  if (parse_event(interp, data, objc - 1, objv + 1, 0, &ev) != TCL_OK)
+    return TCL_ERROR;
+  return push_event(interp, &ev);
+}
+
+// synth::at sample_time op args..., lands on that exact sample
+static int at_cmd(ClientData data, Tcl_Interp *interp, int objc,
+                  Tcl_Obj *const objv[]) {
+  (void)data;
+  uint64_t time;
+  synth_event_t ev;
+
+  if (objc < 3) {
+    Tcl_WrongNumArgs(interp, 1, objv, "sample_time op ?arg ...?");
+    return TCL_ERROR;
+  }
+  if (get_time(interp, objv[1], &time) != TCL_OK ||
+      parse_event(interp, Tcl_GetString(objv[2]), objc - 3, objv + 3, time,
+                  &ev) != TCL_OK)
+    return TCL_ERROR;
+  return push_event(interp, &ev);
+}
+
+// synth::submit {{sample_time op args...} ...}, returns the event count.
+// the whole list is parsed before anything is queued, so a bad entry
+// submits nothing. the queue drains while the list goes in, so a list
+// longer than it can still time out part way, the error then says how many
+// of the events were submitted
+static int submit_cmd(ClientData data, Tcl_Interp *interp, int objc,
+                      Tcl_Obj *const objv[]) {
+  (void)data;
+  int count;
+  Tcl_Obj **entries;
+
+  if (objc != 2) {
+    Tcl_WrongNumArgs(interp, 1, objv, "events");
+    return TCL_ERROR;
+  }
+  if (Tcl_ListObjGetElements(interp, objv[1], &count, &entries) != TCL_OK)
+    return TCL_ERROR;
+
+  synth_event_t *events =
+      (synth_event_t *)Tcl_Alloc(count * sizeof(synth_event_t) + 1);
+  for (int i = 0; i < count; i++) {
+    int words;
+    Tcl_Obj **word;
+    uint64_t time;
+    if (Tcl_ListObjGetElements(interp, entries[i], &words, &word) != TCL_OK ||
+        words < 2 || get_time(interp, word[0], &time) != TCL_OK ||
+        parse_event(interp, Tcl_GetString(word[1]), words - 2, word + 2, time,
+                    &events[i]) != TCL_OK) {
+      Tcl_AppendObjToErrorInfo(
+          interp, Tcl_ObjPrintf("\n    (synth::submit entry %d)", i));
+      Tcl_Free((char *)events);
+      return TCL_ERROR;
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (push_event(interp, &events[i]) != TCL_OK) {
+      Tcl_SetObjResult(interp,
+                       Tcl_ObjPrintf("synth event queue is full, %d of %d "
+                                     "events were submitted",
+                                     i, count));
+      Tcl_Free((char *)events);
+      return TCL_ERROR;
+    }
+  }
+  Tcl_Free((char *)events);
+  Tcl_SetObjResult(interp, Tcl_NewIntObj(count));
+  return TCL_OK;
+}
+
+// synth::now, the sample time the next block starts at
+static int now_cmd(ClientData data, Tcl_Interp *interp, int objc,
+                   Tcl_Obj *const objv[]) {
+  (void)data;
+  if (objc != 1) {
+    Tcl_WrongNumArgs(interp, 1, objv, NULL);
+    return TCL_ERROR;
+  }
+  Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt)atomic_load_explicit(
+                               &g_sample_clock, memory_order_relaxed)));
+  return TCL_OK;
+}
+
+extern Synth *g_synth;
+
+// synth::rate, samples per second, to turn seconds into sample times
+static int rate_cmd(ClientData data, Tcl_Interp *interp, int objc,
+                    Tcl_Obj *const objv[]) {
+  (void)data;
+  if (objc != 1) {
+    Tcl_WrongNumArgs(interp, 1, objv, NULL);
+    return TCL_ERROR;
+  }
+  Tcl_SetObjResult(interp,
+                   Tcl_NewIntObj(g_synth ? g_synth->sample_rate
+                                         : DEFAULT_SAMPLE_RATE));
+  return TCL_OK;
+}
+
+// synth::latency, samples from an event's time to when it is heard
+static int latency_cmd(ClientData data, Tcl_Interp *interp, int objc,
+                       Tcl_Obj *const objv[]) {
+  (void)data;
+  if (objc != 1) {
+    Tcl_WrongNumArgs(interp, 1, objv, NULL);
+    return TCL_ERROR;
+  }
+  Tcl_SetObjResult(interp, Tcl_NewIntObj(atomic_load_explicit(
+                               &g_output_latency, memory_order_relaxed)));
+  return TCL_OK;
+}
+
+// synth::tuning scl ?kbm?, or synth::tuning equal, swaps the tuning table.
+// voices already sounding move to the new pitches
+static int tuning_cmd(ClientData data, Tcl_Interp *interp, int objc,
+                      Tcl_Obj *const objv[]) {
+  (void)data;
+  if (objc != 2 && objc != 3) {
+    Tcl_WrongNumArgs(interp, 1, objv, "scl ?kbm?");
+    return TCL_ERROR;
+  }
+  int sample_rate = g_synth ? g_synth->sample_rate : DEFAULT_SAMPLE_RATE;
+  const char *scl = Tcl_GetString(objv[1]);
+  const char *kbm = objc == 3 ? Tcl_GetString(objv[2]) : NULL;
+  tuning_t *t = !strcmp(scl, "equal") ? tuning_equal(sample_rate)
+                                      : tuning_load(scl, kbm, sample_rate);
+  if (!t) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not load tuning %s", scl));
+    return TCL_ERROR;
+  }
+  tuning_publish(t);
+  Tcl_SetObjResult(interp, Tcl_NewStringObj(t->name, -1));
+  return TCL_OK;
+}
+
+// synth::record path ?direct?, records the output to a wav file until
+// synth::record stop. direct writes with O_DIRECT, past the page cache
+static int record_cmd(ClientData data, Tcl_Interp *interp, int objc,
+                      Tcl_Obj *const objv[]) {
+  (void)data;
+  if (objc == 2 && !strcmp(Tcl_GetString(objv[1]), "stop")) {
+    recorder_stop();
+    return TCL_OK;
+  }
+  if (objc != 2 && !(objc == 3 && !strcmp(Tcl_GetString(objv[2]), "direct"))) {
+    Tcl_WrongNumArgs(interp, 1, objv, "path ?direct?|stop");
+    return TCL_ERROR;
+  }
+  const char *path = Tcl_GetString(objv[1]);
+  if (!recorder_start(path,
+                      g_synth ? g_synth->sample_rate : DEFAULT_SAMPLE_RATE,
+                      g_synth ? g_synth->channels : DEFAULT_CHANNELS,
+                      objc == 3)) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not record to %s", path));
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+// synth::profile path, writes the profiler's spans as a chrome trace
+static int profile_cmd(ClientData data, Tcl_Interp *interp, int objc,
+                       Tcl_Obj *const objv[]) {
+  (void)data;
+  if (objc != 2) {
+    Tcl_WrongNumArgs(interp, 1, objv, "path");
+    return TCL_ERROR;
+  }
+  const char *path = Tcl_GetString(objv[1]);
+  if (!profiler_dump(path)) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not write %s", path));
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+// synth::snapshot path, the engine state at the next block boundary
+static int snapshot_cmd(ClientData data, Tcl_Interp *interp, int objc,
+                        Tcl_Obj *const objv[]) {
+  (void)data;
+  if (objc != 2) {
+    Tcl_WrongNumArgs(interp, 1, objv, "path");
+    return TCL_ERROR;
+  }
+  const char *path = Tcl_GetString(objv[1]);
+  if (!snapshot_save(path)) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not save %s", path));
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+// a step is a list, its key (- for a rest, x for an arpeggiator step)
+// followed by option value pairs: ratchet n, gate 0..1 or any patch
+// parameter, which is locked to the value for the step
+static int parse_step(Tcl_Interp *interp, Tcl_Obj *obj, seq_step_t *st) {
+  int words;
+  Tcl_Obj **word;
+  if (Tcl_ListObjGetElements(interp, obj, &words, &word) != TCL_OK)
+    return TCL_ERROR;
+
+  *st = (seq_step_t){.note = SEQ_REST, .ratchet = 1};
+  if (words == 0 || !strcmp(Tcl_GetString(word[0]), "-"))
+    return TCL_OK;
+  if (!strcmp(Tcl_GetString(word[0]), "x"))
+    st->note = SEQ_HIT;
+  else if (get_key(interp, word[0], &st->note) != TCL_OK)
+    return TCL_ERROR;
+
+  if (words % 2 == 0) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("step %s: options come in pairs",
+                                           Tcl_GetString(obj)));
+    return TCL_ERROR;
+  }
+  for (int i = 1; i < words; i += 2) {
+    const char *name = Tcl_GetString(word[i]);
+    double value;
+    int param = patchParamFromName(name);
+    int shape = param == PARAM_SHAPE
+                    ? shapeIdFromName(Tcl_GetString(word[i + 1]))
+                    : -1;
+    if (shape >= 0)
+      value = shape;
+    else if (Tcl_GetDoubleFromObj(interp, word[i + 1], &value) != TCL_OK)
+      return TCL_ERROR;
+
+    if (!strcmp(name, "ratchet")) {
+      if (value < 1 || value > SEQ_MAX_RATCHET) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("ratchet is 1 to %d",
+                                               SEQ_MAX_RATCHET));
+        return TCL_ERROR;
+      }
+      st->ratchet = (uint8_t)value;
+    } else if (!strcmp(name, "gate")) {
+      st->gate = value;
+    } else if (param >= 0 && st->lock_count < SEQ_MAX_LOCKS) {
+      st->locks[st->lock_count++] = (seq_lock_t){param, value};
+    } else {
+      Tcl_SetObjResult(interp,
+                       param >= 0
+                           ? Tcl_ObjPrintf("at most %d locks per step",
+                                           SEQ_MAX_LOCKS)
+                           : Tcl_ObjPrintf("unknown step option %s", name));
+      return TCL_ERROR;
+    }
+  }
+  return TCL_OK;
+}
+
+static int seq_edit(Tcl_Interp *interp, sequence_t *s, const char *op,
+                    int objc, Tcl_Obj *const objv[]) {
+  static const char *const orders[] = {"up", "down", "updown", "played",
+                                       "random", NULL};
+  double value;
+  int n;
+
+  if (!strcmp(op, "start") && objc <= 1) {
+    uint64_t time = 0;
+    if (objc == 1 && get_time(interp, objv[0], &time) != TCL_OK)
+      return TCL_ERROR;
+    // a fresh start time restarts a running sequence from step 0
+    s->start_time = time ? time : atomic_load(&g_sample_clock);
+    s->running = true;
+  } else if (!strcmp(op, "stop") && objc == 0) {
+    s->running = false;
+  } else if (!strcmp(op, "tempo") && (objc == 1 || objc == 2)) {
+    if (Tcl_GetDoubleFromObj(interp, objv[0], &value) != TCL_OK)
+      return TCL_ERROR;
+    s->bpm = value;
+    if (objc == 2) {
+      if (Tcl_GetIntFromObj(interp, objv[1], &n) != TCL_OK)
+        return TCL_ERROR;
+      s->steps_per_beat = n;
+    }
+  } else if (!strcmp(op, "swing") && objc == 1) {
+    if (Tcl_GetDoubleFromObj(interp, objv[0], &value) != TCL_OK)
+      return TCL_ERROR;
+    s->swing = fmax(0.0, fmin(0.5, value));
+  } else if (!strcmp(op, "gate") && objc == 1) {
+    if (Tcl_GetDoubleFromObj(interp, objv[0], &value) != TCL_OK)
+      return TCL_ERROR;
+    s->gate = fmax(0.0, fmin(1.0, value));
+  } else if (!strcmp(op, "channel") && objc == 1) {
+    return get_channel(interp, objv[0], &s->channel);
+  } else if (!strcmp(op, "arp") && objc == 1) {
+    if (!strcmp(Tcl_GetString(objv[0]), "off")) {
+      s->mode = SEQ_STEPS;
+      return TCL_OK;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[0], orders, "order", 0, &n) !=
+        TCL_OK)
+      return TCL_ERROR;
+    s->mode = SEQ_ARP;
+    s->order = n;
+  } else if (!strcmp(op, "steps") && objc == 1) {
+    Tcl_Obj **steps;
+    if (Tcl_ListObjGetElements(interp, objv[0], &n, &steps) != TCL_OK)
+      return TCL_ERROR;
+    if (n < 1 || n > SEQ_MAX_STEPS) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("a pattern is 1 to %d steps",
+                                             SEQ_MAX_STEPS));
+      return TCL_ERROR;
+    }
+    for (int i = 0; i < n; i++)
+      if (parse_step(interp, steps[i], &s->steps[i]) != TCL_OK)
+        return TCL_ERROR;
+    s->length = n;
+  } else {
+    Tcl_SetObjResult(interp,
+                     Tcl_NewStringObj("expected start ?sample_time?, stop, "
+                                      "tempo bpm ?steps_per_beat?, swing "
+                                      "0..0.5, gate 0..1, channel n, arp "
+                                      "order|off or steps list",
+                                      -1));
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+// synth::seq op ?arg ...?, edits the built in sequencer, which runs on the
+// audio clock. a bad edit leaves the pattern as it was
+static int seq_cmd(ClientData data, Tcl_Interp *interp, int objc,
+                   Tcl_Obj *const objv[]) {
+  (void)data;
+  if (objc < 2) {
+    Tcl_WrongNumArgs(interp, 1, objv, "op ?arg ...?");
+    return TCL_ERROR;
+  }
+  sequence_t *s = sequence_edit();
+  if (!s) {
+    Tcl_SetObjResult(interp, Tcl_NewStringObj("out of memory", -1));
+    return TCL_ERROR;
+  }
+  if (seq_edit(interp, s, Tcl_GetString(objv[1]), objc - 2, objv + 2) !=
+      TCL_OK) {
+    sequence_discard(s);
+    return TCL_ERROR;
+  }
+  sequence_publish(s);
+  return TCL_OK;
+}
+
+int Synth_Init(Tcl_Interp *interp) {
+  static const struct {
+    const char *name;
+    Tcl_ObjCmdProc *proc;
+    const char *op;
+  } commands[] = {
+      {"::synth::note_on", immediate_cmd, "note_on"},
+      {"::synth::note_off", immediate_cmd, "note_off"},
+      {"::synth::program", immediate_cmd, "program"},
+      {"::synth::set", immediate_cmd, "set"},
+      {"::synth::bend", immediate_cmd, "bend"},
+      {"::synth::pressure", immediate_cmd, "pressure"},
+      {"::synth::timbre", immediate_cmd, "timbre"},
+      {"::synth::at", at_cmd, NULL},
+      {"::synth::submit", submit_cmd, NULL},
+      {"::synth::now", now_cmd, NULL},
+      {"::synth::rate", rate_cmd, NULL},
+      {"::synth::latency", latency_cmd, NULL},
+      {"::synth::tuning", tuning_cmd, NULL},
+      {"::synth::seq", seq_cmd, NULL},
+      {"::synth::record", record_cmd, NULL},
+      {"::synth::profile", profile_cmd, NULL},
+      {"::synth::snapshot", snapshot_cmd, NULL},
+  };
+
+  Tcl_Namespace *ns = Tcl_CreateNamespace(interp, "::synth", NULL, NULL);
+  if (!ns)
+    return TCL_ERROR;
+
+  for (size_t i = 0; i < sizeof(commands) / sizeof(*commands); i++)
+    Tcl_CreateObjCommand(interp, commands[i].name, commands[i].proc,
+                         (ClientData)commands[i].op, NULL);
+  if (Tcl_Export(interp, ns, "*", 0) != TCL_OK)
+    return TCL_ERROR;
+
+  return Tcl_PkgProvide(interp, "synth", "0.1");
+}
+
+static void *script_thread(void *arg) {
+  const char *path = arg;
+  log_thread_init();
+
+  Tcl_Interp *interp = Tcl_CreateInterp();
+  if (Tcl_Init(interp) == TCL_ERROR || Synth_Init(interp) == TCL_ERROR) {
+    log_message(ERROR, "tcl initialization failed: %s",
+                Tcl_GetStringResult(interp));
+  } else if (Tcl_EvalFile(interp, path) != TCL_OK) {
+    log_message(ERROR, "%s: %s", path,
+                Tcl_GetVar(interp, "errorInfo", TCL_GLOBAL_ONLY));
+  } else {
+    log_message(INFO, "%s finished", path);
+  }
+
+  Tcl_DeleteInterp(interp);
+  return NULL;
+}
+
+void tclsynth_run_script(const char *path) {
+  pthread_t thread;
+  Tcl_FindExecutable(NULL);
+  if (pthread_create(&thread, NULL, script_thread, (void *)path)) {
+    log_message(ERROR, "could not start the script thread for %s", path);
+    return;
+  }
+  pthread_detach(thread);
+}
@@ -0,0 +1,291 @@
+#include "tuning.h"
+#include "nco.h"
+#include "utils.h"
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// same handover as the parameter snapshots, see params.c
+static _Atomic(tuning_t *) current_tuning = NULL;
+static _Atomic(tuning_t *) tuning_in_use = NULL;
+// the socket and scripts both publish. the lock is held until the replaced
+// table is freed: a second publisher could otherwise free a table the audio
+// thread has just picked up, the same as with sequences
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define BEND_TABLE_SIZE (2 * TUNING_BEND_RANGE * TUNING_BEND_STEPS + 1)
+static float bend_table[BEND_TABLE_SIZE];
+
+static void fill_increments(tuning_t *t) {
+  for (int n = 0; n < TUNING_NOTES; n++)
+    t->inc[n] = ncoPhaseIncrement(t->freq[n], t->sample_rate);
+}
+
+tuning_t *tuning_equal(int sample_rate) {
+  tuning_t *t = calloc(1, sizeof(tuning_t));
+  if (!t)
+    return NULL;
+  snprintf(t->name, sizeof(t->name), "12-tet");
+  t->sample_rate = sample_rate;
+  for (int n = 0; n < TUNING_NOTES; n++)
+    t->freq[n] = powf(2.f, (n - 69) / 12.f) * 440.0f;
+  fill_increments(t);
+  return t;
+}
+
+// next line that is not a ! comment, with surrounding blanks stripped
+static char *next_line(FILE *f, char *buf, size_t size) {
+  while (fgets(buf, size, f)) {
+    char *s = buf;
+    while (isspace((unsigned char)*s))
+      s++;
+    if (*s == '!')
+      continue;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+      *--end = '\0';
+    return s;
+  }
+  return NULL;
+}
+
+// a pitch is cents when it has a dot, otherwise a ratio n/d or a whole
+// number. returns the ratio, 0 if it does not parse
+static double parse_pitch(const char *s) {
+  char *end;
+  if (strchr(s, '.')) {
+    double cents = strtod(s, &end);
+    return end == s ? 0.0 : pow(2.0, cents / 1200.0);
+  }
+  long num = strtol(s, &end, 10);
+  if (end == s || num <= 0)
+    return 0.0;
+  if (*end != '/')
+    return num;
+  long den = strtol(end + 1, &end, 10);
+  return den > 0 ? (double)num / den : 0.0;
+}
+
+typedef struct scale {
+  char description[64];
+  int count;
+  // ratio[0] is 1/1, ratio[count] the period, usually 2/1
+  double ratio[TUNING_MAX_DEGREES + 1];
+} scale_t;
+
+static bool read_scl(const char *path, scale_t *s) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    log_message(ERROR, "could not open %s", path);
+    return false;
+  }
+
+  char buf[256], *line;
+  bool ok = false;
+  if (!(line = next_line(f, buf, sizeof(buf))))
+    goto done;
+  snprintf(s->description, sizeof(s->description), "%s", line);
+  if (!(line = next_line(f, buf, sizeof(buf))))
+    goto done;
+  s->count = atoi(line);
+  if (s->count < 1 || s->count > TUNING_MAX_DEGREES)
+    goto done;
+
+  s->ratio[0] = 1.0;
+  for (int i = 1; i <= s->count; i++) {
+    if (!(line = next_line(f, buf, sizeof(buf))) ||
+        !(s->ratio[i] = parse_pitch(line)))
+      goto done;
+  }
+  ok = s->ratio[s->count] > 1.0;
+
+done:
+  fclose(f);
+  if (!ok)
+    log_message(ERROR, "%s is not a scala scale", path);
+  return ok;
+}
+
+typedef struct keymap {
+  int size; // 0 maps every key to the next degree
+  int first, last;
+  int middle; // key of degree 0
+  int reference;
+  double reference_freq;
+  int period_degree; // degree of the formal octave, 0 is the scale size
+  int map[TUNING_NOTES]; // -1 leaves the key out
+} keymap_t;
+
+static void default_keymap(keymap_t *k) {
+  *k = (keymap_t){.size = 0,
+                  .first = 0,
+                  .last = TUNING_NOTES - 1,
+                  .middle = 60,
+                  .reference = 69,
+                  .reference_freq = 440.0,
+                  .period_degree = 0};
+}
+
+static bool read_kbm(const char *path, keymap_t *k) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    log_message(ERROR, "could not open %s", path);
+    return false;
+  }
+
+  char buf[256], *line;
+  double header[7];
+  bool ok = false;
+  for (int i = 0; i < 7; i++) {
+    if (!(line = next_line(f, buf, sizeof(buf))))
+      goto done;
+    header[i] = strtod(line, NULL);
+  }
+  k->size = (int)header[0];
+  k->first = (int)header[1];
+  k->last = (int)header[2];
+  k->middle = (int)header[3];
+  k->reference = (int)header[4];
+  k->reference_freq = header[5];
+  k->period_degree = (int)header[6];
+  if (k->size < 0 || k->size > TUNING_NOTES || k->reference_freq <= 0.0)
+    goto done;
+
+  for (int i = 0; i < k->size; i++) {
+    if (!(line = next_line(f, buf, sizeof(buf))))
+      goto done;
+    k->map[i] = *line == 'x' ? -1 : atoi(line);
+  }
+  ok = true;
+
+done:
+  fclose(f);
+  if (!ok)
+    log_message(ERROR, "%s is not a scala keyboard mapping", path);
+  return ok;
+}
+
+// scale degree of midi note n, false for keys the mapping leaves out
+static bool note_degree(const scale_t *s, const keymap_t *k, int n,
+                        int *degree) {
+  if (n < k->first || n > k->last)
+    return false;
+  int offset = n - k->middle;
+  if (k->size == 0) {
+    *degree = offset;
+    return true;
+  }
+
+  int octave = offset >= 0 ? offset / k->size
+                           : -((-offset - 1) / k->size) - 1;
+  int m = k->map[offset - octave * k->size];
+  if (m < 0)
+    return false;
+  int period = k->period_degree ? k->period_degree : s->count;
+  *degree = octave * period + m;
+  return true;
+}
+
+static double degree_ratio(const scale_t *s, int degree) {
+  int octave = degree >= 0 ? degree / s->count
+                           : -((-degree - 1) / s->count) - 1;
+  int step = degree - octave * s->count;
+  return pow(s->ratio[s->count], octave) * s->ratio[step];
+}
+
+tuning_t *tuning_load(const char *scl, const char *kbm, int sample_rate) {
+  scale_t *s = malloc(sizeof(scale_t));
+  keymap_t k;
+  default_keymap(&k);
+  if (!s || !read_scl(scl, s) || (kbm && !read_kbm(kbm, &k))) {
+    free(s);
+    return NULL;
+  }
+
+  int ref_degree;
+  if (!note_degree(s, &k, k.reference, &ref_degree)) {
+    log_message(ERROR, "%s: the reference note %d is not mapped",
+                kbm ? kbm : scl, k.reference);
+    free(s);
+    return NULL;
+  }
+  double base = k.reference_freq / degree_ratio(s, ref_degree);
+
+  tuning_t *t = calloc(1, sizeof(tuning_t));
+  if (t) {
+    snprintf(t->name, sizeof(t->name), "%s", s->description);
+    t->sample_rate = sample_rate;
+    for (int n = 0; n < TUNING_NOTES; n++) {
+      int degree;
+      if (note_degree(s, &k, n, &degree))
+        t->freq[n] = (float)(base * degree_ratio(s, degree));
+    }
+    fill_increments(t);
+  }
+  free(s);
+  return t;
+}
+
+tuning_t *tuning_load_or_equal(const char *scl, const char *kbm,
+                               int sample_rate) {
+  tuning_t *t = NULL;
+  if (scl && *scl && strcmp(scl, "equal"))
+    t = tuning_load(scl, kbm && *kbm && strcmp(kbm, "default") ? kbm : NULL,
+                    sample_rate);
+  return t ? t : tuning_equal(sample_rate);
+}
+
+void tuning_init(tuning_t *initial) {
+  for (int i = 0; i < BEND_TABLE_SIZE; i++)
+    bend_table[i] = exp2f((float)(i - BEND_TABLE_SIZE / 2) /
+                          (TUNING_BEND_STEPS * 12.0f));
+  log_message(INFO, "tuning: %s", initial->name);
+  atomic_store(&tuning_in_use, initial);
+  atomic_store(&current_tuning, initial);
+}
+
+const tuning_t *tuning_acquire(void) {
+  tuning_t *t = atomic_load_explicit(&current_tuning, memory_order_acquire);
+  atomic_store_explicit(&tuning_in_use, t, memory_order_release);
+  return t;
+}
+
+void tuning_publish(tuning_t *t) {
+  pthread_mutex_lock(&publish_lock);
+  tuning_t *old = atomic_exchange_explicit(&current_tuning, t,
+                                           memory_order_acq_rel);
+  log_message(INFO, "tuning: %s", t->name);
+  if (!old) {
+    pthread_mutex_unlock(&publish_lock);
+    return;
+  }
+
+  struct timespec wait = {.tv_sec = 0, .tv_nsec = 1000 * 1000};
+  for (int i = 0; i < 1000; i++) {
+    if (atomic_load_explicit(&tuning_in_use, memory_order_acquire) != old) {
+      free(old);
+      pthread_mutex_unlock(&publish_lock);
+      return;
+    }
+    nanosleep(&wait, NULL);
+  }
+  pthread_mutex_unlock(&publish_lock);
+  log_message(WARNING, "tuning: audio thread did not pick up %s", t->name);
+}
+
+float tuningBendRatio(float semitones) {
+  float x = (semitones + TUNING_BEND_RANGE) * TUNING_BEND_STEPS;
+  if (x <= 0.0f)
+    return bend_table[0];
+  if (x >= BEND_TABLE_SIZE - 1)
+    return bend_table[BEND_TABLE_SIZE - 1];
+  int i = (int)x;
+  float frac = x - i;
+  return bend_table[i] + (bend_table[i + 1] - bend_table[i]) * frac;
+}
@@ -0,0 +1,107 @@
+#include "unison.h"
+#include "master.h"
+#include "nco.h"
+#include <math.h>
+#include <string.h>
+
+void unisonStart(Unison *u, int count, float detune_cents, float spread,
+                 uint32_t *rng) {
+  memset(u, 0, sizeof(*u));
+  if (count < 2)
+    return;
+  if (count > UNISON_MAX_VOICES)
+    count = UNISON_MAX_VOICES;
+
+  u->count = count;
+  float gain = 1.0f / sqrtf((float)count); // uncorrelated lanes add in power
+  for (int k = 0; k < count; k++) {
+    float position = 2.0f * k / (count - 1) - 1.0f; // -1 to 1
+    u->ratio[k] = exp2f(position * detune_cents / 1200.0f);
+    u->gain[k] = gain;
+    // alternate sides so neighbouring detunes do not bunch up on one side
+    u->pan[k] = (k & 1 ? -1.0f : 1.0f) * fabsf(position) * spread;
+    u->phase[k] = xorshift32(rng);
+  }
+}
+
+// polyblep sawtooth on four lanes, the same correction bandlimitedRipple
+// does for one oscillator
+static inline v4f sawV4(v4u phase, v4u inc) {
+  v4f p = v4f_from_u32(phase) * NCO_PHASE_SCALE;
+  v4f dt = v4f_from_u32(inc) * NCO_PHASE_SCALE;
+  v4f one = v4f_set1(1.0f);
+
+  v4f t0 = p / dt;
+  v4f start = (t0 + t0) - (t0 * t0) - one;
+  v4f t1 = (p - one) / dt;
+  v4f end = (t1 * t1) + (t1 + t1) + one;
+
+  v4f ripple = v4f_select(p < dt, start,
+                          v4f_select(p > one - dt, end, v4f_set1(0.0f)));
+  return (p + p) - one - ripple;
+}
+
+// shapes without a vector version go lane by lane through the scalar ones
+static inline v4f scalarV4(WaveShapeFn fn, v4u phase, v4u inc,
+                           float shape_parameter_0) {
+  Oscillator o = {.shape_parameter_0 = shape_parameter_0};
+  v4f out;
+  for (int l = 0; l < SIMD_WIDTH; l++) {
+    o.phase = phase[l] * NCO_PHASE_SCALE;
+    o.phase_dt = inc[l] * NCO_PHASE_SCALE;
+    out[l] = fn(o);
+  }
+  return out;
+}
+
+// every lane sample goes into each channel as one vector multiply and sum
+static inline void mixLanes(v4f x, const v4f *gain, int channels, float *out,
+                            size_t stride) {
+  for (int c = 0; c < channels; c++)
+    out[c * stride] += v4f_sum(x * gain[c]);
+}
+
+void unisonRender(Unison *u, ShapeId shape, float freq,
+                  float shape_parameter_0, int sample_rate,
+                  const float (*gains)[UNISON_MAX_VOICES], int channels,
+                  float *out, size_t stride, size_t n) {
+  WaveShapeFn fn = shapeFromId(shape);
+  int groups = (u->count + SIMD_WIDTH - 1) / SIMD_WIDTH;
+
+  for (int g = 0; g < groups; g++) {
+    int base = g * SIMD_WIDTH;
+    v4u phase = v4u_load(&u->phase[base]);
+    v4f gain[MAX_CHANNELS];
+    for (int c = 0; c < channels; c++)
+      gain[c] = v4f_load(&gains[c][base]);
+
+    // increments follow freq every block, so pitch changes reach all lanes
+    v4u inc;
+    for (int l = 0; l < SIMD_WIDTH; l++)
+      inc[l] = ncoPhaseIncrement(freq * u->ratio[base + l], sample_rate);
+
+    switch (shape) {
+    case SHAPE_SAWTOOTH:
+      for (size_t t = 0; t < n; t++) {
+        phase += inc;
+        mixLanes(sawV4(phase, inc), gain, channels, out + t, stride);
+      }
+      break;
+    case SHAPE_SINE:
+      for (size_t t = 0; t < n; t++) {
+        phase += inc;
+        mixLanes(ncoSineV4(phase), gain, channels, out + t, stride);
+      }
+      break;
+    default:
+      for (size_t t = 0; t < n; t++) {
+        phase += inc;
+        mixLanes(scalarV4(fn, phase, inc, shape_parameter_0), gain, channels,
+                 out + t, stride);
+      }
+      break;
+    }
+
+    v4u_store(&u->phase[base], phase);
+  }
+}
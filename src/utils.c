@@ -1,4 +1,8 @@
 #include "utils.h"
+#include "metrics.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <time.h>
 static LogLevel current_log_level = INFO;
 
@@ -40,4 +44,347 @@ void log_message_impl(LogLevel level, const char *file, int line,
 }
 
 void set_log_level(LogLevel level) { current_log_level = level; }
-LogLevel get_current_log_level(void) { return current_log_level; }
\ No newline at end of file
+LogLevel get_current_log_level(void) { return current_log_level; }
+
+// ----------------------------
+// asynchronous logging
+// ----------------------------
+
+static _Atomic(LogRing *) log_rings = NULL;
+static _Thread_local LogRing *thread_ring = NULL;
+// only serializes consumers (the log thread and log_flush), producers never
+// take it. consumers are also the only ones that unlink and free rings
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+// drops counted on rings that were freed since, under drain_lock
+static unsigned long dropped_freed = 0;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+// runs when a thread with a ring exits. what it logged is still to be
+// written, so the ring is only marked, the next drain frees it
+static void log_thread_exit(void *ring) {
+  atomic_store_explicit(&((LogRing *)ring)->dead, true, memory_order_release);
+  thread_ring = NULL;
+}
+
+static void make_ring_key(void) {
+  pthread_key_create(&ring_key, log_thread_exit);
+}
+
+// registers a ring for the calling thread. the one allocation happens here,
+// threads with real time constraints should call this before they start
+void log_thread_init(void) {
+  if (thread_ring)
+    return;
+
+  pthread_once(&ring_key_once, make_ring_key);
+  LogRing *r = calloc(1, sizeof(LogRing));
+  if (!r)
+    return;
+
+  LogRing *head = atomic_load(&log_rings);
+  do {
+    r->next = head;
+  } while (!atomic_compare_exchange_weak(&log_rings, &head, r));
+  thread_ring = r;
+  pthread_setspecific(ring_key, r);
+}
+
+void log_submit(LogLevel level, const char *file, int line, const char *format,
+                const LogArg *args, int nargs) {
+  if (level > current_log_level)
+    return;
+
+  if (!thread_ring) {
+    log_thread_init();
+    if (!thread_ring)
+      return;
+  }
+
+  LogRing *r = thread_ring;
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if (tail - head >= LOG_RING_ENTRIES) {
+    atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  LogEntry *e = &r->entries[tail & (LOG_RING_ENTRIES - 1)];
+  e->level = level;
+  e->file = file;
+  e->line = line;
+  e->format = format;
+  e->nargs = nargs < LOG_MAX_ARGS ? nargs : LOG_MAX_ARGS;
+  clock_gettime(CLOCK_REALTIME, &e->time);
+
+  // strings may not outlive the call, so their bytes are copied into the
+  // entry, truncated if they do not fit
+  size_t used = 0;
+  for (int i = 0; i < e->nargs; i++) {
+    e->args[i] = args[i];
+    if (args[i].type != LOG_ARG_STR)
+      continue;
+
+    const char *s = args[i].v.p ? args[i].v.p : "(null)";
+    if (used >= LOG_STR_BYTES) {
+      e->args[i].v.p = "";
+      continue;
+    }
+    char *dst = e->strings + used;
+    size_t len = strnlen(s, LOG_STR_BYTES - used - 1);
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+    e->args[i].v.p = dst;
+    used += len + 1;
+  }
+
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+  metrics_queue_depth(QUEUE_LOG, tail + 1 - head);
+}
+
+static long long log_arg_as_int(const LogArg *a) {
+  switch (a->type) {
+  case LOG_ARG_DOUBLE:
+    return (long long)a->v.d;
+  case LOG_ARG_PTR:
+  case LOG_ARG_STR:
+    return (long long)(intptr_t)a->v.p;
+  default:
+    return a->v.i;
+  }
+}
+
+static double log_arg_as_double(const LogArg *a) {
+  switch (a->type) {
+  case LOG_ARG_INT:
+    return (double)a->v.i;
+  case LOG_ARG_UINT:
+    return (double)a->v.u;
+  case LOG_ARG_DOUBLE:
+    return a->v.d;
+  default:
+    return 0.0;
+  }
+}
+
+// formats one conversion spec (flags, width, precision and length included)
+// with one stored argument, casting it to what the spec expects
+static int format_one(char *out, size_t size, const char *spec, char conv,
+                      const char *length, const LogArg *a) {
+  long long i = log_arg_as_int(a);
+
+  switch (conv) {
+  case 'd':
+  case 'i':
+    if (!strcmp(length, "l") || !strcmp(length, "z") || !strcmp(length, "t"))
+      return snprintf(out, size, spec, (long)i);
+    if (!strcmp(length, "ll") || !strcmp(length, "j"))
+      return snprintf(out, size, spec, i);
+    return snprintf(out, size, spec, (int)i);
+  case 'u':
+  case 'o':
+  case 'x':
+  case 'X':
+    if (!strcmp(length, "l") || !strcmp(length, "z") || !strcmp(length, "t"))
+      return snprintf(out, size, spec, (unsigned long)i);
+    if (!strcmp(length, "ll") || !strcmp(length, "j"))
+      return snprintf(out, size, spec, (unsigned long long)i);
+    return snprintf(out, size, spec, (unsigned int)i);
+  case 'c':
+    return snprintf(out, size, spec, (int)i);
+  case 'e':
+  case 'E':
+  case 'f':
+  case 'F':
+  case 'g':
+  case 'G':
+  case 'a':
+  case 'A':
+    if (!strcmp(length, "L"))
+      return snprintf(out, size, spec, (long double)log_arg_as_double(a));
+    return snprintf(out, size, spec, log_arg_as_double(a));
+  case 's':
+    return snprintf(out, size, spec,
+                    a->type == LOG_ARG_STR ? (const char *)a->v.p : "(?)");
+  case 'p':
+    return snprintf(out, size, spec, a->v.p);
+  }
+  return snprintf(out, size, "%s", spec);
+}
+
+// the printf subset the stored arguments can represent, '*' widths and %n
+// are not supported and are printed as is
+static void format_entry(char *out, size_t size, const LogEntry *e) {
+  const char *f = e->format;
+  size_t o = 0;
+  int arg = 0;
+
+  while (*f && o + 1 < size) {
+    if (*f != '%') {
+      out[o++] = *f++;
+      continue;
+    }
+    if (f[1] == '%') {
+      out[o++] = '%';
+      f += 2;
+      continue;
+    }
+
+    const char *start = f++;
+    while (*f && strchr("-+ #0", *f))
+      f++;
+    while (*f >= '0' && *f <= '9')
+      f++;
+    if (*f == '.') {
+      f++;
+      while (*f >= '0' && *f <= '9')
+        f++;
+    }
+    const char *len_start = f;
+    while (*f && strchr("hlLqjzt", *f))
+      f++;
+
+    char length[4] = {0};
+    size_t len_bytes = f - len_start;
+    memcpy(length, len_start, len_bytes < 3 ? len_bytes : 3);
+
+    char conv = *f;
+    if (conv)
+      f++;
+
+    char spec[32];
+    size_t spec_len = f - start;
+    if (spec_len >= sizeof(spec))
+      spec_len = sizeof(spec) - 1;
+    memcpy(spec, start, spec_len);
+    spec[spec_len] = '\0';
+
+    if (arg >= e->nargs) {
+      o += snprintf(out + o, size - o, "%s", spec);
+    } else {
+      o += format_one(out + o, size - o, spec, conv, length, &e->args[arg++]);
+    }
+    if (o >= size)
+      o = size - 1;
+  }
+  out[o] = '\0';
+}
+
+static void write_entry(const LogEntry *e) {
+  char message[1024];
+  format_entry(message, sizeof(message), e);
+
+  char time_str[100];
+  struct tm local_time;
+  localtime_r(&e->time.tv_sec, &local_time);
+  strftime(time_str, sizeof(time_str), "[%a %b %d %H:%M:%S %Z %Y]",
+           &local_time);
+
+  printf("%s %s%s:%d: %s\n", time_str, log_lvl_to_str(e->level), e->file,
+         e->line, message);
+}
+
+// takes r out of the list. producers only ever push a new head, so a ring
+// further down is unlinked in place, the head only if no push raced it.
+// caller holds drain_lock
+static bool unlink_ring(LogRing *prev, LogRing *r) {
+  if (prev) {
+    prev->next = r->next;
+    return true;
+  }
+  LogRing *expected = r;
+  return atomic_compare_exchange_strong(&log_rings, &expected, r->next);
+}
+
+// drains every ring and frees those of exited threads, returns the number of
+// entries written. caller holds drain_lock
+static size_t drain_rings_locked(void) {
+  size_t written = 0;
+
+  LogRing *prev = NULL, *next;
+  for (LogRing *r = atomic_load(&log_rings); r; r = next) {
+    next = r->next;
+    // read before the tail, a dead ring's last entries are then all in
+    bool dead = atomic_load_explicit(&r->dead, memory_order_acquire);
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    for (; head != tail; head++) {
+      write_entry(&r->entries[head & (LOG_RING_ENTRIES - 1)]);
+      atomic_store_explicit(&r->head, head + 1, memory_order_release);
+      written++;
+    }
+
+    unsigned long dropped =
+        atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    if (dropped != r->dropped_reported) {
+      printf("[WARNING] log ring full, dropped %lu messages\n",
+             dropped - r->dropped_reported);
+      r->dropped_reported = dropped;
+    }
+
+    if (dead && unlink_ring(prev, r)) {
+      dropped_freed += dropped;
+      free(r);
+    } else {
+      prev = r;
+    }
+  }
+  if (written)
+    fflush(stdout);
+
+  return written;
+}
+
+static size_t drain_rings(void) {
+  pthread_mutex_lock(&drain_lock);
+  size_t written = drain_rings_locked();
+  pthread_mutex_unlock(&drain_lock);
+  return written;
+}
+
+void log_flush(void) { drain_rings(); }
+
+// last flush at exit, the lock is kept so the log thread cannot write
+// concurrently with the final stdio flush
+static void log_shutdown(void) {
+  pthread_mutex_lock(&drain_lock);
+  drain_rings_locked();
+}
+
+// holds drain_lock so no ring is freed under it
+unsigned long log_dropped_total(void) {
+  pthread_mutex_lock(&drain_lock);
+  unsigned long total = dropped_freed;
+  for (LogRing *r = atomic_load(&log_rings); r; r = r->next)
+    total += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+  pthread_mutex_unlock(&drain_lock);
+  return total;
+}
+
+static void *log_thread(void *arg) {
+  (void)arg;
+  log_thread_init();
+
+  struct timespec idle = {.tv_sec = 0, .tv_nsec = 5 * 1000 * 1000};
+  while (1) {
+    if (!drain_rings())
+      nanosleep(&idle, NULL);
+  }
+  return NULL;
+}
+
+// starts the background writer, anything logged before this is kept in the
+// rings and written once it runs. pending messages are flushed at exit
+void log_start(void) {
+  static bool started = false;
+  if (started)
+    return;
+  started = true;
+
+  atexit(log_shutdown);
+
+  pthread_t t;
+  pthread_create(&t, NULL, log_thread, NULL);
+  pthread_detach(t);
+}
@@ -0,0 +1,124 @@
+#include "waveguide.h"
+#include "oscillator.h"
+#include <math.h>
+#include <string.h>
+
+void waveguideInit(Waveguide *w, float *slot) {
+  memset(w, 0, sizeof(*w));
+  w->ring = slot + WAVEGUIDE_GUARD;
+}
+
+// the loop is a whole sample delay, a linear interpolation for the fraction
+// and the two tap lowpass, folded into three taps on the ring. the lowpass
+// adds damping samples of delay, which is taken off the ring delay
+static void waveguideRetune(Waveguide *w, float freq, int sample_rate) {
+  float length = sample_rate / freq - w->damping;
+  if (length < SIMD_WIDTH)
+    length = SIMD_WIDTH;
+  if (length > WAVEGUIDE_RING - 4)
+    length = WAVEGUIDE_RING - 4;
+
+  w->delay = (int)length;
+  float frac = length - w->delay;
+  float d = w->damping;
+  // loop gain that takes decay seconds to fall by 60 dB
+  float gain = w->decay > 0.0f ? powf(0.001f, 1.0f / (w->decay * freq)) : 0.0f;
+  w->taps[0] = gain * (1.0f - d) * (1.0f - frac);
+  w->taps[1] = gain * ((1.0f - d) * frac + d * (1.0f - frac));
+  w->taps[2] = gain * d * frac;
+  w->freq = freq;
+}
+
+void waveguideStart(Waveguide *w, float freq, int sample_rate, float decay,
+                    float brightness, float position, uint32_t *rng) {
+  if (brightness < 0.0f)
+    brightness = 0.0f;
+  if (brightness > 1.0f)
+    brightness = 1.0f;
+  w->damping = 0.5f * (1.0f - brightness);
+  w->decay = decay;
+  waveguideRetune(w, freq, sample_rate);
+
+  // the burst fills the delay + 2 samples the taps read, written as the
+  // past outputs of a ring that starts at 0
+  int len = w->delay + 2;
+  float *burst = w->ring + WAVEGUIDE_RING - len;
+  for (int i = 0; i < len; i++)
+    burst[i] = (xorshift32(rng) >> 8) * (2.0f / (1 << 24)) - 1.0f;
+
+  // plucking at position p cancels the harmonics with a node there, a comb
+  // on the burst. the mean is removed, a dc offset would ring for decay
+  int pick = (int)(position * len);
+  if (pick > 0 && pick < len)
+    for (int i = len - 1; i >= pick; i--)
+      burst[i] -= burst[i - pick];
+  float mean = 0.0f;
+  for (int i = 0; i < len; i++)
+    mean += burst[i];
+  mean /= len;
+  float peak = 1e-6f;
+  for (int i = 0; i < len; i++) {
+    burst[i] -= mean;
+    peak = fmaxf(peak, fabsf(burst[i]));
+  }
+  for (int i = 0; i < len; i++)
+    burst[i] /= peak;
+
+  w->ring[-2] = w->ring[WAVEGUIDE_RING - 2];
+  w->ring[-1] = w->ring[WAVEGUIDE_RING - 1];
+  w->write = 0;
+  w->active = 1;
+}
+
+// keeps a decayed string from sinking into denormals, which are a hundred
+// times slower without ftz. it settles to a dc level far below hearing
+#define WAVEGUIDE_DENORMAL_BIAS 1e-20f
+
+// every output sample depends only on samples at least delay old, so runs
+// of up to delay samples are independent and go four at a time. a run also
+// stops at the end of the ring, the two taps behind the start of the ring
+// read the mirrored guard
+void waveguideRender(Waveguide *w, float freq, int sample_rate, float *out,
+                     size_t n) {
+  if (freq != w->freq)
+    waveguideRetune(w, freq, sample_rate);
+
+  float *ring = w->ring;
+  v4f t0 = v4f_set1(w->taps[0]);
+  v4f t1 = v4f_set1(w->taps[1]);
+  v4f t2 = v4f_set1(w->taps[2]);
+  v4f bias = v4f_set1(WAVEGUIDE_DENORMAL_BIAS);
+
+  size_t t = 0;
+  while (t < n) {
+    int wp = w->write;
+    int rp = (wp - w->delay) & WAVEGUIDE_MASK;
+    size_t run = n - t;
+    if (run > (size_t)w->delay)
+      run = w->delay;
+    if (run > (size_t)(WAVEGUIDE_RING - wp))
+      run = WAVEGUIDE_RING - wp;
+    if (run > (size_t)(WAVEGUIDE_RING - rp))
+      run = WAVEGUIDE_RING - rp;
+
+    const float *r = ring + rp;
+    float *y = ring + wp;
+    size_t i = 0;
+    for (; i + SIMD_WIDTH <= run; i += SIMD_WIDTH) {
+      v4f v = t0 * v4f_load(r + i) + t1 * v4f_load(r + i - 1) +
+              t2 * v4f_load(r + i - 2) + bias;
+      v4f_store(y + i, v);
+      v4f_store(out + t + i, v);
+    }
+    for (; i < run; i++) {
+      y[i] = w->taps[0] * r[i] + w->taps[1] * r[i - 1] +
+             w->taps[2] * r[i - 2] + WAVEGUIDE_DENORMAL_BIAS;
+      out[t + i] = y[i];
+    }
+
+    ring[-2] = ring[WAVEGUIDE_RING - 2];
+    ring[-1] = ring[WAVEGUIDE_RING - 1];
+    w->write = (wp + run) & WAVEGUIDE_MASK;
+    t += run;
+  }
+}
@@ -1,127 +1,158 @@
 #include "yaml.h"
 #include "stdio.h"
+#include "stdlib.h"
 #include "string.h"
-
-hash_t * yaml_read(char *file) {
-  printf("file %s\n", file);
-  char* this_line;
-  char* next_line;
-  char tmp[256];
-  char tmp2[256];
-  FILE *f = fopen(file, "r");
-
-  if (f == NULL) {
-    perror(file);
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct yaml_level {
+  int indent;
+  const char *key; // full dotted key, in the arena
+  size_t key_len;
+  int array_index; // next "- " element under this key
+} yaml_level_t;
+
+// builds parent.segment in the arena
+static char *join_key(arena_t *a, const yaml_level_t *parent,
+                      const char *segment, size_t len, size_t *out_len) {
+  size_t plen = parent ? parent->key_len : 0;
+  size_t total = plen + (plen ? 1 : 0) + len;
+  char *key = arena_alloc(a, total + 1);
+  if (!key)
     return NULL;
+
+  if (plen) {
+    memcpy(key, parent->key, plen);
+    key[plen] = '.';
   }
+  memcpy(key + total - len, segment, len);
+  key[total] = '\0';
+  *out_len = total;
+  return key;
+}
+
+static void parse(yaml_doc_t *doc, const char *p, const char *end) {
+  yaml_level_t stack[YAML_MAX_DEPTH];
+  int depth = 0;
 
-  hash_t *current_hash = hash_new();
-  char key[256];
-  strcpy(key, "");
-  int previous_indent = 0;
-  int arrayIndex = 0;
-  size_t len;
-  while ((this_line = fgets(tmp2, 256, f))) {
-    tmp[0] = '\0';
+  while (p < end) {
+    const char *line_end = memchr(p, '\n', end - p);
+    if (!line_end)
+      line_end = end;
+    const char *next = line_end + 1;
 
-    // compute the indentation level
     int indent = 0;
-    int p;
-    for (p = 0; p < strlen(this_line); p++) {
-      if (this_line[p] != ' ') {
-        break;
-      } else {
-        indent++;
-      }
+    while (p < line_end && *p == ' ') {
+      p++;
+      indent++;
     }
 
-    // ignore full-line comments
-    if (this_line[p] == '#') {
+    // blank lines and full-line comments
+    if (p == line_end || *p == '#' || *p == '\r') {
+      p = next;
       continue;
     }
 
-    // rewind the key to the current indentation level
-    int indentsFound = 0;
-    for (p = 0; p < strlen(key); p++) {
-      if (indentsFound == indent) {
-        key[p] = '\0';
-        break;
-      }
-      if (key[p] == '.') {
-        indentsFound += 2;
-      }
-    }
-
-    // ensure keys don't start with "." or have double dots ".."
-    if (key[0] != '\0' && key[strlen(key) - 1] != '.') {
-      strcat(key, ".");
-    }
-
-    // get the current key
-    if (this_line[indent] == '-') {
-      // array element
-      sprintf(tmp, "%i", arrayIndex);
-      strcat(key, tmp);
-      arrayIndex++;
-      p = indent;
+    // rewind to the parent of this indentation level
+    while (depth > 0 && stack[depth - 1].indent >= indent)
+      depth--;
+    yaml_level_t *parent = depth ? &stack[depth - 1] : NULL;
+
+    const char *segment;
+    size_t segment_len;
+    char index_buf[16];
+
+    if (*p == '-') {
+      // array element, keyed by its position under the parent
+      int index = parent ? parent->array_index++ : 0;
+      segment_len = snprintf(index_buf, sizeof(index_buf), "%d", index);
+      segment = index_buf;
+      p++;
     } else {
-      arrayIndex = 0;
-
-      for (p = indent; p < strlen(this_line); p++) {
-        if (this_line[p] == ':') {
-          break;
-        } else {
-          len = strlen(key);
-          key[len] = this_line[p];
-          key[len + 1] = '\0';
-        }
-      }
+      segment = p;
+      while (p < line_end && *p != ':')
+        p++;
+      segment_len = p - segment;
+      if (p < line_end)
+        p++;
     }
 
-    int i = 0;
-    p += 2; // scan past ": " or "- "
-
-    int comment_start = -1;
-
-    for (; p < strlen(this_line); p++) {
-      if (this_line[p] == '#') {
-        comment_start = p;
-        break;
-      } else if (this_line[p] == '\n') {
-        tmp[i] = '\0';
-        break;
-      } else {
-        tmp[i] = this_line[p];
-        i++;
-      }
+    // value runs up to a comment or the end of the line, trimmed both sides
+    while (p < line_end && *p == ' ')
+      p++;
+    const char *value = p;
+    while (p < line_end && *p != '#')
+      p++;
+    const char *value_end = p;
+    while (value_end > value &&
+           (value_end[-1] == ' ' || value_end[-1] == '\r'))
+      value_end--;
+
+    size_t key_len;
+    char *key = join_key(&doc->arena, parent, segment, segment_len, &key_len);
+    if (!key)
+      return;
+
+    if (value_end > value) {
+      char *val = arena_strndup(&doc->arena, value, value_end - value);
+      if (!val)
+        return;
+      hash_set(doc->hash, key, val);
+    } else if (depth < YAML_MAX_DEPTH) {
+      // no value, this key is a section for the lines below it
+      stack[depth++] = (yaml_level_t){.indent = indent,
+                                      .key = key,
+                                      .key_len = key_len,
+                                      .array_index = 0};
     }
 
-    if (comment_start != -1) {
-      // trim trailing spaces from the value before the comment
-      i--;
-      while (i >= 0 && tmp[i] == ' ') {
-        tmp[i] = '\0';
-        i--;
-      }
-    }
-
-    if (0) {
-      printf("line length: %zu", strlen(this_line));
-      printf(", indents: %i", indent);
-      printf(", key: %s", key);
-      printf(", value: '%s'", tmp);
-    }
+    p = next;
+  }
+}
 
-    char *hashkey = malloc(sizeof(char) * (strlen(key) + 1));
-    strcpy(hashkey, key);
+yaml_doc_t *yaml_read(const char *file) {
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    perror(file);
+    return NULL;
+  }
 
-    char *hashval = malloc(sizeof(char) * (strlen(tmp) + 1));
-    strcpy(hashval, tmp);
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror(file);
+    close(fd);
+    return NULL;
+  }
 
-    if (strcmp(tmp, "") != 0) {
-      hash_set(current_hash, hashkey, hashval);
+  yaml_doc_t *doc = calloc(1, sizeof(yaml_doc_t));
+  if (!doc) {
+    close(fd);
+    return NULL;
+  }
+  doc->hash = hash_new();
+
+  if (st.st_size > 0) {
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      perror(file);
+      close(fd);
+      yaml_free(doc);
+      return NULL;
     }
+    parse(doc, data, data + st.st_size);
+    munmap((void *)data, st.st_size);
   }
-  fclose(f);
-  return current_hash;
+
+  close(fd);
+  return doc;
+}
+
+void yaml_free(yaml_doc_t *doc) {
+  if (!doc)
+    return;
+  hash_free(doc->hash);
+  arena_free(&doc->arena);
+  free(doc);
 }
@@ -3,6 +3,7 @@ namespace eval networking {
     variable server_address "localhost"
     variable server_port 5000
     variable sock ""
+    variable inbuf ""
     array set key_states {}
 
     set debounce_time 100
@@ -35,7 +36,7 @@ namespace eval networking {
         set sock [try_connect $server_address $server_port]
 
         if {$sock ne ""} {
-            fconfigure $sock -blocking 0
+            fconfigure $sock -blocking 0 -translation binary
             ${log}::notice "connection successful, socket configured as non-blocking."
         } else {
             ${log}::error "Failed to connect."
@@ -110,28 +111,45 @@ namespace eval networking {
     # ----------------------------
     # receiving data
     # ----------------------------
+    # frames of a type byte, a 32 bit big endian length and the payload:
+    # type 0 is scope samples as int8, type 1 the text reply to a command
     proc receive_data {} {
         variable sock
+        variable inbuf
         global log
+        global signal_data
+
+        append inbuf [read $sock]
         if {[eof $sock]} {
             close $sock
+            set inbuf ""
             ${log}::notice "connection closed by server."
             networking::connect
+            return
         }
 
-        global signal_data
-        set signal_data {}
-
-        set data [read $sock 256]
-
-        set bytes_read [string length $data]
-        
-        for {set i 0} {$i < $bytes_read} {incr i} {
-            binary scan [string index $data $i] c int8_value
-            lappend signal_data $int8_value
+        set scope 0
+        while {[string length $inbuf] >= 5} {
+            binary scan $inbuf cuIu type length
+            if {[string length $inbuf] < 5 + $length} {
+                break
+            }
+            set payload [string range $inbuf 5 [expr {4 + $length}]]
+            set inbuf [string range $inbuf [expr {5 + $length}] end]
+            switch -- $type {
+                0 {
+                    binary scan $payload c* signal_data
+                    set scope 1
+                }
+                1 {
+                    ${log}::notice [string trimright $payload]
+                }
+            }
         }
 
-        update_waveform
+        if {$scope} {
+            update_waveform
+        }
     }
 
 
@@ -0,0 +1,151 @@
+// test reader for the shm backend: maps the ring read only, follows the
+// writer and prints a line per second with the level and any lost frames
+//
+//   tinysynth --backend shm:/tinysynth
+//   shm_reader [-n /tinysynth] [-s seconds] [-o out.f32]
+
+#include "shmring.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static shm_ring_header_t *attach(const char *name, size_t *size) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    perror(name);
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < SHM_RING_DATA_OFFSET) {
+    fprintf(stderr, "%s: too small for a ring\n", name);
+    close(fd);
+    return NULL;
+  }
+  shm_ring_header_t *h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+
+  if (h->magic != SHM_RING_MAGIC || h->version != SHM_RING_VERSION ||
+      shm_ring_size(h->capacity, h->channels) > (size_t)st.st_size) {
+    fprintf(stderr, "%s: not a tinysynth ring\n", name);
+    munmap(h, st.st_size);
+    return NULL;
+  }
+  *size = st.st_size;
+  return h;
+}
+
+int main(int argc, char **argv) {
+  const char *name = SHM_RING_DEFAULT_NAME;
+  const char *out_path = NULL;
+  double seconds = 0; // until interrupted
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:o:")) != -1) {
+    switch (opt) {
+    case 'n':
+      name = optarg;
+      break;
+    case 's':
+      seconds = atof(optarg);
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n name] [-s seconds] [-o out.f32]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  size_t size;
+  shm_ring_header_t *h = attach(name, &size);
+  if (!h)
+    return 1;
+
+  FILE *out = out_path ? fopen(out_path, "wb") : NULL;
+  if (out_path && !out) {
+    perror(out_path);
+    return 1;
+  }
+
+  const float *data = shm_ring_data(h);
+  uint32_t channels = h->channels;
+  printf("%s: %u Hz, %u channel(s), %u frame ring, %u frame blocks\n", name,
+         h->sample_rate, channels, h->capacity, h->block_frames);
+
+  // start at the newest frame, nothing before attaching is of interest
+  uint64_t pos = atomic_load_explicit(&h->write_pos, memory_order_acquire);
+  uint64_t total = 0, lost = 0, second_frames = 0, second_lost = 0;
+  double sum_sq = 0;
+  float peak = 0;
+  uint64_t limit = seconds > 0 ? (uint64_t)(seconds * h->sample_rate) : 0;
+  struct timespec idle = {0, 1000000};
+
+  while (!limit || total < limit) {
+    uint64_t end = atomic_load_explicit(&h->write_pos, memory_order_acquire);
+    if (end == pos) {
+      nanosleep(&idle, NULL);
+      continue;
+    }
+
+    // lapped, skip to the oldest frame still in the ring
+    if (end - pos > h->capacity) {
+      second_lost += end - h->capacity - pos;
+      pos = end - h->capacity;
+    }
+
+    uint64_t from = pos;
+    for (; pos < end; pos++) {
+      const float *frame = data + shm_ring_index(h, pos) * channels;
+      for (uint32_t c = 0; c < channels; c++) {
+        float v = frame[c];
+        sum_sq += (double)v * v;
+        if (fabsf(v) > peak)
+          peak = fabsf(v);
+      }
+      if (out)
+        fwrite(frame, sizeof(float), channels, out);
+      second_frames++;
+    }
+
+    // the writer may have overwritten the oldest of what was just read
+    if (!shm_ring_valid(h, from)) {
+      uint64_t now = atomic_load_explicit(&h->write_pos, memory_order_relaxed);
+      second_lost += now - h->capacity - from;
+    }
+
+    if (second_frames >= h->sample_rate) {
+      double rms = sqrt(sum_sq / (second_frames * channels));
+      printf("%llu frames  peak %6.1f dBFS  rms %6.1f dBFS  lost %llu\n",
+             (unsigned long long)second_frames,
+             20 * log10(peak + 1e-12), 20 * log10(rms + 1e-12),
+             (unsigned long long)second_lost);
+      fflush(stdout);
+      total += second_frames;
+      lost += second_lost;
+      second_frames = second_lost = 0;
+      sum_sq = 0;
+      peak = 0;
+    }
+  }
+
+  printf("read %llu frames, lost %llu\n", (unsigned long long)total,
+         (unsigned long long)lost);
+  if (out)
+    fclose(out);
+  munmap(h, size);
+  return lost ? 2 : 0;
+}